@@ -1,17 +1,61 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <fnmatch.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/elements.h"
+#include "common/reachability.h"
+
+// Options of the plugin, from its `-plugin-arg-instrument` arguments
 struct Config {
-  int foo;
+  typedef instr::FunctionElement::Level Level;
+
+  // Count the block edges inline in `__coverage_edge_map` instead of calling
+  // `__coverage_reach_block`. Only the edge map trace mode sees them.
+  bool inline_counters = false;
+
+  // Report the operands of the integer comparisons to `__coverage_cmp`
+  bool cmp_log = false;
 
-  Config(){}
-  Config(const Config& c){
-    foo = c.foo;
+  // Computed from the models of a previous run: only the functions and the
+  // blocks that can reach a goal are instrumented. Null to instrument all.
+  std::shared_ptr<const instr::GoalReachability> goals;
+
+  // Instrumentation level of the translation unit, and of the functions
+  // whose qualified name matches a pattern (the last match wins)
+  Level level = instr::FunctionElement::L_EDGE;
+  std::vector<std::pair<std::string, Level>> level_patterns;
+
+  Config() {}
+  Config(const Config &c) {
+    inline_counters = c.inline_counters;
+    cmp_log = c.cmp_log;
+    goals = c.goals;
+    level = c.level;
+    level_patterns = c.level_patterns;
   }
-  Config& operator=(const Config& c) {
+  Config &operator=(const Config &c) {
+    inline_counters = c.inline_counters;
+    cmp_log = c.cmp_log;
+    goals = c.goals;
+    level = c.level;
+    level_patterns = c.level_patterns;
     return *this;
   }
-};
 
+  Level levelFor(const std::string &name) const {
+    Level result = level;
+    for (auto &pattern : level_patterns) {
+      if (fnmatch(pattern.first.c_str(), name.c_str(), 0) == 0)
+        result = pattern.second;
+    }
+    return result;
+  }
+};
 
 #endif
@@ -13,6 +13,7 @@ using namespace clang;
 #include "config.h"
 #include "instr-ast-consumer.h"
 #include "instrument.h"
+#include "shared-data/edge-map.h"
 
 #include <iostream>
 #include <sstream>
@@ -30,7 +31,37 @@ void InstrASTConsumer::writeExterns() {
                      "unsigned int, const unsigned int);"
           << '\n' << "extern void __coverage_enter_func(const unsigned long);"
           << '\n' << "extern void __coverage_exit_func(const unsigned long);" << '\n'
-          << "extern void __coverage_kill(const unsigned long);" << '\n';
+          << "extern void __coverage_kill(const unsigned long);" << '\n'
+          << "extern void __coverage_cmp(const unsigned long, const unsigned "
+             "int, const unsigned long long, const unsigned long long, const "
+             "unsigned int);"
+          << '\n'
+          << "extern void __coverage_fork_here();" << '\n';
+
+  // `shm::edge_index` and `shm::skip_edge_index`, folded by the compiler for
+  // the constant ids. The hits saturate at 0xff like in the runtime, and a
+  // not-taken branch only counts once.
+  if (config.inline_counters) {
+    *output << "extern unsigned char *__coverage_edge_map;" << '\n'
+            << "static inline __attribute__((always_inline)) void "
+               "__coverage_count_edge(const unsigned int func_id, const "
+               "unsigned int pred_block_id, const unsigned int cur_block_id) {"
+            << " const unsigned int h = (func_id * " << EDGE_HASH_FUNC
+            << "u) ^ (pred_block_id * " << EDGE_HASH_PRED
+            << "u) ^ (cur_block_id * " << EDGE_HASH_CUR << "u);"
+            << " unsigned char *hits = __coverage_edge_map + ((h ^ (h >> "
+            << EDGE_MAP_SIZE_POW2 << ")) & " << (EDGE_MAP_SIZE - 1) << "u);"
+            << " *hits += *hits != 0xff; }" << '\n'
+            << "static inline __attribute__((always_inline)) void "
+               "__coverage_count_skip(const unsigned int func_id, const "
+               "unsigned int pred_block_id, const unsigned int cur_block_id) {"
+            << " const unsigned int h = (func_id * " << EDGE_HASH_FUNC
+            << "u) ^ (pred_block_id * " << EDGE_HASH_PRED
+            << "u) ^ (~cur_block_id * " << EDGE_HASH_CUR << "u);"
+            << " unsigned char *hits = __coverage_edge_map + ((h ^ (h >> "
+            << EDGE_MAP_SIZE_POW2 << ")) & " << (EDGE_MAP_SIZE - 1) << "u);"
+            << " if (!*hits) *hits = 1; }" << '\n';
+  }
 }
 
 void InstrASTConsumer::createDependencies() {
@@ -72,7 +103,7 @@ void InstrASTConsumer::HandleTranslationUnit(ASTContext &context) {
             << SM->getFileEntryForID(mainFileID)->getName();
 
   InstrumentationVisitor instrumenter(context, SM, mainFileID, &rewrite, store,
-                                      source_id, analysis);
+                                      source_id, analysis, config);
 
   instrumenter.TraverseDecl(context.getTranslationUnitDecl());
 
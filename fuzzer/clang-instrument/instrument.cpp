@@ -16,8 +16,10 @@ using namespace clang;
 #include "common/logger.h"
 #include "instrument.h"
 
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -32,6 +34,19 @@ bool InstrumentationVisitor::shouldInstrumentFunctionDecl(
   return FD->hasBody();
 }
 
+bool InstrumentationVisitor::shouldInstrumentFunction(
+    const std::string &name) {
+  return !config.goals || config.goals->reaches(name);
+}
+
+bool InstrumentationVisitor::shouldInstrumentBlock(
+    const unsigned int block_id) {
+  if (!config.goals)
+    return true;
+  const std::set<uint32_t> *goal_blocks = cfg_stack.goal_blocks();
+  return goal_blocks && goal_blocks->find(block_id) != goal_blocks->end();
+}
+
 bool InstrumentationVisitor::isInMainFile(const FileID &funcFileID) {
   return mainFileID == funcFileID;
 }
@@ -55,6 +70,7 @@ bool InstrumentationVisitor::HandleStmt(Stmt *stmt) {
 
   if (isa<ForStmt>(stmt)) {
     ForStmt *forStmt = cast<ForStmt>(stmt);
+    InsertCmpDirectives(forStmt->getCond(), findBlockIdForStmt(stmt));
     Stmt *body = forStmt->getBody();
     EnsureBracesControlStmt(body);
     InsertBlockDirective(body, findBlockIdForStmt(body));
@@ -65,28 +81,33 @@ bool InstrumentationVisitor::HandleStmt(Stmt *stmt) {
     InsertBlockDirective(body, findBlockIdForStmt(body));
   } else if (isa<WhileStmt>(stmt)) {
     WhileStmt *whileStmt = cast<WhileStmt>(stmt);
+    InsertCmpDirectives(whileStmt->getCond(), findBlockIdForStmt(stmt));
     Stmt *body = whileStmt->getBody();
     EnsureBracesControlStmt(body);
     InsertBlockDirective(body, findBlockIdForStmt(body));
   } else if (isa<DoStmt>(stmt)) {
     DoStmt *doStmt = cast<DoStmt>(stmt);
+    InsertCmpDirectives(doStmt->getCond(), findBlockIdForStmt(stmt));
     Stmt *body = doStmt->getBody();
     EnsureBracesControlStmt(body);
     InsertBlockDirective(body, findBlockIdForStmt(body));
   } else if (isa<IfStmt>(stmt)) {
     // get both branches
     IfStmt *ifStmt = cast<IfStmt>(stmt);
+    InsertCmpDirectives(ifStmt->getCond(), findBlockIdForStmt(stmt));
     Stmt *thenStmt = ifStmt->getThen();
+    Stmt *elseStmt = ifStmt->getElse();
+    if (!elseStmt) {
+      // add an else stmt with a __coverage_skip_block(...), before the braces
+      // so it follows them
+      InsertSkippedBlockDirective(ifStmt);
+    }
     EnsureBracesControlStmt(thenStmt);
     InsertBlockDirective(thenStmt, findBlockIdForStmt(thenStmt));
 
-    Stmt *elseStmt = ifStmt->getElse();
     if (elseStmt) {
       EnsureBracesControlStmt(elseStmt);
       InsertBlockDirective(elseStmt, findBlockIdForStmt(elseStmt));
-    } else {
-      // add an else stmt with a __coverage_skip_block(...)
-      InsertSkippedBlockDirective(ifStmt);
     }
   } else if (isa<SwitchStmt>(stmt)) {
     SwitchStmt *switchStmt = cast<SwitchStmt>(stmt);
@@ -148,44 +169,309 @@ void InstrumentationVisitor::EnsureBracesControlStmt(Stmt *stmt) {
 }
 
 void InstrumentationVisitor::InsertSkippedBlockDirective(IfStmt *ifStmt) {
-  return;
+  if (ifStmt->getElse() || cfg_stack.level() != FunctionElement::L_EDGE)
+    return;
+
+  Stmt *thenStmt = ifStmt->getThen();
+  const unsigned int block_id = findBlockIdForStmt(thenStmt);
+  if (!shouldInstrumentBlock(block_id))
+    return;
 
-  if (ifStmt->getElse())
+  // The control flow joins after the if, `__coverage_pred_block` is left as
+  // it is
+  std::ostringstream oss;
+  oss << " else {"
+      << (config.inline_counters ? " __coverage_count_skip("
+                                 : " __coverage_skip_block(")
+      << cfg_stack.id() << ", __coverage_pred_block, " << block_id << "); }";
+
+  SourceLocation end = thenStmt->getLocEnd();
+  if (isa<CompoundStmt>(thenStmt)) {
+    rewrite->InsertTextAfterToken(expand_loc(end), oss.str());
     return;
+  }
 
-  SourceLocation end = ifStmt->getLocEnd();
+  // Where `EnsureBracesControlStmt` adds the '}', which is inserted in front
+  // of this one. An enclosing if without braces ends at the same place, and
+  // its text was inserted before: it stays after ours.
   int offset = Lexer::MeasureTokenLength(end, rewrite->getSourceMgr(),
                                          rewrite->getLangOpts()) +
                1;
   SourceLocation adapted_end = end.getLocWithOffset(offset);
-
-  unsigned int block_id = findBlockIdForStmt(ifStmt->getThen());
-  if (block_id < 1) {
-    block_id = 0;
-  }
-
-  std::ostringstream oss;
-  oss << "else { __coverage_skip_block(" << cfg_stack.id() << ", __coverage_pred_block, "
-      << block_id << "); __coverage_pred_block = " << block_id << "; } ";
-
   rewrite->InsertTextBefore(expand_loc(adapted_end), oss.str());
 }
 
 void InstrumentationVisitor::InsertBlockDirective(const Stmt *S,
                                                   const unsigned int block_id) {
+  if (cfg_stack.level() == FunctionElement::L_FUNCTION ||
+      !shouldInstrumentBlock(block_id))
+    return;
+
   SourceLocation start = S->getLocStart();
   if (isa<CompoundStmt>(S)) {
     LOG(INFO) << "Compound, old location = " << start.printToString(*SM);
     start = start.getLocWithOffset(1);
   }
 
+  // Without the edges, there is no predecessor to keep track of
   std::ostringstream oss;
-  oss << " __coverage_reach_block(" << cfg_stack.id() << ", __coverage_pred_block, "
-      << block_id << "); __coverage_pred_block = " << block_id << "; ";
+  oss << (config.inline_counters ? " __coverage_count_edge("
+                                 : " __coverage_reach_block(")
+      << cfg_stack.id();
+  if (cfg_stack.level() == FunctionElement::L_BLOCK) {
+    oss << ", 0, " << block_id << "); ";
+  } else {
+    oss << ", __coverage_pred_block, " << block_id
+        << "); __coverage_pred_block = " << block_id << "; ";
+  }
 
   rewrite->InsertText(expand_loc(start), oss.str());
 }
 
+void InstrumentationVisitor::InsertCmpDirectives(Expr *cond,
+                                                 const unsigned int block_id) {
+  if (!cond || !config.cmp_log ||
+      cfg_stack.level() == FunctionElement::L_FUNCTION)
+    return;
+  cond = cond->IgnoreParenImpCasts();
+
+  // Only follow the boolean structure of the condition
+  if (UnaryOperator *UO = dyn_cast<UnaryOperator>(cond)) {
+    if (UO->getOpcode() == UO_LNot)
+      InsertCmpDirectives(UO->getSubExpr(), block_id);
+    return;
+  }
+  BinaryOperator *BO = dyn_cast<BinaryOperator>(cond);
+  if (!BO)
+    return;
+  if (BO->isLogicalOp()) {
+    InsertCmpDirectives(BO->getLHS(), block_id);
+    InsertCmpDirectives(BO->getRHS(), block_id);
+    return;
+  }
+
+  const unsigned int width = getCmpWidth(BO);
+  if (!width)
+    return;
+
+  const LangOptions &LO = rewrite->getLangOpts();
+  const std::string lhs = Lexer::getSourceText(
+      CharSourceRange::getTokenRange(BO->getLHS()->getSourceRange()), *SM, LO);
+  const std::string rhs = Lexer::getSourceText(
+      CharSourceRange::getTokenRange(BO->getRHS()->getSourceRange()), *SM, LO);
+  if (lhs.empty() || rhs.empty())
+    return;
+
+  // The operands are evaluated twice, which is why they can't have side
+  // effects
+  std::ostringstream oss;
+  oss << "(__coverage_cmp(" << cfg_stack.id() << ", " << block_id
+      << ", (unsigned long long)(" << lhs << "), (unsigned long long)(" << rhs
+      << "), " << width << "), ";
+  rewrite->InsertTextBefore(BO->getLocStart(), oss.str());
+  rewrite->InsertTextAfterToken(BO->getLocEnd(), ")");
+}
+
+unsigned int InstrumentationVisitor::getCmpWidth(const BinaryOperator *BO) {
+  if (!BO->isComparisonOp() || BO->isValueDependent() ||
+      BO->isTypeDependent())
+    return 0;
+  if (BO->getLocStart().isMacroID() || BO->getLocEnd().isMacroID())
+    return 0;
+
+  // The width of the variable side: comparing a char with 'A' is a 1-byte
+  // comparison even if the operands are promoted to int
+  unsigned int width = 0;
+  for (const Expr *operand : {BO->getLHS(), BO->getRHS()}) {
+    const QualType converted = operand->getType();
+    if (!converted->isIntegerType() || converted->isBooleanType())
+      return 0;
+    if (operand->HasSideEffects(context))
+      return 0;
+    if (operand->isEvaluatable(context))
+      continue;
+    const QualType original = operand->IgnoreParenImpCasts()->getType();
+    const unsigned int bytes =
+        (unsigned int)context.getTypeSize(
+            original->isIntegerType() ? original : converted) /
+        8;
+    width = width ? std::min(width, bytes) : bytes;
+  }
+
+  switch (width) {
+  case 1:
+  case 2:
+  case 4:
+  case 8:
+    return width;
+  default:
+    return 0;
+  }
+}
+
+static bool isStdFunction(const CXXRecordDecl *RD) {
+  const std::string name = RD->getQualifiedNameAsString();
+  return name == "std::function" || name == "std::__1::function";
+}
+
+void InstrumentationVisitor::collectCallees(const CFGBlock &block,
+                                            BlockElement &block_elmt) {
+  for (auto &element : block) {
+    auto cfg_stmt = element.getAs<CFGStmt>();
+    if (!cfg_stmt)
+      continue;
+    auto CE = dyn_cast<CallExpr>(cfg_stmt->getStmt());
+    if (!CE)
+      continue;
+
+    const FunctionDecl *callee = CE->getDirectCallee();
+    if (!callee) {
+      block_elmt.indirect_calls = true;
+      continue;
+    }
+    if (auto MD = dyn_cast<CXXMethodDecl>(callee)) {
+      if (MD->isVirtual())
+        block_elmt.indirect_calls = true;
+      // The call operators of the lambdas and of `std::function` don't have
+      // the name of the function they end up in
+      if (MD->getParent()->isLambda() || isStdFunction(MD->getParent())) {
+        block_elmt.indirect_calls = true;
+        continue;
+      }
+    }
+    const std::string name = callee->getQualifiedNameAsString();
+    if (std::find(block_elmt.callees.begin(), block_elmt.callees.end(),
+                  name) == block_elmt.callees.end())
+      block_elmt.callees.push_back(name);
+  }
+}
+
+// The dictionary of the fuzzer gets nothing out of these
+static bool isTrivialLiteral(const llvm::APSInt &value) {
+  return value == 0 || value == 1 || value.isAllOnesValue();
+}
+
+// Little-endian bytes of `value` truncated to `width` bytes
+static std::string encodeIntegerLiteral(const llvm::APSInt &value,
+                                        const unsigned int width) {
+  const uint64_t raw = value.extOrTrunc(64).getZExtValue();
+  std::string bytes;
+  for (unsigned int i = 0; i < width; i++)
+    bytes.push_back((char)((raw >> (8 * i)) & 0xff));
+  return bytes;
+}
+
+static void addLiteral(std::vector<std::string> &literals,
+                       const std::string &literal) {
+  if (std::find(literals.begin(), literals.end(), literal) == literals.end())
+    literals.push_back(literal);
+}
+
+void InstrumentationVisitor::collectExprLiterals(const Expr *expr,
+                                                 ConditionElement &condition) {
+  if (!expr || expr->isValueDependent() || expr->isTypeDependent())
+    return;
+  expr = expr->IgnoreParenImpCasts();
+
+  if (auto SL = dyn_cast<StringLiteral>(expr)) {
+    if (SL->getCharByteWidth() == 1 && SL->getLength() > 0)
+      addLiteral(condition.string_literals, SL->getString().str());
+    return;
+  }
+
+  if (auto UO = dyn_cast<UnaryOperator>(expr)) {
+    if (UO->getOpcode() == UO_LNot)
+      collectExprLiterals(UO->getSubExpr(), condition);
+    return;
+  }
+
+  auto BO = dyn_cast<BinaryOperator>(expr);
+  if (!BO)
+    return;
+  if (BO->isLogicalOp()) {
+    collectExprLiterals(BO->getLHS(), condition);
+    collectExprLiterals(BO->getRHS(), condition);
+    return;
+  }
+  if (!BO->isComparisonOp())
+    return;
+
+  // An integer constant compared with a variable, on the width of the
+  // variable (see `getCmpWidth`)
+  const Expr *operands[] = {BO->getLHS(), BO->getRHS()};
+  for (unsigned int i = 0; i < 2; i++) {
+    const Expr *constant = operands[i], *other = operands[1 - i];
+    if (!constant->getType()->isIntegerType() ||
+        other->isEvaluatable(context))
+      continue;
+    llvm::APSInt value;
+    if (!constant->EvaluateAsInt(value, context) || isTrivialLiteral(value))
+      continue;
+    const QualType original = other->IgnoreParenImpCasts()->getType();
+    if (!original->isIntegerType() || original->isBooleanType())
+      continue;
+    const unsigned int width = (unsigned int)context.getTypeSize(original) / 8;
+    if (width == 0 || width > 8)
+      continue;
+    addLiteral(condition.integer_literals, encodeIntegerLiteral(value, width));
+  }
+
+  // strcmp(buf, "MAGIC") == 0 and the like
+  for (const Expr *operand : operands) {
+    if (auto CE = dyn_cast<CallExpr>(operand->IgnoreParenImpCasts())) {
+      for (const Expr *arg : CE->arguments())
+        collectExprLiterals(arg, condition);
+    }
+  }
+}
+
+void InstrumentationVisitor::collectConditionLiterals(
+    const Stmt *terminator, ConditionElement &condition) {
+  if (!terminator)
+    return;
+
+  if (auto SS = dyn_cast<SwitchStmt>(terminator)) {
+    const Expr *cond = SS->getCond();
+    if (!cond || cond->isValueDependent() || cond->isTypeDependent())
+      return;
+    const QualType original = cond->IgnoreParenImpCasts()->getType();
+    if (!original->isIntegerType() || original->isBooleanType())
+      return;
+    const unsigned int width = (unsigned int)context.getTypeSize(original) / 8;
+    if (width == 0 || width > 8)
+      return;
+
+    for (const SwitchCase *SC = SS->getSwitchCaseList(); SC;
+         SC = SC->getNextSwitchCase()) {
+      auto CS = dyn_cast<CaseStmt>(SC);
+      if (!CS || CS->getLHS()->isValueDependent())
+        continue;
+      const llvm::APSInt value = CS->getLHS()->EvaluateKnownConstInt(context);
+      if (!isTrivialLiteral(value))
+        addLiteral(condition.integer_literals,
+                   encodeIntegerLiteral(value, width));
+    }
+    return;
+  }
+
+  Stmt *cond = nullptr;
+  if (auto IS = dyn_cast<IfStmt>(terminator))
+    cond = IS->getCond();
+  else if (auto WS = dyn_cast<WhileStmt>(terminator))
+    cond = WS->getCond();
+  else if (auto DS = dyn_cast<DoStmt>(terminator))
+    cond = DS->getCond();
+  else if (auto FS = dyn_cast<ForStmt>(terminator))
+    cond = FS->getCond();
+  else if (auto CO = dyn_cast<ConditionalOperator>(terminator))
+    cond = CO->getCond();
+  else if (auto BO = dyn_cast<BinaryOperator>(terminator))
+    cond = BO->isLogicalOp() ? BO->getLHS() : nullptr;
+
+  if (auto E = dyn_cast_or_null<Expr>(cond))
+    collectExprLiterals(E, condition);
+}
+
 unsigned int InstrumentationVisitor::findBlockIdForStmt(Stmt *s) {
   if (!s || !cfg_stack.map()) {
     return 0;
@@ -226,11 +512,19 @@ bool InstrumentationVisitor::HandleLambdaExpr(LambdaExpr *LE) {
   }
 #endif
 
-  element_id func_id = createSharedFunctionInformation(lambdaName);
+  if (!shouldInstrumentFunction(lambdaName)) {
+    LOG(INFO) << "!shouldInstrumentFunction " << lambdaName;
+    return true;
+  }
+
+  const FunctionElement::Level level = config.levelFor(lambdaName);
+  element_id func_id = createSharedFunctionInformation(lambdaName, level);
 
   if (InstrumentationVisitor::FunctionInformation *FI =
-          createFunctionInformation(LE, lambdaName, func_id)) {
+          createFunctionInformation(LE, lambdaName, func_id, level)) {
     createStoredFunctionInfo(FI);
+    if (config.goals)
+      FI->goal_blocks = config.goals->goal_blocks(lambdaName);
 
     cfg_stack.push(FI);
     VisitCallableBody(LE->getBody());
@@ -260,11 +554,19 @@ bool InstrumentationVisitor::VisitFunctionDecl(FunctionDecl *FD) {
   }
 #endif
 
-  element_id func_id = createSharedFunctionInformation(functionName);
+  if (!shouldInstrumentFunction(functionName)) {
+    LOG(INFO) << "!shouldInstrumentFunction " << functionName;
+    return true;
+  }
+
+  const FunctionElement::Level level = config.levelFor(functionName);
+  element_id func_id = createSharedFunctionInformation(functionName, level);
 
   if (InstrumentationVisitor::FunctionInformation *FI =
-          createFunctionInformation(FD, functionName, func_id)) {
+          createFunctionInformation(FD, functionName, func_id, level)) {
     createStoredFunctionInfo(FI);
+    if (config.goals)
+      FI->goal_blocks = config.goals->goal_blocks(functionName);
 
     cfg_stack.push(FI);
     VisitCallableBody(FD->getBody());
@@ -274,7 +576,7 @@ bool InstrumentationVisitor::VisitFunctionDecl(FunctionDecl *FD) {
 }
 
 element_id InstrumentationVisitor::createSharedFunctionInformation(
-    const std::string &name) {
+    const std::string &name, const FunctionElement::Level level) {
   // Need to cleanup all of this...
   LOG(INFO) << "Current store: " << store->toString();
 
@@ -282,6 +584,7 @@ element_id InstrumentationVisitor::createSharedFunctionInformation(
   auto e = Store::create(Element::E_FUNCTION, func_id, /*global???*/ source_id);
   auto func_elmt = std::static_pointer_cast<FunctionElement>(e);
   func_elmt->name = name;
+  func_elmt->level = level;
 
   LOG(INFO) << "created " << func_elmt->toString();
 
@@ -337,8 +640,6 @@ void InstrumentationVisitor::createStoredFunctionInfo(FunctionInformation *FI) {
       }
     }
 
-    std::map<unsigned int, std::vector<std::string>> block_pred_literals;
-
     // Add Block predecessors
     auto block_pred_iter = block->pred_begin(),
          block_pred_end = block->pred_end();
@@ -353,20 +654,58 @@ void InstrumentationVisitor::createStoredFunctionInfo(FunctionInformation *FI) {
       }
     }
 
-    // XXX add literals
+    collectCallees(*block, *block_elmt);
+
+    // Literals of the branch condition, for the dictionary of the fuzzer
+    auto ec = Store::create(Element::E_CONDITION, 0, cur_block_id);
+    auto condition_elmt = std::static_pointer_cast<ConditionElement>(ec);
+    collectConditionLiterals(block->getTerminator().getStmt(),
+                             *condition_elmt);
+    if (!condition_elmt->string_literals.empty() ||
+        !condition_elmt->integer_literals.empty()) {
+      element_id condition_id = store->store().getNextId();
+      condition_elmt->id = condition_id;
+      store->store().add(condition_id, ec);
+      block_elmt->condition_literals.push_back(condition_id);
+    }
 
     // Insert our block
     store->store().add(cur_block_id, e);
   }
+
+  // Number the edges of the function, now that all its blocks are known
+  auto initial_iter = block_element_ids.find(0);
+  const element_id initial_pred_id =
+      initial_iter != block_element_ids.end() ? initial_iter->second : ERROR_ID;
+  const edge_id first_edge_id =
+      store->store().addEdge(EdgeEntry(FI->func_id, ERROR_ID, ERROR_ID));
+  for (auto &block : *FI->cfg) {
+    const element_id cur_block_id = block_element_ids[block->getBlockID()];
+    std::set<element_id> pred_ids{initial_pred_id};
+    for (auto pred_iter = block->pred_begin(); pred_iter != block->pred_end();
+         ++pred_iter) {
+      const CFGBlock *pred = *pred_iter;
+      if (!pred)
+        continue;
+      auto pred_id_iter = block_element_ids.find(pred->getBlockID());
+      if (pred_id_iter != block_element_ids.end())
+        pred_ids.insert(pred_id_iter->second);
+    }
+    for (auto &pred_id : pred_ids)
+      store->store().addEdge(EdgeEntry(FI->func_id, pred_id, cur_block_id));
+  }
+  LOG(INFO) << "Edges " << first_edge_id << " to "
+            << store->store().edges.size() - 1 << " for func " << FI->func_id;
 }
 
 // Specialization of `createFunctionInformation` for `LambdaExpr`
 InstrumentationVisitor::FunctionInformation *
-InstrumentationVisitor::createFunctionInformation(LambdaExpr *LE,
-                                                  const std::string &name,
-                                                  const element_id func_id) {
+InstrumentationVisitor::createFunctionInformation(
+    LambdaExpr *LE, const std::string &name, const element_id func_id,
+    const FunctionElement::Level level) {
   FunctionInformation *FI = new FunctionInformation();
   FI->func_id = func_id;
+  FI->level = level;
   FI->FD = nullptr;
   FI->LE = LE;
 
@@ -380,8 +719,10 @@ InstrumentationVisitor::createFunctionInformation(LambdaExpr *LE,
   SourceLocation start = LE->getBody()->getLocStart();
   std::ostringstream oss;
 
-  oss << "unsigned int __coverage_pred_block = 0; __coverage_enter_func(" << func_id
-      << ");";
+  // Only the edges need the previous block
+  if (level == FunctionElement::L_EDGE)
+    oss << "unsigned int __coverage_pred_block = 0;";
+  oss << " __coverage_enter_func(" << func_id << ");";
   rewrite->InsertTextBefore(expand_loc(start), oss.str());
 
   if (!hasReturnForEpilogue(LE->getBody())) {
@@ -415,13 +756,14 @@ InstrumentationVisitor::createFunctionInformation(LambdaExpr *LE,
 // For a `FunctionDecl` or `CXXMethodDecl`, compute information required for the
 // instrumentation. Access to type info, etc.
 InstrumentationVisitor::FunctionInformation *
-InstrumentationVisitor::createFunctionInformation(FunctionDecl *FD,
-                                                  const std::string &name,
-                                                  const element_id func_id) {
+InstrumentationVisitor::createFunctionInformation(
+    FunctionDecl *FD, const std::string &name, const element_id func_id,
+    const FunctionElement::Level level) {
 
   InstrumentationVisitor::FunctionInformation *FI =
       new InstrumentationVisitor::FunctionInformation();
   FI->func_id = func_id;
+  FI->level = level;
   FI->FD = FD;
   FI->LE = nullptr;
 
@@ -446,8 +788,14 @@ InstrumentationVisitor::createFunctionInformation(FunctionDecl *FD,
     FI->qualifiedReturnType = InstrumentationUtils::getLiteralReturnType(FD);
   }
 
-  oss << "unsigned int __coverage_pred_block = 0; __coverage_enter_func(" << func_id
-      << ");";
+  if (level == FunctionElement::L_EDGE)
+    oss << "unsigned int __coverage_pred_block = 0;";
+  oss << " __coverage_enter_func(" << func_id << ");";
+
+  // Deferred fork server snapshot point, see runtime.h
+  if (InstrumentationUtils::hasForkHereAnnotation(FD)) {
+    oss << " __coverage_fork_here();";
+  }
   rewrite->InsertTextBefore(expand_loc(start), oss.str());
 
   // If the last token isn't a return, we still need to inject something to know
@@ -563,6 +911,16 @@ bool InstrumentationUtils::hasNonVoidReturnValue(FunctionDecl *FD) {
   return InstrumentationUtils::getLiteralReturnType(FD) != "void";
 }
 
+// `__attribute__((annotate("coverage_fork_here")))` on a function makes the
+// fork server start when entering it
+bool InstrumentationUtils::hasForkHereAnnotation(FunctionDecl *FD) {
+  for (const auto *attr : FD->specific_attrs<AnnotateAttr>()) {
+    if (attr->getAnnotation() == "coverage_fork_here")
+      return true;
+  }
+  return false;
+}
+
 // When it's a reference type, we cannot use a variable to capture the return
 // type and assign it, so we'll need to create variable in the scope of the
 // return.
@@ -49,6 +49,11 @@ struct InstrumentationVisitor
     std::unique_ptr<CFG> cfg;
     std::unique_ptr<ParentMap> pm;
 
+    // With `Config::goals`, the internal ids of the blocks to instrument
+    const std::set<uint32_t> *goal_blocks = nullptr;
+
+    FunctionElement::Level level = FunctionElement::L_EDGE;
+
     bool hasRetValue = false;
     bool requiresLocalReturnVariable = false;
     std::string qualifiedReturnType;
@@ -90,6 +95,14 @@ struct InstrumentationVisitor
 
     element_id id() const { return M.empty() ? ERROR_ID : M.front()->func_id; }
 
+    const std::set<uint32_t> *goal_blocks() const {
+      return M.empty() ? nullptr : M.front()->goal_blocks;
+    }
+
+    FunctionElement::Level level() const {
+      return M.empty() ? FunctionElement::L_EDGE : M.front()->level;
+    }
+
     // returns true if the top is a lambda expr
     bool isLambdaExpr() const {
       return M.empty() ? false : M.front()->isLambdaExpr();
@@ -127,12 +140,16 @@ struct InstrumentationVisitor
 
   element_id source_id = ERROR_ID;
 
+  const Config &config;
+
   InstrumentationVisitor(ASTContext &context, SourceManager *SM,
                          FileID &mainFileID, Rewriter *rewrite,
                          std::unique_ptr<Store> &store, element_id source_id,
-                         std::unique_ptr<Analysis> &analysis)
+                         std::unique_ptr<Analysis> &analysis,
+                         const Config &config)
       : context(context), SM(SM), mainFileID(mainFileID), rewrite(rewrite),
-        analysis(analysis), store(store), source_id(source_id) {
+        analysis(analysis), store(store), source_id(source_id),
+        config(config) {
     LOG(INFO) << "Create InstrumentationVisitor";
   }
 
@@ -141,6 +158,10 @@ struct InstrumentationVisitor
   // Limit the instrumentation to non-inlined functions
   bool shouldInstrumentFunctionDecl(const FunctionDecl *FD);
 
+  // With `Config::goals`, limit the instrumentation to what can reach a goal
+  bool shouldInstrumentFunction(const std::string &name);
+  bool shouldInstrumentBlock(const unsigned int block_id);
+
   // Used to limit the instrumentation to the current TU
   bool isInMainFile(const FileID &funcFileID);
 
@@ -161,13 +182,14 @@ struct InstrumentationVisitor
   // Instrumentation root at the function level
   InstrumentationVisitor::FunctionInformation *
   createFunctionInformation(FunctionDecl *, const std::string &,
-                            const element_id);
+                            const element_id, const FunctionElement::Level);
   InstrumentationVisitor::FunctionInformation *
   createFunctionInformation(LambdaExpr *, const std::string &,
-                            const element_id);
+                            const element_id, const FunctionElement::Level);
 
   // Compute and store information for a given function
-  element_id createSharedFunctionInformation(const std::string &functionName);
+  element_id createSharedFunctionInformation(const std::string &functionName,
+                                             const FunctionElement::Level level);
 
   void createStoredFunctionInfo(FunctionInformation *FI);
 
@@ -186,6 +208,23 @@ private:
 
   void InsertBlockDirective(const Stmt *S, const unsigned int block_id);
 
+  // Log the operands of the integer comparisons of a branch condition, see
+  // `__coverage_cmp`
+  void InsertCmpDirectives(Expr *cond, const unsigned int block_id);
+
+  // Width in bytes of the compared integers, 0 if the comparison can't be
+  // logged
+  unsigned int getCmpWidth(const BinaryOperator *BO);
+
+  // Collect the string and integer literals a block terminator compares with
+  void collectConditionLiterals(const Stmt *terminator,
+                                ConditionElement &condition);
+
+  void collectExprLiterals(const Expr *expr, ConditionElement &condition);
+
+  // Record the functions called by a CFG block
+  void collectCallees(const CFGBlock &block, BlockElement &block_elmt);
+
   void rewriteReturnStatements(FunctionDecl *FD);
 };
 
@@ -204,6 +243,8 @@ struct InstrumentationUtils {
 
   static bool canInstrumentReturnGlobally(FunctionDecl *FD);
 
+  static bool hasForkHereAnnotation(FunctionDecl *FD);
+
   static bool isControlFlowStmt(Stmt *stmt);
 
   static std::string getLiteralExpr(SourceManager *SM, Rewriter *rewrite,
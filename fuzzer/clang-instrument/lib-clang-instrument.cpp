@@ -15,6 +15,7 @@ using namespace clang;
 #include "common/logger.h"
 INITIALIZE_EASYLOGGINGPP; // Just once at the root
 
+#include "common/reachability.h"
 #include "common/store.h"
 #include "instr-ast-consumer.h"
 #include "lib-clang-instrument.h"
@@ -38,12 +39,82 @@ ClangInstrumenter::CreateASTConsumer(CompilerInstance &CI,
 
 bool ClangInstrumenter::ParseArgs(const CompilerInstance &CI,
                                   const std::vector<std::string> &args) {
-  // TBD
+  for (auto &arg : args) {
+    if (arg == "inline-counters") {
+      config.inline_counters = true;
+    } else if (arg == "cmp-log") {
+      config.cmp_log = true;
+    } else if (arg.compare(0, 11, "goals-from=") == 0) {
+      const std::string models_file = arg.substr(11);
+      DiagnosticsEngine &diags = CI.getDiagnostics();
+      StoreImpl models;
+      try {
+        models = StoreImpl::fromFile(models_file);
+      } catch (std::exception &e) {
+        // Truncated or not a models file: cereal gives up on it
+        diags.Report(diags.getCustomDiagID(
+            DiagnosticsEngine::Error, "cannot read the models in '%0': %1"))
+            << models_file << e.what();
+        return false;
+      }
+      if (models.elements.empty()) {
+        diags.Report(diags.getCustomDiagID(DiagnosticsEngine::Error,
+                                           "no models in '%0'"))
+            << models_file;
+        return false;
+      }
+      config.goals = std::make_shared<const GoalReachability>(
+          GoalReachability::compute(models));
+    } else if (arg.compare(0, 6, "level=") == 0) {
+      // level=<level> or level=<level>:<pattern>
+      const std::string value = arg.substr(6);
+      const size_t colon = value.find(':');
+      const std::string name = value.substr(0, colon);
+      Config::Level level;
+      if (name == "function") {
+        level = FunctionElement::L_FUNCTION;
+      } else if (name == "block") {
+        level = FunctionElement::L_BLOCK;
+      } else if (name == "edge") {
+        level = FunctionElement::L_EDGE;
+      } else {
+        DiagnosticsEngine &diags = CI.getDiagnostics();
+        diags.Report(diags.getCustomDiagID(
+            DiagnosticsEngine::Error, "unknown instrumentation level: '%0'"))
+            << name;
+        return false;
+      }
+      if (colon == std::string::npos) {
+        config.level = level;
+      } else {
+        config.level_patterns.push_back(
+            std::make_pair(value.substr(colon + 1), level));
+      }
+    } else if (arg == "help") {
+      PrintHelp(llvm::errs());
+    } else {
+      DiagnosticsEngine &diags = CI.getDiagnostics();
+      diags.Report(diags.getCustomDiagID(DiagnosticsEngine::Error,
+                                         "unknown instrument argument: '%0'"))
+          << arg;
+      return false;
+    }
+  }
   return true;
 }
 
 void ClangInstrumenter::PrintHelp(llvm::raw_ostream &ros) {
-  // TBD
+  ros << "-plugin-arg-instrument inline-counters: count the block edges "
+         "inline in the edge map of the runtime (edge map trace mode only)\n"
+      << "-plugin-arg-instrument cmp-log: report the operands of the integer "
+         "comparisons of the branch conditions to the runtime\n"
+      << "-plugin-arg-instrument goals-from=<models>: only instrument the "
+         "functions and blocks that can reach a goal in the models of a "
+         "previous run\n"
+      << "-plugin-arg-instrument level=<function|block|edge>[:<pattern>]: "
+         "record the function boundaries only, the blocks, or the edges "
+         "(default), for the whole file or for the functions matching the "
+         "pattern\n";
 }
 }
 
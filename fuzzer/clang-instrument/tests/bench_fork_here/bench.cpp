@@ -0,0 +1,119 @@
+#include "shared-data/fork-server.h"
+#include "shared-data/shared-data.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <signal.h>
+#include <string>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// Drives the fork server of an instrumented target the same way the
+// Commander does, and reports the number of executions per second when
+// forking from the runtime initialization vs. from `__coverage_fork_here()`.
+//
+// usage: bench-fork-here <instrumented target> <iterations>
+
+static const char *INPUT_FILENAME = "bench_fork_here_input";
+
+static double run_fork_server(shm::SHMFuzzerHandler &handler,
+                              const string &target, const bool deferred,
+                              const unsigned int iterations) {
+  int ctl_pipe[2], st_pipe[2];
+  if (pipe(ctl_pipe) < 0 || pipe(st_pipe) < 0) {
+    cerr << "pipe: " << strerror(errno) << endl;
+    return 0;
+  }
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    dup2(ctl_pipe[0], FORK_SERVER_CTL_FD);
+    dup2(st_pipe[1], FORK_SERVER_ST_FD);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    const int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    setenv(ENV_FORK_SERVER, "1", 1);
+    if (deferred) {
+      setenv(ENV_FORK_SERVER_DEFERRED, "1", 1);
+    }
+    setenv("COVERAGE_FUZZING_TRACE_MODE", "edges", 1);
+    execl(target.c_str(), target.c_str(), INPUT_FILENAME, nullptr);
+    _exit(1);
+  }
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  uint32_t hello = 0;
+  if (!shm::fork_server_read(st_pipe[0], &hello, sizeof(hello)) ||
+      hello != FORK_SERVER_HELLO) {
+    cerr << "The target didn't start its fork server" << endl;
+    return 0;
+  }
+
+  const auto start = chrono::steady_clock::now();
+
+  for (uint64_t testcase_id = 1; testcase_id <= iterations; testcase_id++) {
+    ofstream input(INPUT_FILENAME, ios::out | ios::binary | ios::trunc);
+    input << "AAAABBBB" << testcase_id;
+    input.close();
+
+    int32_t child_pid = 0, child_status = 0;
+    if (!shm::fork_server_write(ctl_pipe[1], &testcase_id,
+                                sizeof(testcase_id)) ||
+        !shm::fork_server_read(st_pipe[0], &child_pid, sizeof(child_pid)) ||
+        !shm::fork_server_read(st_pipe[0], &child_status,
+                               sizeof(child_status))) {
+      cerr << "The fork server died" << endl;
+      return 0;
+    }
+    handler.edge_maps->remove_map(testcase_id);
+  }
+
+  const chrono::duration<double> elapsed =
+      chrono::steady_clock::now() - start;
+
+  close(ctl_pipe[1]);
+  close(st_pipe[0]);
+  waitpid(pid, nullptr, 0);
+
+  return iterations / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    cout << "usage: " << argv[0] << " <instrumented target> <iterations>"
+         << endl;
+    return 0;
+  }
+
+  const string target(argv[1]);
+  const unsigned int iterations = strtoul(argv[2], nullptr, 10);
+
+  // Start from a clean shared memory
+  shm::SHMFuzzerHandler handler(/*cleanup*/ true);
+
+  const double from_init =
+      run_fork_server(handler, target, /*deferred*/ false, iterations);
+  const double from_fork_here =
+      run_fork_server(handler, target, /*deferred*/ true, iterations);
+
+  cout << "fork from the runtime initialization: " << from_init
+       << " execs/s" << endl;
+  cout << "fork from __coverage_fork_here():    " << from_fork_here
+       << " execs/s" << endl;
+  return 0;
+}
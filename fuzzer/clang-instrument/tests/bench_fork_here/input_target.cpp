@@ -0,0 +1,55 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Benchmark target for the deferred fork server: an expensive startup
+// (building a large lookup table) before the input is even read. With the
+// deferred fork server, the children are forked from `run`, once the table
+// has been built.
+
+static const size_t TABLE_SIZE = 1 << 23;
+
+vector<unsigned int> build_table() {
+  vector<unsigned int> table(TABLE_SIZE);
+  unsigned int x = 0x12345678;
+  for (size_t i = 0; i < TABLE_SIZE; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    table[i] = x;
+  }
+  return table;
+}
+
+// The input must be read after the snapshot point, it changes for each child
+__attribute__((annotate("coverage_fork_here"))) int
+run(const vector<unsigned int> &table, const char *filename) {
+  ifstream file(filename, ios::in | ios::binary);
+  string input((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+  unsigned int count = 0;
+  for (size_t i = 0; i < input.size(); i++) {
+    if (table[static_cast<unsigned char>(input[i])] & 1) {
+      count++;
+    }
+  }
+
+  if (count > 8) {
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cout << "Must have one argument: <input file>" << endl;
+    return 0;
+  }
+
+  const vector<unsigned int> table = build_table();
+  return run(table, argv[1]);
+}
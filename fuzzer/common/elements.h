@@ -150,12 +150,20 @@ struct SourceElement : public Element {
 };
 
 struct FunctionElement : public Element {
+  // What the instrumentation of the function records, see the `level`
+  // argument of the plugin:
+  // - L_FUNCTION: the function boundaries only
+  // - L_BLOCK: the blocks, the predecessor block is always 0
+  // - L_EDGE: the edges between the blocks, and the branches not taken
+  enum Level { L_FUNCTION = 0, L_BLOCK, L_EDGE };
+
   std::string name;
   std::string signature;
   std::string mangled_name;
 
   uint16_t num_formals;
   std::vector<element_id> blocks;
+  Level level = L_EDGE;
 
   FunctionElement() : Element() {}
 
@@ -165,7 +173,7 @@ struct FunctionElement : public Element {
   FunctionElement(const FunctionElement &f)
       : Element(f), name(f.name), signature(f.signature),
         mangled_name(f.mangled_name), num_formals(f.num_formals),
-        blocks(f.blocks) {}
+        blocks(f.blocks), level(f.level) {}
 
   FunctionElement &operator=(const FunctionElement &f) {
     if (&f == this)
@@ -176,6 +184,7 @@ struct FunctionElement : public Element {
     mangled_name = f.mangled_name;
     num_formals = f.num_formals;
     blocks = f.blocks;
+    level = f.level;
     return *this;
   }
 
@@ -194,7 +203,7 @@ struct FunctionElement : public Element {
   //
   template <class Archive> void serialize(Archive &archive) {
     archive(cereal::base_class<Element>(this), name, signature, mangled_name,
-            num_formals, blocks);
+            num_formals, blocks, level);
   }
 };
 
@@ -204,6 +213,12 @@ struct BlockElement : public Element {
   std::vector<element_id> summaries;
   std::vector<element_id> condition_literals;
 
+  // Qualified names of the functions called directly by the block, and
+  // whether it makes indirect calls (function pointers, virtual methods,
+  // lambdas)
+  std::vector<std::string> callees;
+  bool indirect_calls = false;
+
   BlockElement() : Element() {}
 
   BlockElement(const element_id id, const element_id source_id)
@@ -212,7 +227,8 @@ struct BlockElement : public Element {
   BlockElement(const BlockElement &b)
       : Element(b), internal_block_id(b.internal_block_id),
         predecessor_ids(b.predecessor_ids), summaries(b.summaries),
-        condition_literals(b.condition_literals) {}
+        condition_literals(b.condition_literals), callees(b.callees),
+        indirect_calls(b.indirect_calls) {}
 
   BlockElement &operator=(const BlockElement &b) {
     if (&b == this)
@@ -222,6 +238,8 @@ struct BlockElement : public Element {
     predecessor_ids = b.predecessor_ids;
     summaries = b.summaries;
     condition_literals = b.condition_literals;
+    callees = b.callees;
+    indirect_calls = b.indirect_calls;
     return *this;
   }
 
@@ -240,7 +258,8 @@ struct BlockElement : public Element {
   //
   template <class Archive> void serialize(Archive &archive) {
     archive(cereal::base_class<Element>(this), internal_block_id,
-            predecessor_ids, summaries, condition_literals);
+            predecessor_ids, summaries, condition_literals, callees,
+            indirect_calls);
   }
 };
 
@@ -341,8 +360,12 @@ struct SummaryElement : public Element {
   }
 };
 
+// The literals a branch condition (or the cases of a switch) compares with.
+// An integer literal is stored as its little-endian bytes, on the width of
+// the value it's compared with.
 struct ConditionElement : public Element {
-  std::vector<std::string> string_literals; // XXX encode different types
+  std::vector<std::string> string_literals;
+  std::vector<std::string> integer_literals;
 
   ConditionElement() : Element() {}
 
@@ -350,13 +373,15 @@ struct ConditionElement : public Element {
       : Element(id, Element::E_CONDITION, block_id) {}
 
   ConditionElement(const ConditionElement &b)
-      : Element(b), string_literals(b.string_literals) {}
+      : Element(b), string_literals(b.string_literals),
+        integer_literals(b.integer_literals) {}
 
   ConditionElement &operator=(const ConditionElement &b) {
     if (&b == this)
       return *this;
     Element::operator=(b);
     string_literals = b.string_literals;
+    integer_literals = b.integer_literals;
     return *this;
   }
 
@@ -371,6 +396,9 @@ struct ConditionElement : public Element {
     for (auto &lit : string_literals) {
       oss << "\"" << lit << "\",";
     }
+    for (auto &lit : integer_literals) {
+      oss << lit.size() << "B,";
+    }
     oss << "]>";
     return oss.str();
   }
@@ -379,7 +407,36 @@ struct ConditionElement : public Element {
   // Serialization utils
   //
   template <class Archive> void serialize(Archive &archive) {
-    archive(cereal::base_class<Element>(this), string_literals);
+    archive(cereal::base_class<Element>(this), string_literals,
+            integer_literals);
+  }
+};
+
+// Dense id of a CFG edge, the index of its `EdgeEntry` in the edge table of
+// the store. Assigned by the instrumentation, in order, across all the TUs.
+typedef uint32_t edge_id;
+
+// An edge of the CFG of a function. The entry of the function is the edge
+// without blocks; the first block reached in a function comes from the
+// block of internal id 0, as the instrumentation starts with this
+// predecessor.
+struct EdgeEntry {
+  element_id func_id = ERROR_ID;
+  element_id pred_block_id = ERROR_ID;
+  element_id cur_block_id = ERROR_ID;
+
+  EdgeEntry() {}
+
+  EdgeEntry(const element_id func_id, const element_id pred_block_id,
+            const element_id cur_block_id)
+      : func_id(func_id), pred_block_id(pred_block_id),
+        cur_block_id(cur_block_id) {}
+
+  //
+  // Serialization utils
+  //
+  template <class Archive> void serialize(Archive &archive) {
+    archive(func_id, pred_block_id, cur_block_id);
   }
 };
 }
@@ -0,0 +1,95 @@
+#include "reachability.h"
+#include "common/logger.h"
+
+#include <memory>
+#include <vector>
+using namespace std;
+
+namespace instr {
+
+bool GoalReachability::reaches(const string &function,
+                               const uint32_t internal_block_id) const {
+  const set<uint32_t> *function_blocks = goal_blocks(function);
+  return function_blocks &&
+         function_blocks->find(internal_block_id) != function_blocks->end();
+}
+
+const set<uint32_t> *
+GoalReachability::goal_blocks(const string &function) const {
+  auto iter = blocks.find(function);
+  return iter != blocks.end() ? &iter->second : nullptr;
+}
+
+// The element `id` of the store if it's of `kind`, nullptr otherwise
+template <typename T>
+static shared_ptr<T> findElement(const StoreImpl &store, const element_id id,
+                                 const Element::Kind kind) {
+  auto iter = store.elements.find(id);
+  if (iter == store.elements.end() || !iter->second ||
+      iter->second->getKind() != kind)
+    return nullptr;
+  return static_pointer_cast<T>(iter->second);
+}
+
+GoalReachability GoalReachability::compute(const StoreImpl &store) {
+  GoalReachability result;
+
+  // Walk the CFGs and the call graph backward from the goals. The edges from
+  // the initial predecessor (block 0) aren't part of the CFG.
+  map<element_id, vector<element_id>> predecessors;
+  for (auto &edge : store.edges) {
+    if (edge.pred_block_id == ERROR_ID || edge.cur_block_id == ERROR_ID)
+      continue;
+    auto pred_elmt = findElement<BlockElement>(store, edge.pred_block_id,
+                                               Element::E_BLOCK);
+    if (pred_elmt && pred_elmt->internal_block_id != 0)
+      predecessors[edge.cur_block_id].push_back(edge.pred_block_id);
+  }
+
+  map<string, vector<element_id>> callers;
+  vector<element_id> worklist;
+  for (auto &elmt_iter : store.elements) {
+    auto elmt = elmt_iter.second;
+    if (!elmt || elmt->getKind() != Element::E_BLOCK)
+      continue;
+    auto block_elmt = static_pointer_cast<BlockElement>(elmt);
+    for (auto &callee : block_elmt->callees)
+      callers[callee].push_back(elmt_iter.first);
+    if (!block_elmt->summaries.empty() || block_elmt->indirect_calls)
+      worklist.push_back(elmt_iter.first);
+  }
+
+  set<element_id> reaching_blocks;
+  while (!worklist.empty()) {
+    const element_id block_id = worklist.back();
+    worklist.pop_back();
+    auto block_elmt =
+        findElement<BlockElement>(store, block_id, Element::E_BLOCK);
+    if (!block_elmt || !reaching_blocks.insert(block_id).second)
+      continue;
+
+    auto pred_iter = predecessors.find(block_id);
+    if (pred_iter != predecessors.end()) {
+      for (auto &pred_id : pred_iter->second)
+        worklist.push_back(pred_id);
+    }
+
+    auto func_elmt = findElement<FunctionElement>(
+        store, block_elmt->getFunctionId(), Element::E_FUNCTION);
+    if (!func_elmt)
+      continue;
+    result.blocks[func_elmt->name].insert(block_elmt->internal_block_id);
+    if (result.functions.insert(func_elmt->name).second) {
+      auto callers_iter = callers.find(func_elmt->name);
+      if (callers_iter != callers.end()) {
+        for (auto &caller_id : callers_iter->second)
+          worklist.push_back(caller_id);
+      }
+    }
+  }
+
+  LOG(INFO) << result.functions.size() << " functions and "
+            << reaching_blocks.size() << " blocks can reach a goal";
+  return result;
+}
+}
@@ -0,0 +1,43 @@
+#ifndef REACHABILITY_H
+#define REACHABILITY_H
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "store.h"
+
+namespace instr {
+
+// The functions and blocks of the models that can reach a goal (a block with
+// summaries), through the CFG of their function and the functions they call.
+// Used to only instrument them in a second instrumentation run. Functions are
+// known by name since the element ids differ from one run to the other.
+//
+// A call to a function without models (library code) can't reach a goal, an
+// indirect call can reach any of them.
+class GoalReachability {
+  std::set<std::string> functions;
+  std::map<std::string, std::set<uint32_t>> blocks; // internal block ids
+
+public:
+  GoalReachability() = default;
+
+  // Fixpoint over the edge table and the callees of the blocks
+  static GoalReachability compute(const StoreImpl &store);
+
+  bool reaches(const std::string &function) const {
+    return functions.find(function) != functions.end();
+  }
+
+  bool reaches(const std::string &function,
+               const uint32_t internal_block_id) const;
+
+  // The blocks of `function` that reach a goal, nullptr if there is none
+  const std::set<uint32_t> *goal_blocks(const std::string &function) const;
+
+  size_t num_functions() const { return functions.size(); }
+};
+}
+
+#endif
@@ -76,6 +76,11 @@ void StoreImpl::add(const element_id id, const shared_ptr<Element> &element) {
   }
 }
 
+edge_id StoreImpl::addEdge(const EdgeEntry &edge) {
+  edges.push_back(edge);
+  return (edge_id)(edges.size() - 1);
+}
+
 string StoreImpl::toString() const {
   ostringstream oss;
   oss << "Store(" << endl;
@@ -91,6 +96,7 @@ string StoreImpl::toString() const {
     oss << elmt.first << "->" << elmt.second->toString() << ", ";
   }
   oss << endl << "]," << endl;
+  oss << " edges := " << edges.size() << endl;
   oss << ");";
   return oss.str();
 }
@@ -29,18 +29,20 @@ namespace instr {
 //     lib
 typedef std::map<element_id, std::shared_ptr<Element>> lookup_t;
 typedef std::map<std::string, element_id> sources_t;
+typedef std::vector<EdgeEntry> edges_t;
 
 // This is the internal state that gets serialized.
 struct StoreImpl {
   element_id global_id = ERROR_ID;
   sources_t sources;
   lookup_t elements;
+  edges_t edges; // by edge_id
 
   StoreImpl() = default;
 
   StoreImpl(const StoreImpl &impl)
       : global_id(impl.global_id), sources(impl.sources),
-        elements(impl.elements) {}
+        elements(impl.elements), edges(impl.edges) {}
 
   ~StoreImpl() = default;
 
@@ -54,11 +56,14 @@ struct StoreImpl {
 
   void add(const element_id id, const std::shared_ptr<Element> &element);
 
+  // Append an edge to the edge table, returns its id
+  edge_id addEdge(const EdgeEntry &edge);
+
   //
   // Serialization utils
   //
   template <class Archive> void serialize(Archive &archive) {
-    archive(global_id, sources, elements);
+    archive(global_id, sources, elements, edges);
   }
 
   std::string toString() const;
@@ -1,7 +1,10 @@
 #include "commander.h"
 #include "common/logger.h"
+#include "shared-data/fork-server.h"
+#include "shared-data/shared-data.h"
 #include "utils.h"
 
+#include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/trim_all.hpp>
 #include <boost/filesystem.hpp>
@@ -18,6 +21,8 @@ namespace bt = boost::timer;
 #include <windows.h>
 #else
 #include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -28,6 +33,7 @@ namespace bt = boost::timer;
 using namespace tbb;
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <set>
@@ -40,16 +46,18 @@ namespace fuzz {
 
 static const std::string FUZZING_CRASH_ME = "COVERAGE_FUZZING_CRASH_ME";
 static const std::string ENV_TESTCASE_ID = "COVERAGE_FUZZING_TESTCASE_ID";
+static const std::string ENV_TRACE_MODE = "COVERAGE_FUZZING_TRACE_MODE";
 static const std::string INPUT_NEEDLE = "__INPUT__";
 static const std::string FILE_NEEDLE = "__FILE__";
+static const std::string FORK_SERVER_INPUT = "fork_server_input";
 
 //
 // Some process utils
 //
 void timeout_kill(const bp::process::id_type pid) {
 #if (BOOST_OS_MACOS || BOOST_OS_LINUX)
-  kill(pid, SIGUSR2); // notify the child of the timeout. it will then flush the
-                      // trace and then commit suicide
+  kill(pid, SIGUSR2); // notify the child of the timeout. it will then publish
+                      // E_TIMEDOUT and commit suicide
 #else
 #error "Windows not supported yet for processes."
 #endif
@@ -90,6 +98,24 @@ ProcessStatus get_pid_status(const bp::process::id_type pid) {
 #endif
 }
 
+// Wait for data on `fd` for at most `timeout_ms` milliseconds
+bool wait_readable(const int fd, const int timeout_ms) {
+#if (BOOST_OS_MACOS || BOOST_OS_LINUX)
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  int ret;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+  return ret > 0;
+#else
+#error "Windows not supported yet for processes."
+#endif
+}
+
 void set_group_child_process(const bp::process::id_type pid) {
 #if (BOOST_OS_MACOS || BOOST_OS_LINUX)
   if (setpgid(pid, pid) == -1) {
@@ -272,8 +298,29 @@ struct Commander::Impl {
 
   string executable;
   vector<string> args;
-  uint32_t input_index;
+  uint32_t input_index = 0;
   bool force_crash_target = false;
+  bool stream_target_stdout = false;
+  uint32_t timeout_seconds = 0;
+  bool fork_server_deferred = false;
+
+  // In persistent mode, the "fork server" is the harness itself, running all
+  // the testcases in-process. It gets recycled after `persistent_iterations`
+  // testcases, or when its memory grew by more than `persistent_max_rss_growth`
+  // bytes since its first testcase (some state is leaking).
+  bool persistent = false;
+  uint32_t persistent_iterations = 0;
+  size_t persistent_max_rss_growth = 0;
+  uint32_t persistent_num_runs = 0;
+  size_t persistent_initial_rss = 0;
+  std::unique_ptr<shm::SHMFuzzerHandler> persistent_shm;
+  shm::PersistentInput *persistent_input = nullptr;
+
+  // The fork server, when enabled and supported by the target
+  bp::process::id_type fork_server_pid = -1;
+  int fork_server_ctl_fd = -1;
+  int fork_server_st_fd = -1;
+  string fork_server_input;
 
 #if defined(BOOST_POSIX_API)
   bp::posix_context ctx;
@@ -287,14 +334,24 @@ struct Commander::Impl {
       : command_line(command_line), input_kind(input_kind) {
     initialize(vm, no_cleanup);
   }
+  ~Impl() { stop_fork_server(); }
 
   bp::process::id_type exec(uint64_t testcase_id, uint8_t *data, uint32_t size);
   bp::child __internal_exec(const vector<string> &process_args);
 
+  bool has_fork_server() const { return fork_server_pid > 0; }
+  bp::process::id_type fork_server_exec(uint64_t testcase_id, uint8_t *data,
+                                        uint32_t size, ProcessStatus &status);
+
 private:
   void initialize(const po::variables_map &vm, bool no_cleanup = false);
+  bool start_fork_server();
+  void stop_fork_server();
+  bool restart_fork_server();
+  bool should_recycle_persistent();
   void parse_command_line();
   void parse_extra_env(const string &env_options);
+  void setup_ld_preload(const po::variables_map &vm);
   std::string replace_fuzz_input(const std::string &input, uint64_t testcase_id,
                                  uint8_t *data, uint32_t size);
   std::string to_input(uint64_t testcase_id, uint8_t *data, uint32_t size);
@@ -306,8 +363,11 @@ void Commander::Impl::initialize(const po::variables_map &vm, bool no_cleanup) {
 // Set the original environment from shell that runs coverage-fuzzer
 // ctx.environment = bp::self::get_environment();
 
+  stream_target_stdout = vm["stream-target-stdout"].as<bool>();
+  timeout_seconds = vm["target-timeout-seconds"].as<uint32_t>();
+
 #if defined(BOOST_POSIX_API)
-  if (vm["stream-target-stdout"].as<bool>()) {
+  if (stream_target_stdout) {
     ctx.output_behavior.insert(
         bp::behavior_map::value_type(STDOUT_FILENO, bp::inherit_stream()));
     ctx.output_behavior.insert(
@@ -364,6 +424,85 @@ void Commander::Impl::initialize(const po::variables_map &vm, bool no_cleanup) {
   if (force_crash_target) {
     ctx.environment.insert(bp::environment::value_type(FUZZING_CRASH_ME, "1"));
   }
+
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_TRACE_MODE, vm["trace-mode"].as<string>()));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_TRACE_COMPRESSION, vm["trace-compression"].as<bool>() ? "1" : "0"));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_FLUSH_INTERVAL_MS, to_string(vm["flush-interval-ms"].as<uint32_t>())));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_HIT_BUCKETS, vm["hit-buckets"].as<bool>() ? "1" : "0"));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_CONTEXT_DEPTH, to_string(vm["context-depth"].as<uint32_t>())));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_CMP_LOG, vm["cmp-log"].as<bool>() ? "1" : "0"));
+
+  // Before the fork server starts
+  setup_ld_preload(vm);
+
+  const shm::SHMConfig &shm_config = shm::SHMConfig::current();
+  ctx.environment.insert(
+      bp::environment::value_type(ENV_CAMPAIGN_ID, shm_config.campaign_id));
+  ctx.environment.insert(bp::environment::value_type(
+      ENV_SHM_SIZE_MB, to_string(shm_config.segment_size >> 20)));
+
+  fork_server_deferred = vm["fork-server-deferred"].as<bool>();
+  persistent = vm["persistent"].as<bool>();
+  persistent_iterations = vm["persistent-iterations"].as<uint32_t>();
+  persistent_max_rss_growth =
+      vm["persistent-max-rss-growth-mb"].as<uint32_t>() * 1024 * 1024;
+
+  if (persistent) {
+    if (!start_fork_server()) {
+      LOG(ERROR) << "Cannot start the persistent target (is it a harness "
+                    "defining LLVMFuzzerTestOneInput?)";
+    }
+  } else if (vm["fork-server"].as<bool>()) {
+    if (!start_fork_server()) {
+      LOG(ERROR) << "Cannot use the fork server, the target will be launched "
+                    "for each testcase";
+    }
+  }
+}
+
+// The libraries of `ld-preload` (separated by ':'), after the ones of an
+// LD_PRELOAD given with `environment`. That's how the SUT gets the libc
+// comparisons interception (dist/preload) for the token dictionary.
+void Commander::Impl::setup_ld_preload(const po::variables_map &vm) {
+  if (!vm.count("ld-preload"))
+    return;
+
+#if defined(__APPLE__)
+  const string ld_preload_env = "DYLD_INSERT_LIBRARIES";
+#else
+  const string ld_preload_env = "LD_PRELOAD";
+#endif
+  vector<string> libraries;
+  auto it = env.find(ld_preload_env);
+  if (it != env.end())
+    libraries.push_back(it->second);
+
+  boost::char_separator<char> sep_colon(":");
+  boost::tokenizer<boost::char_separator<char>> tokens(
+      vm["ld-preload"].as<string>(), sep_colon);
+  for (auto &library : tokens) {
+    if (library.empty() || ld_preload.count(library))
+      continue;
+    if (!fs::exists(library)) {
+      LOG(ERROR) << "Cannot find the library to preload: " << library;
+      continue;
+    }
+    ld_preload.insert(library);
+    libraries.push_back(fs::absolute(library).string());
+  }
+  if (libraries.empty())
+    return;
+
+  ctx.environment.erase(ld_preload_env);
+  ctx.environment.insert(bp::environment::value_type(
+      ld_preload_env, boost::algorithm::join(libraries, ":")));
+  LOG(INFO) << "Preloading in the target: " << ctx.environment[ld_preload_env];
 }
 
 // Split by ; then by =, and trim
@@ -543,6 +682,260 @@ bp::child Commander::Impl::__internal_exec(const vector<string> &process_args) {
 #endif
 }
 
+// Launch the target once, with the fork server pipes. The command line is
+// fixed for the lifetime of the server, so all the testcases are written to
+// the same input file (or to the shared memory in persistent mode).
+bool Commander::Impl::start_fork_server() {
+#if defined(BOOST_POSIX_API)
+  if (input_kind != E_COMMAND_FILE && !persistent) {
+    LOG(ERROR) << "The fork server requires the input to be passed as a file ("
+               << FILE_NEEDLE << ")";
+    return false;
+  }
+
+  vector<string> process_args(args);
+  if (input_kind == E_COMMAND_FILE) {
+    fork_server_input = (idir / FORK_SERVER_INPUT).string();
+    ba::replace_all(process_args[input_index], FILE_NEEDLE, fork_server_input);
+  }
+
+  vector<string> process_env;
+  for (auto &env_name_value : ctx.environment) {
+    process_env.push_back(env_name_value.first + "=" + env_name_value.second);
+  }
+  if (persistent) {
+    process_env.push_back(string(ENV_PERSISTENT) + "=1");
+  } else {
+    process_env.push_back(string(ENV_FORK_SERVER) + "=1");
+    if (fork_server_deferred) {
+      process_env.push_back(string(ENV_FORK_SERVER_DEFERRED) + "=1");
+    }
+  }
+
+  vector<char *> argv, envp;
+  for (auto &arg : process_args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+  for (auto &env_line : process_env)
+    envp.push_back(const_cast<char *>(env_line.c_str()));
+  envp.push_back(nullptr);
+
+  int ctl_pipe[2], st_pipe[2];
+  if (pipe(ctl_pipe) < 0) {
+    LOG(ERROR) << "Cannot create the fork server pipes: " << strerror(errno);
+    return false;
+  }
+  if (pipe(st_pipe) < 0) {
+    LOG(ERROR) << "Cannot create the fork server pipes: " << strerror(errno);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    return false;
+  }
+
+  // Our ends of the pipes must not leak into other targets we launch
+  fcntl(ctl_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(st_pipe[0], F_SETFD, FD_CLOEXEC);
+
+  // Don't get killed when writing to a dead fork server
+  signal(SIGPIPE, SIG_IGN);
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    LOG(ERROR) << "Cannot fork the fork server: " << strerror(errno);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    dup2(ctl_pipe[0], FORK_SERVER_CTL_FD);
+    dup2(st_pipe[1], FORK_SERVER_ST_FD);
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    if (!stream_target_stdout) {
+      const int null_fd = open("/dev/null", O_RDWR);
+      if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+      }
+    }
+
+    execve(executable.c_str(), argv.data(), envp.data());
+    _exit(1);
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+  fork_server_pid = pid;
+  fork_server_ctl_fd = ctl_pipe[1];
+  fork_server_st_fd = st_pipe[0];
+
+  // The runtime says hello once it reached the first instrumented function,
+  // or `__coverage_fork_here()` when deferred
+  uint32_t hello = 0;
+  if (!wait_readable(fork_server_st_fd, timeout_seconds * 1000) ||
+      !shm::fork_server_read(fork_server_st_fd, &hello, sizeof(hello)) ||
+      hello != FORK_SERVER_HELLO) {
+    LOG(ERROR) << "The target didn't start its fork server (is it linked "
+                  "with the instrumentation runtime?)";
+    stop_fork_server();
+    return false;
+  }
+
+  if (persistent) {
+    if (!persistent_shm) {
+      persistent_shm.reset(new shm::SHMFuzzerHandler(/*cleanup*/ false,
+                                                     /*remove_mutexes*/ false));
+    }
+    persistent_input = persistent_shm->inputs->get_create_input(pid);
+    persistent_num_runs = 0;
+    persistent_initial_rss = 0;
+  }
+
+  LOG(INFO) << "Fork server started with pid=" << fork_server_pid;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Commander::Impl::stop_fork_server() {
+  if (fork_server_ctl_fd >= 0)
+    close(fork_server_ctl_fd);
+  if (fork_server_st_fd >= 0)
+    close(fork_server_st_fd);
+  fork_server_ctl_fd = fork_server_st_fd = -1;
+
+  if (fork_server_pid > 0) {
+    kill_them_all(fork_server_pid);
+    if (persistent_shm)
+      persistent_shm->inputs->remove_input(fork_server_pid);
+  }
+  fork_server_pid = -1;
+  persistent_input = nullptr;
+}
+
+bool Commander::Impl::restart_fork_server() {
+  stop_fork_server();
+  return start_fork_server();
+}
+
+// Resident memory of a process, in bytes. 0 when not available.
+static size_t get_pid_rss(const bp::process::id_type pid) {
+#if BOOST_OS_LINUX
+  ifstream statm("/proc/" + to_string(pid) + "/statm");
+  size_t total_pages = 0, resident_pages = 0;
+  if (statm >> total_pages >> resident_pages) {
+    return resident_pages * sysconf(_SC_PAGESIZE);
+  }
+#endif
+  return 0;
+}
+
+bool Commander::Impl::should_recycle_persistent() {
+  ++persistent_num_runs;
+  if (persistent_iterations > 0 &&
+      persistent_num_runs >= persistent_iterations) {
+    return true;
+  }
+
+  if (persistent_max_rss_growth == 0)
+    return false;
+
+  // The first testcase warms up the harness, measure from there
+  const size_t rss = get_pid_rss(fork_server_pid);
+  if (persistent_num_runs == 1) {
+    persistent_initial_rss = rss;
+    return false;
+  }
+
+  if (rss > persistent_initial_rss + persistent_max_rss_growth) {
+    LOG(INFO) << "Recycle the persistent target pid=" << fork_server_pid
+              << ", its memory grew from " << persistent_initial_rss << " to "
+              << rss << " bytes";
+    return true;
+  }
+  return false;
+}
+
+// Run one testcase through the fork server. This is synchronous: the child
+// is reaped (or timed out) when this returns, and `status` is set to its
+// final status.
+bp::process::id_type Commander::Impl::fork_server_exec(uint64_t testcase_id,
+                                                       uint8_t *data,
+                                                       uint32_t size,
+                                                       ProcessStatus &status) {
+  if (persistent) {
+    if (size > PERSISTENT_INPUT_MAX_SIZE) {
+      LOG(ERROR) << "Truncate the input of testcase_id=" << testcase_id
+                 << " to " << PERSISTENT_INPUT_MAX_SIZE << " bytes";
+      size = PERSISTENT_INPUT_MAX_SIZE;
+    }
+    persistent_input->size = size;
+    std::memcpy(persistent_input->data, data, size);
+  } else {
+    ofstream file_contents(fork_server_input,
+                           ios::out | ios::binary | ios::trunc);
+    file_contents.write(reinterpret_cast<char *>(data), size * sizeof(uint8_t));
+    file_contents.close();
+  }
+
+  const uint64_t request = testcase_id;
+  int32_t child_pid = -1;
+  if (!shm::fork_server_write(fork_server_ctl_fd, &request, sizeof(request)) ||
+      !shm::fork_server_read(fork_server_st_fd, &child_pid,
+                             sizeof(child_pid)) ||
+      child_pid <= 0) {
+    if (persistent) {
+      LOG(ERROR) << "The persistent target died before testcase_id="
+                 << testcase_id;
+      restart_fork_server();
+      return -1;
+    }
+    LOG(ERROR) << "The fork server died, the target will be launched for each "
+                  "testcase";
+    stop_fork_server();
+    status = E_PROCESS_RUNNING;
+    return exec(testcase_id, data, size);
+  }
+
+  status = E_PROCESS_TERMINATED;
+  const int timeout_ms = timeout_seconds * 1000;
+  if (!wait_readable(fork_server_st_fd, timeout_ms)) {
+    // Same as the TimeoutWatcher, let the child publish its timeout first
+    timeout_kill(child_pid);
+    status = E_PROCESS_TIMEDOUT;
+    if (!wait_readable(fork_server_st_fd, timeout_ms)) {
+      kill(child_pid, SIGKILL);
+    }
+  }
+
+  int32_t child_status = 0;
+  if (!shm::fork_server_read(fork_server_st_fd, &child_status,
+                             sizeof(child_status))) {
+    if (persistent) {
+      // Crashed or timed out, the process monitor salvages its trace
+      LOG(INFO) << "The persistent target terminated with testcase_id="
+                << testcase_id << ", restart it";
+      restart_fork_server();
+    } else {
+      LOG(ERROR) << "The fork server died while running testcase_id="
+                 << testcase_id;
+      stop_fork_server();
+    }
+  } else if (persistent && should_recycle_persistent()) {
+    restart_fork_server();
+  }
+
+  return child_pid;
+}
+
 void Commander::initialize(bool no_cleanup) {
   if (command_line.empty())
     return;
@@ -564,19 +957,20 @@ void Commander::initialize(bool no_cleanup) {
 
   setup_environment();
   setup_post_processor();
-  setup_ld_preload();
 }
 
 void Commander::setup_environment() { return; }
 
 void Commander::setup_post_processor() { return; }
 
-void Commander::setup_ld_preload() { return; }
-
 bool Commander::call(uint64_t testcase_id, uint8_t *data, uint32_t size) {
   if (impl) {
     try {
-      const auto pid = impl->exec(testcase_id, data, size);
+      ProcessStatus status = E_PROCESS_RUNNING;
+      const auto pid =
+          impl->has_fork_server()
+              ? impl->fork_server_exec(testcase_id, data, size, status)
+              : impl->exec(testcase_id, data, size);
       if (pid < 0) {
         LOG(ERROR) << "Process call for testcase_id=" << testcase_id
                    << " failed";
@@ -584,6 +978,12 @@ bool Commander::call(uint64_t testcase_id, uint8_t *data, uint32_t size) {
       }
       LOG(INFO) << "Assign pid=" << pid << " with testcase_id=" << testcase_id;
 
+      // A persistent target reports the same pid for all its testcases, the
+      // previous one must have been picked up by the process monitor
+      if (impl->persistent) {
+        wait_processed_pid(pid);
+      }
+
       {
         testcase_pid_map_t::accessor acc;
         if (testcase_pids.insert(acc, pid)) {
@@ -591,7 +991,7 @@ bool Commander::call(uint64_t testcase_id, uint8_t *data, uint32_t size) {
         }
       }
 
-      child_processes.insert(pid);
+      child_processes.insert(pid, status);
       return true;
     } catch (exception &e) {
       LOG(ERROR) << "Exception: " << e.what();
@@ -607,6 +1007,23 @@ uint64_t Commander::get_testcase_id(const bp::process::id_type pid) const {
   return acc->second;
 }
 
+void Commander::wait_processed_pid(const bp::process::id_type pid) {
+  boost::timer::cpu_timer timer;
+  while (true) {
+    {
+      testcase_pid_map_t::const_accessor acc;
+      if (!testcase_pids.find(acc, pid))
+        return;
+    }
+    if (timer.elapsed().wall > child_processes.process_timeout_nanoseconds) {
+      LOG(ERROR) << "pid=" << pid << " was never processed, drop it";
+      processed_pid(pid);
+      return;
+    }
+    boost::this_thread::yield();
+  }
+}
+
 void Commander::processed_pid(const bp::process::id_type pid) {
   testcase_pid_map_t::accessor acc;
   if (!testcase_pids.find(acc, pid))
@@ -187,9 +187,9 @@ public:
 
 private:
   void initialize(bool no_cleanup);
+  void wait_processed_pid(const bp::process::id_type pid);
   void setup_environment();
   void setup_post_processor();
-  void setup_ld_preload();
 };
 }
 
@@ -1,6 +1,7 @@
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
 
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -105,8 +106,20 @@ int main(int argc, char *argv[]) {
       ("max-num-testcases", po::value<uint64_t>()->default_value(DEFAULT_MAX_NUM_TESTCASES), "maximum number of generated testcases")
       ("feedback-only", po::value<bool>()->default_value(false), "do not leverage goals")
       ("grammar-mutations-only", po::value<bool>()->default_value(false), "only perform mutations based on a grammar")
-      ("fork-server", po::value<bool>()->default_value(false), "use the fork-server embedded in the SUT")
+      ("fork-server", po::value<bool>()->default_value(false), "use the fork-server embedded in the SUT (the input must be passed as __FILE__)")
+      ("fork-server-deferred", po::value<bool>()->default_value(false), "the fork-server starts when the SUT calls __coverage_fork_here() instead of at its first instrumented function")
+      ("persistent", po::value<bool>()->default_value(false), "run the testcases in-process: the SUT is a harness defining LLVMFuzzerTestOneInput, linked without main")
+      ("persistent-iterations", po::value<uint32_t>()->default_value(1000), "number of testcases run by a persistent SUT before it's restarted")
+      ("persistent-max-rss-growth-mb", po::value<uint32_t>()->default_value(256), "restart a persistent SUT when its memory grew by more than this since its first testcase (0 to disable)")
+      ("trace-mode", po::value<string>()->default_value("list"), "how the SUT shares its trace: \"list\" (full ordered trace) or \"edges\" (fixed-size map of bucketed edge hits)")
+      ("flush-interval-ms", po::value<uint32_t>()->default_value(0), "in the \"list\" trace mode, the SUT streams its trace to the shared memory from a background thread with this period (0 to only flush when its buffers are full and at exit)")
+      ("trace-compression", po::value<bool>()->default_value(false), "in the \"list\" trace mode, the SUT compresses its trace in the shared memory (delta, varint and run-length coding), for deep loops")
+      ("hit-buckets", po::value<bool>()->default_value(false), "in the \"list\" trace mode, the SUT only records a branch when its hit count enters a new bucket (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)")
+      ("context-depth", po::value<uint32_t>()->default_value(0), "tell edges apart by their calling context, hashed from this number of callers (0 to disable, at most 16). In the \"edges\" trace mode, the map can then no longer be resolved to blocks for the goals")
+      ("cmp-log", po::value<bool>()->default_value(false), "the SUT, instrumented with the cmp-log plugin argument, logs the operands of its integer comparisons, and a mutation substitutes them in the inputs (input-to-state)")
       ("max-num-processes", po::value<size_t>()->default_value(DEFAULT_MAX_NUM_PROCESSES), "maximum number of processes running at the same time")
+      ("campaign-id", po::value<string>()->default_value(""), "id of the campaign, to run several fuzzers on the same host without sharing their shared memory")
+      ("shm-size-mb", po::value<uint32_t>()->default_value(DEFAULT_SHM_SIZE_MB), "size of the shared memory segment of the campaign")
       ("dump-statistics", po::value<bool>()->default_value(true), "dump statistics related to the testcase generation")
       ("slow-mating-strategies", po::value<bool>()->default_value(false), "enable mating strategies that are computing intensive")
       ("evolution-timeout-seconds", po::value<uint32_t>()->default_value(DEFAULT_EVOLUTION_TIMEOUT_SECONDS), "maximum number of seconds one evolution in the GA can take")
@@ -120,7 +133,7 @@ int main(int argc, char *argv[]) {
 
     po::options_description transformation_options("Transformation options");
     transformation_options.add_options()
-      ("ld-preload", po::value<string>(), "value passed to LD_PRELOAD")
+      ("ld-preload", po::value<string>(), "libraries preloaded in the target (separated by ':'). With dist/preload/libinstr-preload, the buffers compared by strcmp, strncmp, memcmp and strstr feed a token dictionary")
       ("post-processor", po::value<string>(), "path to script for post-processing the fuzzed value");
 
     po::options_description target_options("Target options");
@@ -161,6 +174,11 @@ int main(int argc, char *argv[]) {
         instr::setupLogger("fuzzing.log");
       }
 
+      // The shared memory of the campaign is used by this process and the SUT
+      setenv(ENV_CAMPAIGN_ID, vm["campaign-id"].as<string>().c_str(), 1);
+      setenv(ENV_SHM_SIZE_MB,
+             std::to_string(vm["shm-size-mb"].as<uint32_t>()).c_str(), 1);
+
       FuzzerHandler fuzzer_handler(vm);
       if (!command_line.empty()) {
         fuzzer_handler.set_command_line(command_line);
@@ -141,6 +141,26 @@ MutationHandler::MutationHandler(const po::variables_map &vm) : vm(vm) {
   mutations.push_back(shared_ptr<Mutation>(new DuplicateByteMutator()));
   mutations.push_back(shared_ptr<Mutation>(new DuplicateBytesMutator()));
   mutations.push_back(shared_ptr<Mutation>(new ChangeASCIIIntegerMutator()));
+  if (vm["cmp-log"].as<bool>())
+    mutations.push_back(shared_ptr<Mutation>(new CmpOperandMutator()));
+  if (vm.count("ld-preload"))
+    add_token_mutator();
+}
+
+void MutationHandler::add_token_mutator() {
+  if (token_mutator)
+    return;
+  token_mutator = true;
+  mutations.push_back(shared_ptr<Mutation>(new TokenMutator()));
+}
+
+void MutationHandler::set_knowledge(ProgramKnowledge *k) {
+  // The static dictionary is known once the models are loaded
+  if (k && k->dictionary_size() > 0)
+    add_token_mutator();
+  knowledge = k;
+  for (auto &mutation : mutations)
+    mutation->set_knowledge(k);
 }
 
 shared_ptr<Mutation> MutationHandler::choice(utils::Rand &random) const {
@@ -459,6 +479,7 @@ void Evolver::evolve(unique_ptr<ProgramKnowledge> &k) {
 
   utils::Rand &rand_ref = *random;
   bool improved = false;
+  mutations.set_knowledge(k.get());
 
   LOG(INFO) << "Proceeding with " << generations << "th generation";
   LOG(INFO) << "Current population size: " << population->size();
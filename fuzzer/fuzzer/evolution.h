@@ -165,12 +165,19 @@ class MutationHandler {
   const po::variables_map &vm;
   std::vector<std::shared_ptr<Mutation>> mutations;
   ProgramKnowledge *knowledge = nullptr;
+  bool token_mutator = false;
+
+  // With the preload library, or a dictionary from the models
+  void add_token_mutator();
 
 public:
   MutationHandler(const po::variables_map &vm);
   MutationHandler(const MutationHandler &) = delete;
   MutationHandler &operator=(const MutationHandler &) = delete;
 
+  // Given to the mutations that use it
+  void set_knowledge(ProgramKnowledge *k);
+
   std::shared_ptr<Mutation> choice(utils::Rand &random) const;
 };
 
@@ -43,6 +43,9 @@ void FuzzerHandler::initialize() {
 
   disable_ui = vm["disable-ui"].as<bool>();
 
+  trace_mode = traceModeFromName(vm["trace-mode"].as<string>());
+  LOG(INFO) << "Traces are shared as: " << traceModeName(trace_mode);
+
   // The size of the population to use as the median. We'll allow for
   // deviation
   const uint32_t supplied_population_size =
@@ -70,9 +73,10 @@ void FuzzerHandler::initialize() {
   if (!skip_calling_target) {
     // When we skip the call target, for testing, there is no need to
     // instantiate the commander and shared memory reader.
-    commander = std::unique_ptr<Commander>(new Commander(vm, command_line));
+    // The shared memory must exist before the commander starts a fork server
     shm_handler = std::unique_ptr<SHMFuzzerHandler>(
         new SHMFuzzerHandler(/*cleanup*/ true));
+    commander = std::unique_ptr<Commander>(new Commander(vm, command_line));
   } else {
     mocker = std::unique_ptr<Mocker>(new Mocker(driver->random));
   }
@@ -106,6 +110,8 @@ void FuzzerHandler::initialize() {
     driver->knowledge =
         std::unique_ptr<ProgramKnowledge>(new ProgramKnowledge(/*mock*/ true));
   }
+  driver->knowledge->set_hit_buckets(vm["hit-buckets"].as<bool>());
+  driver->knowledge->set_context_depth(vm["context-depth"].as<uint32_t>());
 
   //
   init_seeds(supplied_population_size - seeds->values.size(),
@@ -218,16 +224,20 @@ void FuzzerProcessMonitor::operator()() {
 
   while (true) {
     if (processes.empty()) {
-      if (all_testscases_received.load() && !all_testscases_sent.load()) {
+      if (all_testscases_received.load() && !all_testscases_sent.load() &&
+          unsalvaged.empty()) {
         all_testscases_sent.store(true);
       }
+      retry_salvage();
       boost::this_thread::sleep(boost::posix_time::milliseconds(100));
       continue;
     }
 
     const auto pids = processes.get_terminated_processes();
-    if (pids.empty())
+    if (pids.empty()) {
+      retry_salvage();
       continue;
+    }
 
     // For each finished process we can get the trace and add it
     for (auto &m_pid : pids) {
@@ -235,17 +245,65 @@ void FuzzerProcessMonitor::operator()() {
       if (testcase_id < 1)
         continue;
 
-      if (m_pid.second == E_PROCESS_TIMEDOUT) {
-        // Communicate the timeout for this process...
-        // LOG(INFO) << "Push testcase " << testcase_id << " as timedout";
-        timed_out_queue.push(testcase_id);
-        all_processed.insert(testcase_id);
+      // Its trace is complete once what it didn't flush (e.g. it crashed) is
+      // salvaged, and its pid is kept until then
+      const bool timed_out = m_pid.second == E_PROCESS_TIMEDOUT;
+      if (salvage(m_pid.first, testcase_id)) {
+        processed(m_pid.first, testcase_id, timed_out);
       } else {
-        // LOG(INFO) << "Push testcase " << testcase_id;
-        queue.push(testcase_id);
-        all_processed.insert(testcase_id);
+        unsalvaged_t pending = {testcase_id, timed_out,
+                                boost::posix_time::microsec_clock::local_time()};
+        unsalvaged[m_pid.first] = pending;
       }
-      commander->processed_pid(m_pid.first);
+    }
+    retry_salvage();
+  }
+}
+
+void FuzzerProcessMonitor::processed(const int32_t pid,
+                                     const uint64_t testcase_id,
+                                     const bool timed_out) {
+  if (timed_out) {
+    // Communicate the timeout for this process...
+    // LOG(INFO) << "Push testcase " << testcase_id << " as timedout";
+    timed_out_queue.push(testcase_id);
+  } else {
+    // LOG(INFO) << "Push testcase " << testcase_id;
+    queue.push(testcase_id);
+  }
+  all_processed.insert(testcase_id);
+  fuzzer_handler.commander->processed_pid(pid);
+}
+
+bool FuzzerProcessMonitor::salvage(const int32_t pid,
+                                   const uint64_t testcase_id) {
+  shm::SHMFuzzerHandler *shm = fuzzer_handler.shm_handler.get();
+  try {
+    return shm->pending->salvage(pid, testcase_id, shm->container,
+                                 shm->edge_maps);
+  } catch (exception &e) {
+    LOG(ERROR) << "Cannot salvage the trace of pid=" << pid << ": "
+               << e.what();
+    return true;
+  }
+}
+
+void FuzzerProcessMonitor::retry_salvage() {
+  const auto now = boost::posix_time::microsec_clock::local_time();
+  for (auto it = unsalvaged.begin(); it != unsalvaged.end();) {
+    const unsalvaged_t &pending = it->second;
+    bool done = salvage(it->first, pending.testcase_id);
+    if (!done && now - pending.since > boost::posix_time::milliseconds(
+                                           MONITOR_SALVAGE_TIMEOUT_MS)) {
+      LOG(ERROR) << "pid=" << it->first << " never exited, process testcase "
+                 << pending.testcase_id << " without its pending trace";
+      done = true;
+    }
+    if (done) {
+      processed(it->first, pending.testcase_id, pending.timed_out);
+      it = unsalvaged.erase(it);
+    } else {
+      ++it;
     }
   }
 }
@@ -274,14 +332,16 @@ void FuzzerTraceRetriever::operator()() {
     if (timed_out_queue.try_pop(testcase_id)) {
       empty_queue = false;
       all_received.insert(testcase_id);
-      try {
-        // shm_handler->container->remove_trace(testcase_id);
-        ++processed_testcases;
-        all_processed.insert(testcase_id);
-      } catch (exception &e) {
+      // The edges recorded before the timeout count like any others
+      if (!process(testcase_id, /*timed_out*/ true)) {
+        try {
+          shm_handler->container->remove_trace(testcase_id);
+          shm_handler->edge_maps->remove_map(testcase_id);
+        } catch (exception &e) {
+          LOG(ERROR) << "FuzzerTraceRetriever- Exception: " << e.what();
+        }
         ++processed_testcases;
         all_processed.insert(testcase_id);
-        continue;
       }
     }
 
@@ -292,27 +352,60 @@ void FuzzerTraceRetriever::operator()() {
   }
 }
 
-bool FuzzerTraceRetriever::process(const uint64_t testcase_id) {
-  LOG(INFO) << "FuzzerTraceRetriever::process- receives " << testcase_id;
+bool FuzzerTraceRetriever::process(const uint64_t testcase_id,
+                                   const bool timed_out) {
+  LOG(INFO) << "FuzzerTraceRetriever::process- receives " << testcase_id
+            << (timed_out ? " (timed out)" : "");
 
   if (testcase_id < 1) {
     LOG(INFO) << "Non-valid testcase_id " << testcase_id;
     return true;
   }
 
+  // Published before the trace by the runtime
+  if (CmpLogContainer::cmp_log_t *cmp_log =
+          shm_handler->cmp_logs->get_log(testcase_id)) {
+    fuzzer_handler.driver->knowledge->add_cmp_log(*cmp_log);
+    shm_handler->cmp_logs->remove_log(testcase_id);
+  }
+  if (TokenLogContainer::token_log_t *token_log =
+          shm_handler->token_logs->get_log(testcase_id)) {
+    fuzzer_handler.driver->knowledge->add_token_log(*token_log);
+    shm_handler->token_logs->remove_log(testcase_id);
+  }
+
+  if (fuzzer_handler.trace_mode == E_TRACE_MODE_EDGE_MAP) {
+    EdgeMapContainer::edge_map_t *edge_map =
+        shm_handler->edge_maps->get_map(testcase_id);
+    if (!edge_map) {
+      LOG(INFO) << "Cannot retrieve edge map for testcase_id=" << testcase_id;
+      return false;
+    }
+    try {
+      fuzzer_handler.driver->knowledge->add_edge_map(testcase_id, *edge_map);
+      LOG(INFO) << "Processed testcase_id=" << testcase_id;
+      ++processed_testcases;
+      all_processed.insert(testcase_id);
+    } catch (exception &e) {
+      LOG(ERROR) << "FuzzerTraceRetriever::process- Exception: " << e.what();
+    }
+    shm_handler->edge_maps->remove_map(testcase_id);
+    return true;
+  }
+
   Container::trace_t *trace = shm_handler->container->get_trace(testcase_id);
   if (trace) {
     try {
       // LOG(INFO) << "Add trace for " << testcase_id;
       fuzzer_handler.driver->knowledge->add_trace(testcase_id, *trace);
-      // LOG(INFO) << " Remove SHM trace for " << testcase_id;
-      // shm_handler->container->remove_trace(testcase_id);
       LOG(INFO) << "Processed testcase_id=" << testcase_id;
       ++processed_testcases;
       all_processed.insert(testcase_id);
     } catch (exception &e) {
       LOG(ERROR) << "FuzzerTraceRetriever::process- Exception: " << e.what();
     }
+    // The knowledge keeps what it needs, the SHM can be reused right away
+    shm_handler->container->remove_trace(testcase_id);
     return true;
   } else {
     LOG(INFO) << "Cannot retrieve trace for testcase_id=" << testcase_id;
@@ -342,6 +435,8 @@ void FuzzerHandler::single_threaded_loop() {
   const double one_evolution_timeout_seconds =
       (double)(vm["evolution-timeout-seconds"].as<uint32_t>());
   const size_t max_concurrent_processes = vm["max-num-processes"].as<size_t>();
+  const double target_timeout_seconds =
+      (double)(vm["target-timeout-seconds"].as<uint32_t>());
 
   FuzzerProcessMonitor process_monitor(*this, available_testcases,
                                        timedout_testcases);
@@ -382,6 +477,24 @@ void FuzzerHandler::single_threaded_loop() {
         boost::this_thread::sleep(boost::posix_time::milliseconds(1));
       }
 
+      // Backpressure: when the SHM is almost full, let the trace retriever
+      // ingest and free the pending traces before spawning more processes
+      if (!skip_calling_target && shm_handler->red_free_size()) {
+        LOG(INFO) << "SHM almost full (" << shm_handler->free_size()
+                  << " bytes free), waiting for the pending traces";
+        utils::timer_t backpressure_timer;
+        while (shm_handler->red_free_size() &&
+               current_testcase_ids.size() >
+                   trace_retriever.processed_testcases.load() &&
+               backpressure_timer.seconds() < target_timeout_seconds) {
+          boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        }
+        if (shm_handler->red_free_size()) {
+          LOG(ERROR) << "SHM still almost full after ingesting the traces ("
+                     << shm_handler->free_size() << " bytes free)";
+        }
+      }
+
       // Assign the testcase id
       ++current_testcase_id;
       ++generated_testcases;
@@ -457,8 +570,6 @@ void FuzzerHandler::single_threaded_loop() {
 
       LOG(INFO) << "All processes are accounted for.";
 
-      // reset_shared_memory(&trace_retriever);
-
       // Communicate the coverage for this run to the UI
       if (!disable_ui) {
         handler_ui->consume_local_coverage(
@@ -489,14 +600,6 @@ void FuzzerHandler::single_threaded_loop() {
   crash_analyzer_thread.join();
 }
 
-void FuzzerHandler::reset_shared_memory(FuzzerTraceRetriever *trace_retriever) {
-  LOG(ERROR) << "Had to reset the shared memory due to timeouts";
-  shm_handler.reset(new SHMFuzzerHandler(/*cleanup*/ true));
-  boost::this_thread::sleep(boost::posix_time::seconds(1));
-  trace_retriever->shm_handler.reset(new SHMRuntimeWriter());
-  boost::this_thread::sleep(boost::posix_time::seconds(1));
-}
-
 void FuzzerHandler::multi_threaded_loop(const uint32_t num_threads) {
   using namespace threading;
 
@@ -549,13 +652,41 @@ FuzzerHandler::isolated_evaluation(const std::string &input_buffer) {
 
   if (local_commander.call(input_testcase_id, raw_buffer, length)) {
     // wait for having access to this very testcase...
+    std::set<int32_t> terminated;
     while (true) {
       boost::this_thread::sleep(boost::posix_time::microseconds(10));
+      // A crashed process leaves its end in its pending trace
+      for (auto &m_pid : local_commander.processes().get_terminated_processes())
+        terminated.insert(m_pid.first);
+      for (auto it = terminated.begin(); it != terminated.end();) {
+        if (isolated_shm_handler.pending->salvage(
+                *it, input_testcase_id, isolated_shm_handler.container,
+                isolated_shm_handler.edge_maps)) {
+          it = terminated.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (trace_mode == E_TRACE_MODE_EDGE_MAP) {
+        EdgeMapContainer::edge_map_t *edge_map =
+            isolated_shm_handler.edge_maps->get_map(input_testcase_id);
+        if (edge_map) {
+          result =
+              driver->knowledge->evaluate_edge_map(input_testcase_id, *edge_map);
+          isolated_shm_handler.edge_maps->remove_map(input_testcase_id);
+          isolated_shm_handler.cmp_logs->remove_log(input_testcase_id);
+          isolated_shm_handler.token_logs->remove_log(input_testcase_id);
+          break;
+        }
+        continue;
+      }
       Container::trace_t *trace =
           isolated_shm_handler.container->get_trace(input_testcase_id);
       if (trace) {
         result = driver->knowledge->evaluate_trace(input_testcase_id, *trace);
         isolated_shm_handler.container->remove_trace(input_testcase_id);
+        isolated_shm_handler.cmp_logs->remove_log(input_testcase_id);
+        isolated_shm_handler.token_logs->remove_log(input_testcase_id);
         break;
       }
     }
@@ -620,6 +751,11 @@ void FuzzerMonitor::operator()() {
               << ", rate: " << (current_gen_testcases / num_seconds) << "/s. "
               << "Currently at " << fuzzer_handler.driver->evolver->generations
               << "th generation";
+    if (fuzzer_handler.shm_handler) {
+      LOG(INFO) << "[Monitor] SHM free: "
+                << (fuzzer_handler.shm_handler->free_size() >> 20) << "MB of "
+                << (fuzzer_handler.shm_handler->size() >> 20) << "MB";
+    }
   }
 }
 
@@ -16,6 +16,7 @@
 
 #include "tbb/concurrent_queue.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
@@ -29,6 +30,10 @@ namespace bl = boost::lockfree;
 
 namespace fuzz {
 
+// How long a terminated process can take to exit before its testcase is
+// processed without salvaging its pending trace
+#define MONITOR_SALVAGE_TIMEOUT_MS 10000
+
 namespace ui {
 struct WebSocketServer; // fwd declaration
 struct UICrashReader;   // fwd declaration
@@ -62,6 +67,7 @@ class FuzzerHandler {
   bool skip_calling_target = false;
   bool disable_ui = false;
   std::string command_line;
+  shm::TraceMode trace_mode = shm::E_TRACE_MODE_LIST;
 
   MemoryManager memory;
 
@@ -106,7 +112,6 @@ private:
   void init_seeds(const uint32_t remaining_places,
                   const uint32_t population_deviation);
 
-  void reset_shared_memory(FuzzerTraceRetriever *trace_retriever);
   void clear_queue(testcase_queue_t &queue);
 
   void multi_threaded_loop(const uint32_t num_threads);
@@ -166,6 +171,15 @@ struct FuzzerProcessMonitor {
   testcase_queue_t &timed_out_queue;
   std::set<uint64_t> all_processed;
 
+  // Terminated pids whose pending trace couldn't be salvaged yet because they
+  // were still exiting. Their testcase is only pushed once it's salvaged.
+  struct unsalvaged_t {
+    uint64_t testcase_id;
+    bool timed_out;
+    boost::posix_time::ptime since;
+  };
+  std::map<int32_t, unsalvaged_t> unsalvaged;
+
   std::atomic_bool all_testscases_received;
   std::atomic_bool all_testscases_sent;
 
@@ -180,6 +194,16 @@ struct FuzzerProcessMonitor {
   void operator()();
 
   void clear();
+
+private:
+  // Move what a terminated process didn't flush into its trace, timed out
+  // or not. Returns false if it's still running, it's then retried later.
+  bool salvage(const int32_t pid, const uint64_t testcase_id);
+  void retry_salvage();
+
+  // Hand the testcase of a salvaged process to the trace retrievers
+  void processed(const int32_t pid, const uint64_t testcase_id,
+                 const bool timed_out);
 };
 
 struct FuzzerTraceRetriever {
@@ -209,7 +233,10 @@ struct FuzzerTraceRetriever {
 
   void operator()();
 
-  bool process(const uint64_t testcase_id);
+  // Score the trace (or edge map) of the testcase. A timed out testcase is
+  // scored on what it recorded before it was killed, its trace ends with
+  // E_TIMEDOUT. Returns false if there is nothing to score.
+  bool process(const uint64_t testcase_id, const bool timed_out = false);
 
   void clear();
 };
@@ -8,6 +8,8 @@ using namespace instr;
 #include <boost/graph/graphviz.hpp>
 namespace bgl = boost;
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <memory>
@@ -23,8 +25,7 @@ namespace fuzz {
 // ProgramKnowledge
 //
 ProgramKnowledge::ProgramKnowledge(const string &models_file)
-    : blind(false), store(new Store(models_file)),
-      block_cache(new lru_cache_t(LRU_CACHE_SIZE)) {
+    : blind(false), store(new Store(models_file)) {
   LOG(INFO) << store->toString();
   initialize();
 }
@@ -37,6 +38,150 @@ ProgramKnowledge::ProgramKnowledge(const bool blind) : blind(blind) {
 
 void ProgramKnowledge::initialize() {
   coverage = std::unique_ptr<Coverage>(new Coverage(*this));
+  if (store) {
+    index_blocks();
+    index_edges();
+    build_dictionary();
+  }
+}
+
+// Lay out the block elements of each function by internal block id, so
+// `get_block_element` is two array lookups
+void ProgramKnowledge::index_blocks() {
+  function_blocks.assign(
+      store->store().global_id + 1,
+      std::pair<uint32_t, uint32_t>(KNOWLEDGE_NO_BLOCKS, 0));
+  function_levels.assign(store->store().global_id + 1,
+                         FunctionElement::L_EDGE);
+
+  for (auto &elmt_iter : elements()) {
+    auto elmt = elmt_iter.second;
+    if (!elmt || elmt->getKind() != Element::E_FUNCTION)
+      continue;
+
+    auto func_elmt = std::static_pointer_cast<FunctionElement>(elmt);
+    function_levels[func_elmt->getId()] = func_elmt->level;
+    uint32_t num_blocks = 0;
+    for (auto &block_elmt_id : func_elmt->blocks) {
+      auto block_elmt =
+          std::static_pointer_cast<BlockElement>(elements()[block_elmt_id]);
+      if (block_elmt)
+        num_blocks = std::max(num_blocks, block_elmt->internal_block_id + 1);
+    }
+
+    const uint32_t offset = (uint32_t)block_elements.size();
+    function_blocks[func_elmt->getId()] = std::make_pair(offset, num_blocks);
+    block_elements.resize(offset + num_blocks, ERROR_ID);
+    for (auto &block_elmt_id : func_elmt->blocks) {
+      auto block_elmt =
+          std::static_pointer_cast<BlockElement>(elements()[block_elmt_id]);
+      if (block_elmt)
+        block_elements[offset + block_elmt->internal_block_id] = block_elmt_id;
+    }
+  }
+}
+
+// Compute the edge map index of all the CFG edges of the edge table of the
+// models, so an edge map can be translated back into blocks (for the goals
+// and the UI). On collisions, the first edge wins.
+void ProgramKnowledge::index_edges() {
+  edge_elements.assign(EDGE_MAP_SIZE, ERROR_ID);
+
+  for (auto &edge : store->store().edges) {
+    // The function entry
+    if (edge.cur_block_id == ERROR_ID) {
+      element_id &slot = edge_elements[shm::edge_index(edge.func_id, 0, 0)];
+      if (slot == ERROR_ID)
+        slot = edge.func_id;
+      continue;
+    }
+
+    auto cur_elmt =
+        std::static_pointer_cast<BlockElement>(elements()[edge.cur_block_id]);
+    auto pred_elmt =
+        std::static_pointer_cast<BlockElement>(elements()[edge.pred_block_id]);
+    if (!cur_elmt || !pred_elmt)
+      continue;
+
+    element_id &slot = edge_elements[shm::edge_index(
+        edge.func_id, pred_elmt->internal_block_id,
+        cur_elmt->internal_block_id)];
+    if (slot == ERROR_ID)
+      slot = edge.cur_block_id;
+  }
+
+  // A function instrumented at L_FUNCTION only has its entry in the traces.
+  // The ENTRY block of a CFG has its last internal id and no statement: the
+  // entry reaches its successor when there's only one.
+  std::map<element_id, std::set<element_id>> successors;
+  for (auto &edge : store->store().edges) {
+    if (edge.cur_block_id != ERROR_ID &&
+        get_function_level(edge.func_id) == FunctionElement::L_FUNCTION)
+      successors[edge.pred_block_id].insert(edge.cur_block_id);
+  }
+  for (element_id func_id = 0; func_id < function_levels.size(); func_id++) {
+    const std::pair<uint32_t, uint32_t> &blocks = function_blocks[func_id];
+    if (function_levels[func_id] != FunctionElement::L_FUNCTION ||
+        blocks.first == KNOWLEDGE_NO_BLOCKS || blocks.second == 0)
+      continue;
+    const element_id entry_id =
+        block_elements[blocks.first + blocks.second - 1];
+    if (entry_id == ERROR_ID)
+      continue;
+    const std::set<element_id> &entry_successors = successors[entry_id];
+    const element_id reached_id = entry_successors.size() == 1
+                                      ? *entry_successors.begin()
+                                      : entry_id;
+    entry_blocks[func_id] = reached_id;
+
+    element_id &slot = edge_elements[shm::edge_index(func_id, 0, 0)];
+    if (slot == func_id)
+      slot = reached_id;
+  }
+}
+
+// Seed the dictionary with the literals of the branch conditions found by the
+// instrumentation. An integer is compared after conversion from the input in
+// any byte order, or parsed from text.
+void ProgramKnowledge::build_dictionary() {
+  for (auto &elmt_iter : elements()) {
+    auto elmt = elmt_iter.second;
+    if (!elmt || elmt->getKind() != Element::E_CONDITION)
+      continue;
+
+    auto condition_elmt = std::static_pointer_cast<ConditionElement>(elmt);
+    for (auto &literal : condition_elmt->string_literals) {
+      add_token(reinterpret_cast<const uint8_t *>(literal.data()),
+                std::min<size_t>(literal.size(), TOKEN_MAX_SIZE));
+    }
+
+    for (auto &literal : condition_elmt->integer_literals) {
+      if (literal.empty() || literal.size() > sizeof(uint64_t))
+        continue;
+      std::string big_endian(literal.rbegin(), literal.rend());
+      add_token(reinterpret_cast<const uint8_t *>(literal.data()),
+                literal.size());
+      add_token(reinterpret_cast<const uint8_t *>(big_endian.data()),
+                big_endian.size());
+
+      uint64_t value = 0;
+      for (size_t i = 0; i < literal.size(); i++)
+        value |= (uint64_t)(uint8_t)literal[i] << (8 * i);
+      const unsigned int bits = 8 * literal.size();
+      int64_t signed_value = (int64_t)value;
+      if (bits < 64 && (value >> (bits - 1)) & 1)
+        signed_value = (int64_t)(value | (~0ull << bits));
+      const std::string text = std::to_string(signed_value);
+      add_token(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+    }
+  }
+
+  // The preload tokens never evict the first half of the static ones
+  std::lock_guard<std::mutex> lock(tokens_mutex);
+  static_tokens = std::min<size_t>(tokens.size(), KNOWLEDGE_DICTIONARY_SIZE / 2);
+  tokens_next = static_tokens;
+  LOG(INFO) << "Dictionary of " << tokens.size()
+            << " tokens from the condition literals";
 }
 
 void ProgramKnowledge::create_mocking_random() {
@@ -62,6 +207,95 @@ void ProgramKnowledge::add_trace(const uint64_t testcase_id,
   coverage->add_trace(testcase_id, trace);
 }
 
+void ProgramKnowledge::add_edge_map(const uint64_t testcase_id,
+                                    const shm::EdgeMap &edge_map) {
+  coverage->add_edge_map(testcase_id, edge_map);
+}
+
+measure::trace_score_t
+ProgramKnowledge::evaluate_edge_map(const uint64_t testcase_id,
+                                    const shm::EdgeMap &edge_map) {
+  return coverage->evaluate_edge_map(testcase_id, edge_map);
+}
+
+void ProgramKnowledge::set_hit_buckets(const bool enabled) {
+  coverage->set_hit_buckets(enabled);
+}
+
+void ProgramKnowledge::set_context_depth(const uint32_t depth) {
+  coverage->set_context_depth(std::min<uint32_t>(depth, CONTEXT_MAX_DEPTH));
+}
+
+void ProgramKnowledge::add_cmp_log(const shm::CmpLog &cmp_log) {
+  std::lock_guard<std::mutex> lock(cmp_mutex);
+  const uint32_t size = std::min<uint32_t>(cmp_log.size, CMP_LOG_SIZE);
+  for (uint32_t i = 0; i < size; i++) {
+    const shm::CmpOperands &operands = cmp_log.entries[i];
+    const cmp_key_t key(operands.width, operands.lhs, operands.rhs);
+    if (cmp_keys.find(key) != cmp_keys.end())
+      continue;
+
+    if (cmp_operands.size() < KNOWLEDGE_CMP_POOL_SIZE) {
+      cmp_operands.push_back(operands);
+    } else {
+      shm::CmpOperands &oldest = cmp_operands[cmp_next];
+      cmp_keys.erase(cmp_key_t(oldest.width, oldest.lhs, oldest.rhs));
+      oldest = operands;
+      cmp_next = (cmp_next + 1) % KNOWLEDGE_CMP_POOL_SIZE;
+    }
+    cmp_keys.insert(key);
+  }
+}
+
+bool ProgramKnowledge::random_cmp_operands(utils::Rand &random,
+                                           shm::CmpOperands &operands) {
+  std::lock_guard<std::mutex> lock(cmp_mutex);
+  if (cmp_operands.empty())
+    return false;
+  operands = cmp_operands[random.next_number(cmp_operands.size())];
+  return true;
+}
+
+void ProgramKnowledge::add_token(const uint8_t *data, const size_t size) {
+  if (!size)
+    return;
+  std::string token(reinterpret_cast<const char *>(data), size);
+  std::lock_guard<std::mutex> lock(tokens_mutex);
+  if (token_set.find(token) != token_set.end())
+    return;
+
+  if (tokens.size() < KNOWLEDGE_DICTIONARY_SIZE) {
+    tokens.push_back(token);
+  } else {
+    token_set.erase(tokens[tokens_next]);
+    tokens[tokens_next] = token;
+    tokens_next = static_tokens + (tokens_next + 1 - static_tokens) %
+                                      (KNOWLEDGE_DICTIONARY_SIZE - static_tokens);
+  }
+  token_set.insert(token);
+}
+
+void ProgramKnowledge::add_token_log(const shm::TokenLog &token_log) {
+  const uint32_t size = std::min<uint32_t>(token_log.size, TOKEN_LOG_SIZE);
+  for (uint32_t i = 0; i < size; i++) {
+    const shm::Token &token = token_log.entries[i];
+    add_token(token.data, std::min<uint32_t>(token.size, TOKEN_MAX_SIZE));
+  }
+}
+
+bool ProgramKnowledge::random_token(utils::Rand &random, std::string &token) {
+  std::lock_guard<std::mutex> lock(tokens_mutex);
+  if (tokens.empty())
+    return false;
+  token = tokens[random.next_number(tokens.size())];
+  return true;
+}
+
+size_t ProgramKnowledge::dictionary_size() {
+  std::lock_guard<std::mutex> lock(tokens_mutex);
+  return tokens.size();
+}
+
 const std::map<instr::element_id, uint32_t> &
 ProgramKnowledge::get_local_coverage() const {
   return coverage->get_local_coverage();
@@ -85,8 +319,6 @@ const score_map &ProgramKnowledge::get_goals_scores() const {
 
 void ProgramKnowledge::reset_scores() { coverage->reset_scores(); }
 
-// That's a lot of work to get that... The LRU cache is just a poor man
-// solution currently used.
 element_id ProgramKnowledge::get_block_element(const element_id func_id,
                                                const uint32_t block_id) {
   if (blind) {
@@ -99,55 +331,41 @@ element_id ProgramKnowledge::get_block_element(const element_id func_id,
                                : func_id + block_id * block_id;
   }
 
-  const lru_cache_key_t cache_key = lru_cache_key_t(func_id, block_id);
-  if (block_cache->exists(cache_key)) {
-    return block_cache->copy_get(cache_key);
-  }
-
-  auto elmt = elements()[func_id];
-  if (!elmt) {
+  if (func_id >= function_blocks.size() ||
+      function_blocks[func_id].first == KNOWLEDGE_NO_BLOCKS) {
     LOG(ERROR) << "Unknown function " << func_id;
     return ERROR_ID;
   }
 
-  if (elmt->getKind() != Element::E_FUNCTION) {
-    LOG(ERROR) << "Got a weird kind for func_id: " << elmt->getKind();
-    block_cache->put(cache_key, ERROR_ID);
-    return ERROR_ID;
-  }
-
-  auto func_elmt = std::static_pointer_cast<FunctionElement>(elmt);
-
-  for (auto &block_elmt_id : func_elmt->blocks) {
-    auto be = elements()[block_elmt_id];
-    auto block_elmt = std::static_pointer_cast<BlockElement>(be);
-    if (block_elmt->internal_block_id == block_id) {
-      block_cache->put(cache_key, block_elmt_id);
-      return block_elmt_id;
-    }
+  const std::pair<uint32_t, uint32_t> &blocks = function_blocks[func_id];
+  const element_id block_elmt_id =
+      block_id < blocks.second ? block_elements[blocks.first + block_id]
+                               : ERROR_ID;
+  if (block_elmt_id == ERROR_ID) {
+    LOG(ERROR) << "Couldn't find the block " << block_id
+               << " for the given func_id: " << func_id;
   }
-
-  LOG(ERROR) << "Couldn't find the block " << block_id
-             << " for the given func_id: " << func_id;
-  block_cache->put(cache_key, ERROR_ID);
-  return ERROR_ID;
+  return block_elmt_id;
 }
 
 //
 // Coverage methods
 //
 Coverage::Coverage(ProgramKnowledge &knowledge)
-    : knowledge(knowledge), vertex_cache(new lru_cache_t(LRU_CACHE_SIZE)) {}
+    : knowledge(knowledge), virgin_edges(EDGE_MAP_SIZE, 0xff),
+      vertex_cache(new lru_cache_t(LRU_CACHE_SIZE)) {}
 
 void Coverage::add_trace(const uint64_t testcase_id,
                          shm::Container::trace_t &trace) {
-  size_t num_elements = 0;
-  for (auto &trace_element : trace) {
+  // Linear scan of each contiguous chunk of the trace
+  edge_counts_t edge_counts;
+  trace.for_each_element([&](const shm::TraceElement &trace_element) {
     add_trace_element(testcase_id, trace_element);
-    num_elements++;
-  }
+    count_edge(trace_element, edge_counts);
+  });
+  add_hit_buckets(testcase_id, edge_counts, /*mock*/ false);
   LOG(INFO) << "Coverage: testcase_id=" << testcase_id
-            << " trace_size=" << num_elements;
+            << " trace_size=" << trace.size();
 }
 
 void Coverage::add_trace(const uint64_t testcase_id,
@@ -171,9 +389,12 @@ Coverage::evaluate_trace(const uint64_t testcase_id,
   update_coverage_score(testcase_id, 0, 0, /*initialize*/ true);
   update_goal_score(testcase_id, 0, 0, /*initialize*/ true);
 
-  for (auto &trace_element : trace) {
+  edge_counts_t edge_counts;
+  trace.for_each_element([&](const shm::TraceElement &trace_element) {
     add_trace_element(testcase_id, trace_element, /*mock*/ true, &trace_list);
-  }
+    count_edge(trace_element, edge_counts);
+  });
+  add_hit_buckets(testcase_id, edge_counts, /*mock*/ true);
 
   // We don't have the size here...
   m_result.goal = goal_scores[testcase_id];
@@ -185,8 +406,139 @@ Coverage::evaluate_trace(const uint64_t testcase_id,
   return result;
 }
 
+void Coverage::count_edge(const shm::TraceElement &trace_element,
+                          edge_counts_t &edge_counts) {
+  uint32_t context = 0;
+  if (context_depth) {
+    call_stack_t &stack = edge_counts.call_stacks[trace_element.thread_id];
+    if (trace_element.kind == shm::E_ENTER_FUNCTION) {
+      stack.functions.push_back((uint32_t)trace_element.func_id);
+      stack.context = shm::context_hash(
+          stack.functions.data(), stack.functions.size(), context_depth);
+    } else if (trace_element.kind == shm::E_EXIT_FUNCTION &&
+               !stack.functions.empty()) {
+      stack.functions.pop_back();
+      stack.context = shm::context_hash(
+          stack.functions.data(), stack.functions.size(), context_depth);
+    }
+    context = stack.context;
+  }
+
+  if (trace_element.cur_block_id == 0)
+    return;
+  const uint32_t index =
+      trace_element.kind == shm::E_FALSE_BRANCH
+          ? shm::skip_edge_index(trace_element.func_id,
+                                 trace_element.pred_block_id,
+                                 trace_element.cur_block_id)
+          : shm::edge_index(trace_element.func_id, trace_element.pred_block_id,
+                            trace_element.cur_block_id);
+  edge_counts.hits[index ^ context]++;
+  if (context)
+    edge_counts.in_context.insert(index ^ context);
+}
+
+// A known edge hit a number of times never seen before (e.g. one more
+// iteration of a loop) is new coverage too. Outside of a calling context,
+// its first bucket is already scored as a new edge of the graph.
+void Coverage::add_hit_buckets(const uint64_t testcase_id,
+                               const edge_counts_t &edge_counts, bool mock) {
+  uint32_t new_buckets = 0;
+  for (auto &edge_count : edge_counts.hits) {
+    const uint8_t bucket =
+        hit_buckets
+            ? shm::bucket_of_step(edge_count.second)
+            : shm::bucket_hits((uint8_t)std::min<uint32_t>(edge_count.second,
+                                                           0xff));
+    uint8_t &virgin = virgin_edges[edge_count.first];
+    if (!(virgin & bucket))
+      continue;
+    if (!mock) {
+      virgin &= ~bucket;
+    }
+    if (bucket > 1 ||
+        edge_counts.in_context.find(edge_count.first) !=
+            edge_counts.in_context.end())
+      new_buckets++;
+  }
+  if (new_buckets) {
+    update_coverage_score(testcase_id, new_buckets, new_buckets);
+  }
+}
+
+void Coverage::add_edge_map(const uint64_t testcase_id,
+                            const shm::EdgeMap &edge_map, bool mock,
+                            std::list<instr::element_id> *trace_list_ptr) {
+  uint32_t abs_score = 0, diff_score = 0;
+  size_t num_edges = 0;
+
+  // Maps are sparse, skip 8 empty entries at a time
+  for (size_t word = 0; word < EDGE_MAP_SIZE; word += sizeof(uint64_t)) {
+    uint64_t value;
+    std::memcpy(&value, edge_map.hits + word, sizeof(uint64_t));
+    if (!value)
+      continue;
+
+    for (size_t index = word; index < word + sizeof(uint64_t); index++) {
+      const uint8_t bucket = edge_map.hits[index];
+      if (!bucket)
+        continue;
+      num_edges++;
+
+      if (virgin_edges[index] & bucket) {
+        abs_score += 2;
+        diff_score += 1;
+        if (!mock) {
+          virgin_edges[index] &= ~bucket;
+        }
+      } else {
+        abs_score += 1;
+      }
+
+      // The calling contexts scramble the indexes
+      if (context_depth)
+        continue;
+      const element_id elmt_id = knowledge.get_edge_element(index);
+      if (elmt_id == ERROR_ID)
+        continue;
+      update_local_coverage(elmt_id);
+      if (trace_list_ptr != nullptr) {
+        trace_list_ptr->push_back(elmt_id);
+      }
+      lookup_goals(ERROR_ID, elmt_id, testcase_id);
+    }
+  }
+
+  update_coverage_score(testcase_id, abs_score, diff_score);
+  LOG(INFO) << "Coverage: testcase_id=" << testcase_id
+            << " edge_map_size=" << num_edges;
+}
+
+measure::trace_score_t
+Coverage::evaluate_edge_map(const uint64_t testcase_id,
+                            const shm::EdgeMap &edge_map) {
+  measure::trace_score_t result;
+
+  std::list<instr::element_id> trace_list;
+  measure::measure_t m_result;
+
+  update_coverage_score(testcase_id, 0, 0, /*initialize*/ true);
+  update_goal_score(testcase_id, 0, 0, /*initialize*/ true);
+
+  add_edge_map(testcase_id, edge_map, /*mock*/ true, &trace_list);
+
+  m_result.goal = goal_scores[testcase_id];
+  m_result.edge = coverage_scores[testcase_id];
+
+  result.first = trace_list;
+  result.second = m_result;
+
+  return result;
+}
+
 void Coverage::add_trace_element(const uint64_t testcase_id,
-                                 shm::TraceElement &trace_element, bool mock,
+                                 const shm::TraceElement &trace_element,
+                                 bool mock,
                                  std::list<instr::element_id> *trace_list_ptr) {
   if (trace_element.cur_block_id == 0) {
     // Record the visited functions in func_enter/func_exit boundaries
@@ -201,11 +553,45 @@ void Coverage::add_trace_element(const uint64_t testcase_id,
       } else {
         update_coverage_score(testcase_id, /*absolute*/ 1, /*diff*/ 0);
       }
+
+      // Without its blocks, entering the function is all we know about it
+      const element_id entry_block_elmt_id =
+          trace_element.kind == shm::E_ENTER_FUNCTION
+              ? knowledge.get_entry_block(trace_element.func_id)
+              : ERROR_ID;
+      if (entry_block_elmt_id != ERROR_ID) {
+        if (trace_list_ptr != nullptr) {
+          trace_list_ptr->push_back(entry_block_elmt_id);
+        }
+        lookup_goals(ERROR_ID, entry_block_elmt_id, testcase_id);
+      }
+    }
+    return;
+  }
+
+  // The block wasn't reached, only the direction of the branch is new
+  if (trace_element.kind == shm::E_FALSE_BRANCH) {
+    const branch_key_t key((uint32_t)trace_element.func_id,
+                           trace_element.pred_block_id,
+                           trace_element.cur_block_id);
+    if (not_taken_branches.find(key) == not_taken_branches.end()) {
+      update_coverage_score(testcase_id, /*absolute*/ 2, /*diff*/ 1);
+      if (!mock)
+        not_taken_branches.insert(key);
+    } else {
+      update_coverage_score(testcase_id, /*absolute*/ 1, /*diff*/ 0);
     }
     return;
   }
-  const element_id pred_block_elmt_id = knowledge.get_block_element(
-      trace_element.func_id, trace_element.pred_block_id);
+
+  // At L_BLOCK, the predecessor isn't recorded: the blocks hang off their
+  // function in the graph
+  const element_id pred_block_elmt_id =
+      knowledge.get_function_level(trace_element.func_id) ==
+              FunctionElement::L_BLOCK
+          ? (element_id)trace_element.func_id
+          : knowledge.get_block_element(trace_element.func_id,
+                                        trace_element.pred_block_id);
   const element_id cur_block_elmt_id = knowledge.get_block_element(
       trace_element.func_id, trace_element.cur_block_id);
 
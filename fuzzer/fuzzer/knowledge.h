@@ -18,8 +18,13 @@ namespace bgl = boost;
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 namespace fuzz {
 typedef measure::index_map index_map;
 typedef measure::score_map score_map;
@@ -28,38 +33,62 @@ typedef measure::trace_score_t trace_score_t;
 
 typedef std::map<instr::element_id, uint32_t> coverage_t;
 
-class Coverage;
+// Number of distinct comparison operands kept for `CmpOperandMutator`
+#define KNOWLEDGE_CMP_POOL_SIZE 4096
 
-class ProgramKnowledge {
-  friend class Coverage;
+// Number of tokens kept in the dictionary of `TokenMutator`
+#define KNOWLEDGE_DICTIONARY_SIZE 4096
 
-  typedef std::pair<instr::element_id, uint32_t> lru_cache_key_t;
-  typedef instr::element_id lru_cache_value_t;
+#define KNOWLEDGE_NO_BLOCKS 0xffffffff
 
-  struct hash_key_t {
-    size_t operator()(const lru_cache_key_t &e) const {
-      return std::hash<uint32_t>()(e.first) ^ std::hash<uint32_t>()(e.second);
-    }
-  };
-
-  struct equal_to_key_t {
-    bool operator()(const lru_cache_key_t &a, const lru_cache_key_t &b) const {
-      return a.first == b.first && a.second == b.second;
-    }
-  };
+class Coverage;
 
-  typedef cache::lru_cache<lru_cache_key_t, lru_cache_value_t, hash_key_t,
-                           equal_to_key_t>
-      lru_cache_t;
+class ProgramKnowledge {
+  friend class Coverage;
 
   bool blind = false;
   std::unique_ptr<instr::Store> store;
   std::unique_ptr<Coverage> coverage;
-  std::unique_ptr<lru_cache_t> block_cache;
+
+  // Block elements by function element_id and internal block id, see
+  // `index_blocks`: the blocks of function f start at
+  // block_elements[function_blocks[f].first], and there are
+  // function_blocks[f].second of them. KNOWLEDGE_NO_BLOCKS for the other
+  // elements.
+  std::vector<std::pair<uint32_t, uint32_t>> function_blocks;
+  std::vector<instr::element_id> block_elements;
+
+  // Instrumentation level of each function, by element_id
+  std::vector<instr::FunctionElement::Level> function_levels;
+
+  // For the functions instrumented at L_FUNCTION, the block reached when
+  // entering them, see `index_edges`
+  std::unordered_map<instr::element_id, instr::element_id> entry_blocks;
 
   // Only set when mocking models...
   std::unique_ptr<utils::Rand> random;
 
+  // Edge map index -> element_id, see `index_edges`
+  std::vector<instr::element_id> edge_elements;
+
+  // The most recent distinct operands of the comparisons logged by the
+  // runtime, a ring of KNOWLEDGE_CMP_POOL_SIZE. They're shared by all the
+  // individuals since the children of a cross-over don't have a trace yet.
+  typedef std::tuple<uint32_t, uint64_t, uint64_t> cmp_key_t;
+  std::mutex cmp_mutex;
+  std::vector<shm::CmpOperands> cmp_operands;
+  std::set<cmp_key_t> cmp_keys;
+  size_t cmp_next = 0;
+
+  // The token dictionary, filled with the literals of the models and the
+  // buffers compared by the SUT. Same bounded ring as the comparison
+  // operands, after the `static_tokens` first entries.
+  std::mutex tokens_mutex;
+  std::vector<std::string> tokens;
+  std::set<std::string> token_set;
+  size_t tokens_next = 0;
+  size_t static_tokens = 0;
+
 public:
   ProgramKnowledge() = delete;
   ProgramKnowledge(const ProgramKnowledge &) = delete;
@@ -78,9 +107,31 @@ public:
 
   instr::sources_t &sources() const { return store->store().sources; }
 
+  // The edge table of the instrumentation, by instr::edge_id
+  const instr::edges_t &edges() const { return store->store().edges; }
+
   instr::element_id get_block_element(const instr::element_id func_id,
                                       const uint32_t block_id);
 
+  // L_EDGE for unknown functions, and without models
+  instr::FunctionElement::Level
+  get_function_level(const instr::element_id func_id) const {
+    return func_id < function_levels.size() ? function_levels[func_id]
+                                            : instr::FunctionElement::L_EDGE;
+  }
+
+  // ERROR_ID unless the function is instrumented at L_FUNCTION
+  instr::element_id get_entry_block(const instr::element_id func_id) const {
+    auto iter = entry_blocks.find(func_id);
+    return iter == entry_blocks.end() ? instr::ERROR_ID : iter->second;
+  }
+
+  // Reverse lookup of an edge map index to the element (block, or function
+  // for function entries) it was computed from. ERROR_ID when unknown.
+  instr::element_id get_edge_element(const uint32_t index) const {
+    return edge_elements.empty() ? instr::ERROR_ID : edge_elements[index];
+  }
+
   //
   // Coverage methods
   //
@@ -99,6 +150,33 @@ public:
   void add_trace(const uint64_t testcase_id,
                  shm::Container::mocked_trace_t &trace);
 
+  void add_edge_map(const uint64_t testcase_id, const shm::EdgeMap &edge_map);
+
+  trace_score_t evaluate_edge_map(const uint64_t testcase_id,
+                                  const shm::EdgeMap &edge_map);
+
+  // The traces are recorded with ENV_HIT_BUCKETS
+  void set_hit_buckets(const bool enabled);
+
+  // ENV_CONTEXT_DEPTH of the runtime
+  void set_context_depth(const uint32_t depth);
+
+  // Keep the operands of a testcase with ENV_CMP_LOG
+  void add_cmp_log(const shm::CmpLog &cmp_log);
+
+  // Pick the operands of a logged comparison, false if there is none yet
+  bool random_cmp_operands(utils::Rand &random, shm::CmpOperands &operands);
+
+  void add_token(const uint8_t *data, const size_t size);
+
+  // Keep the tokens of a testcase logged by the preload library
+  void add_token_log(const shm::TokenLog &token_log);
+
+  // Pick a token of the dictionary, false if it's empty
+  bool random_token(utils::Rand &random, std::string &token);
+
+  size_t dictionary_size();
+
   void to_dot(const std::string &filename);
 
   std::pair<uint32_t, uint32_t> coverage_size();
@@ -108,6 +186,9 @@ public:
 private:
   void initialize();
   void create_mocking_random();
+  void index_blocks();
+  void index_edges();
+  void build_dictionary();
 };
 
 struct GoalScoringMechanism {
@@ -136,6 +217,10 @@ class Coverage {
 
   // XXX use a compact representation of sets of integers
   std::set<uint32_t> reached_functions;
+  // Branches seen not taken (E_FALSE_BRANCH), by (func_id, pred_block_id,
+  // cur_block_id)
+  typedef std::tuple<uint32_t, uint32_t, uint32_t> branch_key_t;
+  std::set<branch_key_t> not_taken_branches;
   std::set<instr::element_id> covered_goals;
   coverage_t local_coverage;
 
@@ -145,6 +230,26 @@ class Coverage {
 
   std::map<instr::element_id, score_t> mocked_scores;
 
+  // For the edge maps, the buckets never hit so far for each edge (AFL's
+  // virgin map). Starts with all bits set. Also used for the hit counts of
+  // the edges of the traces.
+  std::vector<uint8_t> virgin_edges;
+
+  // Number of times each edge appears in a trace, by edge map index. With
+  // a context depth, the index includes the calling context of the edge,
+  // from the function boundaries of each thread.
+  struct call_stack_t {
+    std::vector<uint32_t> functions;
+    uint32_t context = 0;
+  };
+  struct edge_counts_t {
+    std::unordered_map<uint32_t, uint32_t> hits;
+    std::unordered_set<uint32_t> in_context; // indexes with a calling context
+    std::map<uint64_t, call_stack_t> call_stacks; // by thread
+  };
+  bool hit_buckets = false;
+  uint32_t context_depth = 0;
+
   graph_t graph;
 
   typedef instr::element_id lru_cache_key_t;
@@ -183,10 +288,22 @@ public:
                  shm::Container::mocked_trace_t &trace);
 
   void
-  add_trace_element(const uint64_t testcase_id, shm::TraceElement &e,
+  add_trace_element(const uint64_t testcase_id, const shm::TraceElement &e,
+                    bool mock = false,
+                    std::list<instr::element_id> *trace_list_ptr = nullptr);
+
+  // Score a whole edge map at once: an edge is new when it's hit in a bucket
+  // that was never seen before for this edge.
+  void add_edge_map(const uint64_t testcase_id, const shm::EdgeMap &edge_map,
                     bool mock = false,
                     std::list<instr::element_id> *trace_list_ptr = nullptr);
 
+  trace_score_t evaluate_edge_map(const uint64_t testcase_id,
+                                  const shm::EdgeMap &edge_map);
+
+  void set_hit_buckets(const bool enabled) { hit_buckets = enabled; }
+  void set_context_depth(const uint32_t depth) { context_depth = depth; }
+
   template <class IntSetMap> class edge_writer {
   public:
     edge_writer(const IntSetMap &s) : s(s) {}
@@ -221,6 +338,13 @@ public:
 private:
   void update_local_coverage(const instr::element_id elmt);
 
+  void count_edge(const shm::TraceElement &trace_element,
+                  edge_counts_t &edge_counts);
+
+  // Score the buckets of the hit counts of a trace against `virgin_edges`
+  void add_hit_buckets(const uint64_t testcase_id,
+                       const edge_counts_t &edge_counts, bool mock);
+
   void update_coverage_score(const uint64_t testcase_id,
                              const uint32_t abs_score,
                              const uint32_t diff_score,
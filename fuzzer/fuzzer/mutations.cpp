@@ -269,6 +269,75 @@ Individual ChangeASCIIIntegerMutator::apply(utils::Rand &random,
   return c;
 }
 
+Individual CmpOperandMutator::apply(utils::Rand &random,
+                                    const Individual &i) const {
+  Individual c = i.clone();
+  shm::CmpOperands operands;
+  if (!knowledge || !knowledge->random_cmp_operands(random, operands))
+    return c;
+
+  const size_t size = c.memory.length(c.index);
+  uint8_t *buffer = c.memory.buffer(c.index);
+  const uint32_t width = std::min<uint32_t>(operands.width, 8);
+  if (!width || size < width)
+    return c;
+
+  // Either operand can be the one coming from the input
+  uint64_t from = operands.lhs, to = operands.rhs;
+  if (random.next_bool())
+    std::swap(from, to);
+  switch (random.next_number(3)) {
+  case 1:
+    to++;
+    break;
+  case 2:
+    to--;
+    break;
+  }
+
+  // [0] little endian, [1] big endian
+  uint8_t pattern[2][8], replacement[2][8];
+  for (uint32_t b = 0; b < width; b++) {
+    pattern[0][b] = pattern[1][width - 1 - b] = (uint8_t)(from >> (8 * b));
+    replacement[0][b] = replacement[1][width - 1 - b] =
+        (uint8_t)(to >> (8 * b));
+  }
+
+  // Start from a random offset so that every occurrence gets its chance
+  const size_t positions = size - width + 1;
+  const size_t start = random.next_number(positions);
+  for (size_t k = 0; k < positions; k++) {
+    const size_t offset = (start + k) % positions;
+    for (uint32_t order = 0; order < 2; order++) {
+      if (std::memcmp(buffer + offset, pattern[order], width) == 0) {
+        std::memcpy(buffer + offset, replacement[order], width);
+        return c;
+      }
+    }
+  }
+
+  std::memcpy(buffer + start, replacement[random.next_number(2)], width);
+  return c;
+}
+
+Individual TokenMutator::apply(utils::Rand &random, const Individual &i) const {
+  Individual c = i.clone();
+  std::string token;
+  if (!knowledge || !knowledge->random_token(random, token))
+    return c;
+
+  const size_t size = c.memory.length(c.index);
+  const bool insert = size < token.size() || random.next_bool();
+  const uint32_t offset =
+      random.next_number(insert ? size + 1 : size - token.size() + 1);
+  if (insert && !c.memory.insert_bytes(c.index, offset, token.size()))
+    return c;
+
+  uint8_t *buffer = c.memory.buffer(c.index);
+  std::memcpy(buffer + offset, token.data(), token.size());
+  return c;
+}
+
 #undef MAX_INPUT_SIZE_MULTIPLIER
 
 // end namespace=ga
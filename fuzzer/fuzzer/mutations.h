@@ -45,6 +45,22 @@ struct ChangeASCIIIntegerMutator : public Mutation {
   Individual apply(utils::Rand &random, const Individual &i) const;
 };
 
+// Input-to-state substitution: look for the bytes of one operand of a
+// comparison logged by the runtime (ENV_CMP_LOG) in the input, in little or
+// big endian, and replace them with the other operand, or with it +/- 1 for
+// the ordering comparisons. Without a match, the operand is written at a
+// random offset.
+struct CmpOperandMutator : public Mutation {
+  Individual apply(utils::Rand &random, const Individual &i) const;
+};
+
+// Insert a token of the dictionary of the knowledge (condition literals of
+// the models, and tokens of the preload library) at a random offset, or
+// overwrite the input with it
+struct TokenMutator : public Mutation {
+  Individual apply(utils::Rand &random, const Individual &i) const;
+};
+
 // end namespace=ga
 }
 // end namespace=fuzz
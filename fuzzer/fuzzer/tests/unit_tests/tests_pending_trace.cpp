@@ -0,0 +1,131 @@
+#define BOOST_TEST_MODULE PendingTrace Tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+#include <cstdint>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct PendingFixture {
+  const std::string name = "tests_pending_trace_" + std::to_string(getpid());
+  ipc::managed_shared_memory *segment;
+  Container *container;
+  EdgeMapContainer *edge_maps;
+  PendingTraceContainer *pending;
+
+  PendingFixture() {
+    ipc::shared_memory_object::remove(name.c_str());
+    segment = new ipc::managed_shared_memory(ipc::create_only, name.c_str(),
+                                             64 * 1024 * 1024);
+    container = new Container(segment, segment->get_segment_manager());
+    edge_maps = new EdgeMapContainer(segment);
+    pending = new PendingTraceContainer(segment);
+  }
+
+  ~PendingFixture() {
+    delete pending;
+    delete edge_maps;
+    delete container;
+    delete segment;
+    ipc::shared_memory_object::remove(name.c_str());
+  }
+
+  // Run `body` in a child that dies without flushing anything
+  template <typename F> int32_t run_child(F body) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      body();
+      _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return pid;
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(salvage_CrashedProcess, PendingFixture) {
+  const int32_t pid = run_child([this]() {
+    PendingTrace *trace = pending->create_pending(getpid(), 42, nullptr, nullptr);
+    PendingRing *ring = pending->create_ring(trace, 0);
+    TraceRecord records[2];
+    for (uint32_t i = 0; i < 10; i++) {
+      const size_t count = encode_trace_record(
+          TraceElement(E_TRUE_BRANCH, 0, 1, i, i + 1), 0, records);
+      for (size_t j = 0; j < count; j++)
+        ring->records[ring->head++ & (PENDING_RING_CAPACITY - 1)] = records[j];
+    }
+    trace->status.store(E_CRASHED);
+  });
+
+  BOOST_TEST(pending->salvage(pid, 42, container, edge_maps));
+  Container::trace_t *trace = container->get_trace(42);
+  BOOST_TEST_REQUIRE(trace != nullptr);
+  size_t count = 0;
+  TraceKind last = E_UNKNOWN;
+  for (const auto &element : *trace) {
+    last = element.kind;
+    count++;
+  }
+  BOOST_TEST(count == 11);
+  BOOST_TEST(last == E_CRASHED);
+
+  // It has been destroyed
+  const std::string pending_name = pending->get_pending_name(pid);
+  BOOST_TEST(!segment->find<PendingTrace>(pending_name.c_str()).first);
+}
+
+BOOST_FIXTURE_TEST_CASE(salvage_TerminatedProcess, PendingFixture) {
+  const int32_t pid = run_child([this]() {
+    PendingTrace *trace = pending->create_pending(getpid(), 43, nullptr, nullptr);
+    PendingRing *ring = pending->create_ring(trace, 0);
+    ring->head = 4;
+    trace->status.store(E_TERMINATED);
+  });
+
+  BOOST_TEST(pending->salvage(pid, 43, container, edge_maps));
+  BOOST_TEST(container->get_trace(43) == nullptr);
+}
+
+BOOST_FIXTURE_TEST_CASE(salvage_RunningProcess, PendingFixture) {
+  PendingTrace *trace =
+      pending->create_pending(getpid(), 44, nullptr, nullptr);
+  BOOST_TEST(!pending->salvage(getpid(), 44, container, edge_maps));
+
+  // A persistent target is done with a testcase once it's flushed
+  trace->status.store(E_TERMINATED);
+  BOOST_TEST(pending->salvage(getpid(), 44, container, edge_maps));
+  BOOST_TEST(segment->find<PendingTrace>(
+                        pending->get_pending_name(getpid()).c_str())
+                 .first == trace);
+  pending->remove_pending(getpid());
+}
+
+BOOST_FIXTURE_TEST_CASE(create_SalvagesLeftover, PendingFixture) {
+  // A dead process left records for testcase 45 under our pid
+  PendingTrace *leftover =
+      pending->create_pending(getpid(), 45, nullptr, nullptr);
+  PendingRing *ring = pending->create_ring(leftover, 0);
+  TraceRecord records[2];
+  encode_trace_record(TraceElement(E_TRUE_BRANCH, 0, 1, 0, 2), 0, records);
+  ring->records[ring->head++] = records[0];
+  leftover->status.store(E_CRASHED);
+
+  PendingTrace *trace = pending->create_pending(getpid(), 46, container,
+                                                edge_maps);
+  Container::trace_t *salvaged = container->get_trace(45);
+  BOOST_TEST_REQUIRE(salvaged != nullptr);
+  size_t count = 0;
+  for (const auto &element : *salvaged) {
+    (void)element;
+    count++;
+  }
+  BOOST_TEST(count == 2);
+
+  // The fuzzer doesn't salvage the new pending trace for the old testcase
+  BOOST_TEST(pending->salvage(getpid(), 45, container, edge_maps));
+  BOOST_TEST(trace->testcase_id.load() == 46);
+  pending->remove_pending(getpid());
+}
@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE GoalReachability Tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "common/logger.h"
+INITIALIZE_EASYLOGGINGPP;
+
+#include "common/reachability.h"
+using namespace instr;
+
+#include <memory>
+#include <string>
+
+// A small program in the shape the instrumentation stores it: `callee` has a
+// goal, `caller` calls it, `no_goal` only calls library code and `indirect`
+// calls through a function pointer.
+struct ModelsFixture {
+  StoreImpl store;
+
+  ModelsFixture() {
+    setupLogger("tests_reachability.log");
+
+    // callee: 2 (goal) -> 0
+    addFunction(10, "callee");
+    auto goal = addBlock(11, 10, 2);
+    goal->summaries.push_back(100);
+    addBlock(12, 10, 0);
+    addEdge(10, 11, 12);
+
+    // caller: 3 -> 2 (calls callee) -> 1 -> 0, the exit jumps back to 3
+    addFunction(20, "caller");
+    addBlock(21, 20, 3);
+    addBlock(22, 20, 2)->callees.push_back("callee");
+    addBlock(23, 20, 1);
+    addBlock(24, 20, 0);
+    addEdge(20, 21, 22);
+    addEdge(20, 22, 23);
+    addEdge(20, 23, 24);
+    addEdge(20, 24, 21);
+    addEdge(20, ERROR_ID, 21);
+
+    // no_goal: 2 (calls strlen) -> 0
+    addFunction(30, "no_goal");
+    addBlock(31, 30, 2)->callees.push_back("strlen");
+    addBlock(32, 30, 0);
+    addEdge(30, 31, 32);
+
+    // indirect: 3 -> 2 (calls a function pointer) -> 0
+    addFunction(40, "indirect");
+    addBlock(41, 40, 3);
+    addBlock(42, 40, 2)->indirect_calls = true;
+    addBlock(43, 40, 0);
+    addEdge(40, 41, 42);
+    addEdge(40, 42, 43);
+
+    // An edge of the models of another run
+    addEdge(50, 51, 22);
+  }
+
+  void addFunction(const element_id id, const std::string &name) {
+    auto func_elmt = std::make_shared<FunctionElement>(id, 1);
+    func_elmt->name = name;
+    store.add(id, func_elmt);
+  }
+
+  std::shared_ptr<BlockElement> addBlock(const element_id id,
+                                         const element_id func_id,
+                                         const uint32_t internal_block_id) {
+    auto block_elmt = std::make_shared<BlockElement>(id, func_id);
+    block_elmt->internal_block_id = internal_block_id;
+    store.add(id, block_elmt);
+    return block_elmt;
+  }
+
+  void addEdge(const element_id func_id, const element_id pred_block_id,
+               const element_id cur_block_id) {
+    store.addEdge(EdgeEntry(func_id, pred_block_id, cur_block_id));
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(compute_GoalInCallee, ModelsFixture) {
+  const GoalReachability reachability = GoalReachability::compute(store);
+
+  BOOST_CHECK(reachability.reaches("callee"));
+  BOOST_CHECK(reachability.reaches("callee", 2));
+  BOOST_CHECK(!reachability.reaches("callee", 0));
+
+  // The calling block and its predecessor, not what follows the call
+  BOOST_CHECK(reachability.reaches("caller"));
+  BOOST_CHECK(reachability.reaches("caller", 2));
+  BOOST_CHECK(reachability.reaches("caller", 3));
+  BOOST_CHECK(!reachability.reaches("caller", 1));
+}
+
+BOOST_FIXTURE_TEST_CASE(compute_ExitIsNotAPredecessor, ModelsFixture) {
+  const GoalReachability reachability = GoalReachability::compute(store);
+
+  // 0 -> 3 goes back through the initial predecessor, not the CFG
+  BOOST_CHECK(!reachability.reaches("caller", 0));
+  BOOST_CHECK_EQUAL(reachability.goal_blocks("caller")->size(), 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(compute_NoGoal, ModelsFixture) {
+  const GoalReachability reachability = GoalReachability::compute(store);
+
+  BOOST_CHECK(!reachability.reaches("no_goal"));
+  BOOST_CHECK(!reachability.reaches("no_goal", 2));
+  BOOST_CHECK(reachability.goal_blocks("no_goal") == nullptr);
+  BOOST_CHECK(!reachability.reaches("strlen"));
+}
+
+BOOST_FIXTURE_TEST_CASE(compute_IndirectCalls, ModelsFixture) {
+  const GoalReachability reachability = GoalReachability::compute(store);
+
+  BOOST_CHECK(reachability.reaches("indirect"));
+  BOOST_CHECK(reachability.reaches("indirect", 2));
+  BOOST_CHECK(reachability.reaches("indirect", 3));
+  BOOST_CHECK(!reachability.reaches("indirect", 0));
+  BOOST_CHECK_EQUAL(reachability.num_functions(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(compute_UnknownElements, ModelsFixture) {
+  const size_t num_elements = store.elements.size();
+  // A goal block whose function isn't in the models
+  addBlock(61, 60, 2)->summaries.push_back(101);
+
+  const GoalReachability reachability = GoalReachability::compute(store);
+  BOOST_CHECK_EQUAL(store.elements.size(), num_elements + 1);
+  BOOST_CHECK_EQUAL(reachability.num_functions(), 3);
+}
@@ -0,0 +1,143 @@
+#define BOOST_TEST_MODULE TestcaseSlots Tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+#include <cstdint>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Writers of the concurrency test: each thread of each process appends to its
+// own testcase, in small batches so the claims of the slots interleave
+static const uint32_t NUM_PROCESSES = 40;
+static const uint32_t NUM_THREADS = 4;
+static const uint32_t NUM_BATCHES = 50;
+static const uint32_t BATCH_SIZE = 20;
+
+struct SlotsFixture {
+  const std::string name = "tests_testcase_slots_" + std::to_string(getpid());
+  ipc::managed_shared_memory *segment;
+  Container *container;
+
+  SlotsFixture() {
+    ipc::shared_memory_object::remove(name.c_str());
+    segment = new ipc::managed_shared_memory(ipc::create_only, name.c_str(),
+                                             256 * 1024 * 1024);
+    container = new Container(segment, segment->get_segment_manager());
+  }
+
+  ~SlotsFixture() {
+    delete container;
+    delete segment;
+    ipc::shared_memory_object::remove(name.c_str());
+  }
+
+  static uint64_t testcase_of(const uint32_t process, const uint32_t thread) {
+    return 1 + process * NUM_THREADS + thread;
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(add_ConcurrentWriters, SlotsFixture) {
+  std::vector<pid_t> pids;
+  for (uint32_t process = 0; process < NUM_PROCESSES; process++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      std::vector<std::thread> threads;
+      for (uint32_t thread = 0; thread < NUM_THREADS; thread++) {
+        threads.emplace_back([this, process, thread]() {
+          const uint64_t testcase_id = testcase_of(process, thread);
+          TraceElement batch[BATCH_SIZE];
+          for (uint32_t i = 0; i < NUM_BATCHES; i++) {
+            for (uint32_t j = 0; j < BATCH_SIZE; j++) {
+              const uint32_t block = i * BATCH_SIZE + j;
+              batch[j] = TraceElement(E_TRUE_BRANCH, thread, 42, block,
+                                      block + 1);
+            }
+            container->add(testcase_id, batch, BATCH_SIZE);
+          }
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  for (pid_t pid : pids) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    BOOST_TEST(WIFEXITED(status));
+  }
+
+  // Every trace is complete and in order
+  for (uint32_t process = 0; process < NUM_PROCESSES; process++) {
+    for (uint32_t thread = 0; thread < NUM_THREADS; thread++) {
+      const uint64_t testcase_id = testcase_of(process, thread);
+      Container::trace_t *trace = container->get_trace(testcase_id);
+      BOOST_TEST_REQUIRE(trace != nullptr);
+      uint32_t count = 0;
+      bool in_order = true;
+      for (const auto &element : *trace) {
+        in_order = in_order && element.thread_id == thread &&
+                   element.pred_block_id == count &&
+                   element.cur_block_id == count + 1;
+        count++;
+      }
+      BOOST_TEST(count == NUM_BATCHES * BATCH_SIZE);
+      BOOST_TEST(in_order);
+      container->remove_trace(testcase_id);
+    }
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(add_TakesOverAbandonedSlot, SlotsFixture) {
+  // A writer killed in the middle of a flush leaves its slot in WRITING
+  const pid_t pid = fork();
+  if (pid == 0) {
+    void *evicted = nullptr;
+    container->slots.acquire_write(7, &evicted);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  // The state is in the low 32 bits of the word, the pid in the high ones
+  const uint64_t word = container->slots.slot(7).state.load();
+  BOOST_TEST((uint32_t)word == (uint32_t)E_SLOT_WRITING);
+  BOOST_TEST((int32_t)(word >> 32) == pid);
+
+  container->add(7, TraceElement(E_TRUE_BRANCH, 0, 42, 6, 4));
+  Container::trace_t *trace = container->get_trace(7);
+  BOOST_TEST_REQUIRE(trace != nullptr);
+  size_t count = 0;
+  for (const auto &element : *trace) {
+    BOOST_TEST(element.cur_block_id == 4);
+    count++;
+  }
+  BOOST_TEST(count == 1);
+}
+
+BOOST_AUTO_TEST_CASE(add_FullSegment) {
+  // Room for the slot table and a few edge maps only
+  const std::string name =
+      "tests_testcase_slots_full_" + std::to_string(getpid());
+  ipc::shared_memory_object::remove(name.c_str());
+  ipc::managed_shared_memory segment(ipc::create_only, name.c_str(),
+                                     2 * 1024 * 1024);
+  EdgeMapContainer edge_maps(&segment);
+  std::vector<uint8_t> hits(EDGE_MAP_SIZE, 1);
+
+  // The maps that don't fit are dropped, and their slot is free again
+  uint64_t testcase_id = 1;
+  while (segment.get_free_memory() >= EDGE_MAP_SIZE)
+    edge_maps.add(testcase_id++, hits.data(), E_TERMINATED);
+  edge_maps.add(testcase_id, hits.data(), E_TERMINATED);
+  BOOST_TEST(edge_maps.get_map(testcase_id) == nullptr);
+  BOOST_TEST((uint32_t)edge_maps.slots.slot(testcase_id).state.load() ==
+             (uint32_t)E_SLOT_FREE);
+  BOOST_TEST(edge_maps.get_map(1) != nullptr);
+  ipc::shared_memory_object::remove(name.c_str());
+}
@@ -0,0 +1,123 @@
+#define BOOST_TEST_MODULE TimedOutTrace Tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "common/logger.h"
+INITIALIZE_EASYLOGGINGPP;
+
+#include "common/store.h"
+#include "knowledge.h"
+#include "shared-data/shared-data.h"
+using namespace instr;
+using namespace shm;
+
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A function of the models with the blocks 3 -> 2 -> 1 -> 0, and a SUT that
+// hangs in it: the background flusher got 0 -> 3 into the SHM, 3 -> 2 and
+// 2 -> 1 are still in its ring when the fuzzer kills it.
+struct TimedOutFixture {
+  const std::string name = "tests_timed_out_trace_" + std::to_string(getpid());
+  const std::string models_file = name + ".xxx";
+  ipc::managed_shared_memory *segment;
+  Container *container;
+  EdgeMapContainer *edge_maps;
+  PendingTraceContainer *pending;
+  element_id func_id = ERROR_ID;
+
+  TimedOutFixture() {
+    setupLogger("tests_timed_out_trace.log");
+    ipc::shared_memory_object::remove(name.c_str());
+    segment = new ipc::managed_shared_memory(ipc::create_only, name.c_str(),
+                                             64 * 1024 * 1024);
+    container = new Container(segment, segment->get_segment_manager());
+    edge_maps = new EdgeMapContainer(segment);
+    pending = new PendingTraceContainer(segment);
+    write_models();
+  }
+
+  ~TimedOutFixture() {
+    delete pending;
+    delete edge_maps;
+    delete container;
+    delete segment;
+    ipc::shared_memory_object::remove(name.c_str());
+    std::remove(models_file.c_str());
+  }
+
+  void write_models() {
+    std::remove(models_file.c_str());
+    Store store(models_file);
+    StoreImpl &s = store.store();
+    const element_id source_id = s.addSource("hang.cpp");
+    func_id = s.getNextId();
+    auto func_elmt = std::static_pointer_cast<FunctionElement>(
+        Store::create(Element::E_FUNCTION, func_id, source_id));
+    func_elmt->name = "hang";
+    element_id blocks[4];
+    for (uint32_t i = 0; i < 4; i++) {
+      blocks[i] = s.getNextId();
+      auto block_elmt = std::static_pointer_cast<BlockElement>(
+          Store::create(Element::E_BLOCK, blocks[i], func_id));
+      block_elmt->internal_block_id = i;
+      func_elmt->blocks.push_back(blocks[i]);
+      s.add(blocks[i], block_elmt);
+    }
+    s.add(func_id, func_elmt);
+    s.addEdge(EdgeEntry(func_id, ERROR_ID, ERROR_ID));
+    s.addEdge(EdgeEntry(func_id, blocks[0], blocks[3]));
+    s.addEdge(EdgeEntry(func_id, blocks[3], blocks[2]));
+    s.addEdge(EdgeEntry(func_id, blocks[2], blocks[1]));
+    s.addEdge(EdgeEntry(func_id, blocks[1], blocks[0]));
+  }
+
+  void push(PendingRing *ring, const TraceElement &element) {
+    TraceRecord records[2];
+    const size_t count = encode_trace_record(element, 0, records);
+    for (size_t j = 0; j < count; j++)
+      ring->records[ring->head++ & (PENDING_RING_CAPACITY - 1)] = records[j];
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(add_trace_TimedOutTestcase, TimedOutFixture) {
+  const uint32_t func = (uint32_t)func_id;
+  const pid_t pid = fork();
+  if (pid == 0) {
+    PendingTrace *trace = pending->create_pending(getpid(), 42, container,
+                                                  edge_maps);
+    PendingRing *ring = pending->create_ring(trace, 0);
+    container->add(42, TraceElement(E_TRUE_BRANCH, 0, func, 0, 3));
+    push(ring, TraceElement(E_TRUE_BRANCH, 0, func, 3, 2));
+    push(ring, TraceElement(E_TRUE_BRANCH, 0, func, 2, 1));
+    // What the SIGUSR2 handler of the runtime does before it dies
+    trace->status.store(E_TIMEDOUT);
+    kill(getpid(), SIGKILL);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  BOOST_TEST(pending->salvage(pid, 42, container, edge_maps));
+  Container::trace_t *trace = container->get_trace(42);
+  BOOST_TEST_REQUIRE(trace != nullptr);
+  size_t count = 0;
+  TraceKind last = E_UNKNOWN;
+  for (const auto &element : *trace) {
+    last = element.kind;
+    count++;
+  }
+  BOOST_TEST(count == 4);
+  BOOST_TEST(last == E_TIMEDOUT);
+
+  // What the trace retriever does with it
+  fuzz::ProgramKnowledge knowledge(models_file);
+  const uint32_t edges_before = knowledge.coverage_size().second;
+  knowledge.add_trace(42, *trace);
+  container->remove_trace(42);
+
+  BOOST_TEST(knowledge.coverage_size().second == edges_before + 3);
+  BOOST_TEST(knowledge.get_coverage_scores().at(42).diff > 0);
+}
@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE TraceRecord Tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+#include <cstdint>
+
+static bool same(const TraceElement &a, const TraceElement &b) {
+  return a.kind == b.kind && a.thread_id == b.thread_id &&
+         a.func_id == b.func_id && a.pred_block_id == b.pred_block_id &&
+         a.cur_block_id == b.cur_block_id;
+}
+
+static size_t roundtrip(const TraceElement &element, const uint32_t thread,
+                        TraceElement &decoded) {
+  TraceRecord records[2] = {0, 0};
+  const size_t count = encode_trace_record(element, thread, records);
+  BOOST_TEST(decode_trace_record(records, count, decoded) == count);
+  return count;
+}
+
+BOOST_AUTO_TEST_CASE(encode_CompactBranch) {
+  TraceElement decoded;
+  const TraceElement element(E_TRUE_BRANCH, 3, 42, 6, 4);
+  BOOST_TEST(roundtrip(element, 3, decoded) == 1);
+  BOOST_TEST(same(decoded, element));
+
+  // The first block of a function has no predecessor yet
+  const TraceElement first(E_TRUE_BRANCH, 3, 42, 0, 9);
+  BOOST_TEST(roundtrip(first, 3, decoded) == 1);
+  BOOST_TEST(same(decoded, first));
+
+  // Largest compact block ids
+  const TraceElement largest(E_FALSE_BRANCH, 3, 42, 4095, 4095);
+  BOOST_TEST(roundtrip(largest, 3, decoded) == 1);
+  BOOST_TEST(same(decoded, largest));
+}
+
+BOOST_AUTO_TEST_CASE(encode_FunctionBoundaries) {
+  TraceElement decoded;
+  const TraceElement enter(E_ENTER_FUNCTION, 0, 42);
+  BOOST_TEST(roundtrip(enter, 0, decoded) == 1);
+  BOOST_TEST(same(decoded, enter));
+
+  const TraceElement exit(E_EXIT_FUNCTION, 7, 42);
+  BOOST_TEST(roundtrip(exit, 7, decoded) == 1);
+  BOOST_TEST(same(decoded, exit));
+}
+
+BOOST_AUTO_TEST_CASE(encode_TerminalKinds) {
+  TraceElement decoded;
+  const TraceKind kinds[] = {E_KILL, E_TERMINATED, E_CRASHED, E_TIMEDOUT,
+                             E_UNKNOWN};
+  for (const TraceKind kind : kinds) {
+    const TraceElement element(kind);
+    BOOST_TEST(roundtrip(element, 0, decoded) == 1);
+    BOOST_TEST(same(decoded, element));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(encode_ExtendedElements) {
+  TraceElement decoded;
+
+  // Block ids too large for a compact record
+  const TraceElement far(E_TRUE_BRANCH, 1, 42, 5002, 5000);
+  BOOST_TEST(roundtrip(far, 1, decoded) == 2);
+  BOOST_TEST(same(decoded, far));
+
+  const TraceElement far_pred(E_FALSE_BRANCH, 1, 42, 4096, 3);
+  BOOST_TEST(roundtrip(far_pred, 1, decoded) == 2);
+  BOOST_TEST(same(decoded, far_pred));
+
+  // Function id too large for a compact record
+  const TraceElement large(E_EXCEPTION_BRANCH, 2, 0x80000000u, 0x80000001u,
+                           0x80000002u);
+  TraceRecord records[2];
+  BOOST_TEST(encode_trace_record(large, 2, records) == 2);
+  BOOST_TEST(is_trace_record_head(records[0]));
+  BOOST_TEST(!is_trace_record_head(records[1]));
+  BOOST_TEST(decode_trace_record(records, 2, decoded) == 2);
+  BOOST_TEST(decoded.func_id == large.func_id);
+  // Block ids are kept on 30 bits in extended records
+  BOOST_TEST(decoded.pred_block_id == (large.pred_block_id & 0x3fffffffu));
+  BOOST_TEST(decoded.cur_block_id == (large.cur_block_id & 0x3fffffffu));
+}
+
+BOOST_AUTO_TEST_CASE(encode_ThreadIndexSaturates) {
+  TraceElement decoded;
+  const TraceElement element(E_ENTER_FUNCTION, 0, 42);
+  roundtrip(element, 5000, decoded);
+  BOOST_TEST(decoded.thread_id == TRACE_RECORD_MAX_THREAD);
+}
+
+BOOST_AUTO_TEST_CASE(decode_TruncatedElement) {
+  TraceElement decoded;
+  TraceRecord records[2];
+  const TraceElement element(E_TRUE_BRANCH, 0, 42, 5002, 5000);
+  BOOST_TEST(encode_trace_record(element, 0, records) == 2);
+  BOOST_TEST(decode_trace_record(records, 1, decoded) == 0);
+  BOOST_TEST(decode_trace_record(records, 0, decoded) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(decode_Sequence) {
+  const TraceElement elements[] = {
+      TraceElement(E_ENTER_FUNCTION, 0, 10),
+      TraceElement(E_TRUE_BRANCH, 0, 10, 0, 6),
+      TraceElement(E_TRUE_BRANCH, 0, 10, 6, 4),
+      TraceElement(E_FALSE_BRANCH, 0, 10, 4, 5000), // extended
+      TraceElement(E_EXIT_FUNCTION, 0, 10), TraceElement(E_TERMINATED)};
+  const size_t num_elements = sizeof(elements) / sizeof(elements[0]);
+
+  TraceRecord records[2 * num_elements];
+  size_t num_records = 0;
+  for (size_t i = 0; i < num_elements; i++) {
+    num_records += encode_trace_record(elements[i], 0, records + num_records);
+  }
+  BOOST_TEST(num_records == num_elements + 1);
+
+  size_t offset = 0, decoded_elements = 0;
+  TraceElement decoded;
+  while (size_t length = decode_trace_record(records + offset,
+                                             num_records - offset, decoded)) {
+    BOOST_TEST(same(decoded, elements[decoded_elements]));
+    offset += length;
+    decoded_elements++;
+  }
+  BOOST_TEST(decoded_elements == num_elements);
+}
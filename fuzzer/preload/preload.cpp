@@ -0,0 +1,322 @@
+// Interception of the libc comparison functions, loaded in the SUT with the
+// `ld-preload` option of the fuzzer. Magic values are often checked with
+// strcmp & co, which the source instrumentation never sees: each distinct
+// buffer they compare is appended to the token log of the current testcase,
+// and the fuzzer turns them into a dictionary.
+#include "shared-data/shared-data.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define NASTY_DEBUG 0
+
+#if (NASTY_DEBUG == 1)
+#include <iostream>
+#endif
+
+// Shorter buffers are too common to tell us anything
+#define PRELOAD_MIN_TOKEN_SIZE 3
+
+// Fingerprints of the tokens already logged for the current testcase. Must
+// be a power of 2.
+#define PRELOAD_SEEN_SIZE 1024
+
+// Tokens logged without looking for the pending trace of the runtime again,
+// when it doesn't exist (yet)
+#define PRELOAD_PENDING_RETRY 1024
+
+// The hooks are named preload_*. On Linux, they are exported under the name of
+// the libc function (the C++ headers overload some of them, hence the asm
+// label), and the libc ones are found with RTLD_NEXT. dyld doesn't let a
+// library override libc symbols, but interposes the functions listed in the
+// `__interpose` section, except in the library itself.
+#if defined(__APPLE__)
+#define PRELOAD_SYMBOL(name)
+#define PRELOAD_REAL(name) name
+#define PRELOAD_INTERPOSE(name)                                                \
+  __attribute__((used)) static const struct {                                  \
+    const void *replacement;                                                   \
+    const void *replacee;                                                      \
+  } interpose_##name __attribute__((section("__DATA,__interpose"))) = {        \
+      (const void *)(preload_##name), (const void *)(name)};
+#else
+#define PRELOAD_SYMBOL(name) __asm__(#name)
+#define PRELOAD_REAL(name)                                                     \
+  (preload::real_##name ? preload::real_##name : preload::naive_##name)
+#define PRELOAD_INTERPOSE(name)
+#endif
+
+namespace preload {
+
+typedef int (*strcmp_t)(const char *, const char *);
+typedef int (*strncmp_t)(const char *, const char *, size_t);
+typedef int (*memcmp_t)(const void *, const void *, size_t);
+typedef char *(*strstr_t)(const char *, const char *);
+
+static strcmp_t real_strcmp = nullptr;
+static strncmp_t real_strncmp = nullptr;
+static memcmp_t real_memcmp = nullptr;
+static strstr_t real_strstr = nullptr;
+
+// Used until the libc functions are resolved (dlsym compares strings too).
+// The library is built with -fno-builtin so these don't become calls to
+// themselves.
+static int naive_memcmp(const void *a, const void *b, size_t n) {
+  const uint8_t *x = static_cast<const uint8_t *>(a);
+  const uint8_t *y = static_cast<const uint8_t *>(b);
+  for (size_t i = 0; i < n; i++) {
+    if (x[i] != y[i])
+      return x[i] < y[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static int naive_strncmp(const char *a, const char *b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t x = (uint8_t)a[i], y = (uint8_t)b[i];
+    if (x != y)
+      return x < y ? -1 : 1;
+    if (!x)
+      return 0;
+  }
+  return 0;
+}
+
+static int naive_strcmp(const char *a, const char *b) {
+  return naive_strncmp(a, b, (size_t)-1);
+}
+
+static char *naive_strstr(const char *haystack, const char *needle) {
+  if (!*needle)
+    return const_cast<char *>(haystack);
+  for (; *haystack; haystack++) {
+    size_t i = 0;
+    while (needle[i] && haystack[i] == needle[i])
+      i++;
+    if (!needle[i])
+      return const_cast<char *>(haystack);
+  }
+  return nullptr;
+}
+
+// The SHM code compares strings too
+static thread_local bool in_hook = false;
+
+static std::atomic<bool> disabled{false};
+static std::mutex mutex;
+static shm::ipc::managed_shared_memory *segment = nullptr;
+static shm::TokenLogContainer *token_logs = nullptr;
+
+// The runtime keeps the testcase id of the process in its pending trace,
+// which follows the fork server and persistent mode. It doesn't exist yet
+// before the runtime is initialized.
+static std::atomic<shm::PendingTrace *> pending{nullptr};
+static unsigned long env_testcase_id = 0;
+
+// Name of the pending trace of the process, and the number of lookups skipped
+// before looking for it again when it's missing
+static std::string pending_name;
+static uint32_t pending_skips = 0;
+
+static std::atomic<uint64_t> seen[PRELOAD_SEEN_SIZE];
+static unsigned long seen_testcase_id = 0;
+
+static uint64_t fingerprint(const uint8_t *data, const size_t size) {
+  uint64_t h = 0xcbf29ce484222325ull ^ size;
+  for (size_t i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h | 1; // 0 is a free entry
+}
+
+// With `insert`, claims a free entry. Returns true if `h` was already there,
+// or if there's no room left.
+static bool is_seen(const uint64_t h, const bool insert) {
+  for (uint32_t probe = 0; probe < 8; probe++) {
+    std::atomic<uint64_t> &entry = seen[(h + probe) & (PRELOAD_SEEN_SIZE - 1)];
+    const uint64_t current = entry.load(std::memory_order_relaxed);
+    if (current == h)
+      return true;
+    if (current == 0) {
+      if (insert)
+        entry.store(h, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void clear_seen() {
+  for (size_t i = 0; i < PRELOAD_SEEN_SIZE; i++)
+    seen[i].store(0, std::memory_order_relaxed);
+}
+
+// Called with `mutex`
+static bool attach() {
+  if (token_logs)
+    return true;
+  try {
+    segment = new shm::ipc::managed_shared_memory(
+        shm::ipc::open_only, shm::SHMConfig::current().segment_name.c_str());
+    token_logs = new shm::TokenLogContainer(segment);
+  } catch (const std::exception &ex) {
+#if (NASTY_DEBUG == 1)
+    std::cerr << "[[PRELOAD]] Cannot attach the SHM: " << ex.what()
+              << std::endl;
+#endif
+    if (segment)
+      delete segment;
+    segment = nullptr;
+    return false;
+  }
+  return true;
+}
+
+// Called with `mutex`
+static unsigned long testcase_id() {
+  shm::PendingTrace *p = pending.load();
+  if (!p && pending_skips) {
+    pending_skips--;
+  } else if (!p) {
+    if (pending_name.empty()) {
+      shm::PendingTraceContainer container(segment);
+      pending_name = container.get_pending_name(getpid());
+    }
+    p = segment->find<shm::PendingTrace>(pending_name.c_str()).first;
+    pending.store(p);
+    if (!p)
+      pending_skips = PRELOAD_PENDING_RETRY;
+  }
+  return p ? (unsigned long)p->testcase_id.load() : env_testcase_id;
+}
+
+static void log_token(const void *data, const size_t size) {
+  if (size < PRELOAD_MIN_TOKEN_SIZE || size > TOKEN_MAX_SIZE || in_hook ||
+      disabled.load(std::memory_order_relaxed))
+    return;
+
+  in_hook = true;
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  const uint64_t h = fingerprint(bytes, size);
+  if (!is_seen(h, false)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!attach()) {
+      disabled.store(true);
+    } else {
+      // A token is only logged once per testcase, the fuzzer remembers it
+      const unsigned long tc_id = testcase_id();
+      if (tc_id != seen_testcase_id) {
+        clear_seen();
+        seen_testcase_id = tc_id;
+      }
+      if (tc_id && !is_seen(h, true))
+        token_logs->add(tc_id, bytes, (uint32_t)size);
+    }
+  }
+  in_hook = false;
+}
+
+// strnlen(s, n), but strings longer than a token are skipped without reading
+// them entirely. strncmp's buffers don't have to be NUL-terminated.
+static size_t token_length(const char *s, const size_t n) {
+  const size_t limit = n < TOKEN_MAX_SIZE + 1 ? n : TOKEN_MAX_SIZE + 1;
+  size_t size = 0;
+  while (size < limit && s[size])
+    size++;
+  return size;
+}
+
+static void log_strings(const char *a, const char *b, const size_t n) {
+  log_token(a, token_length(a, n));
+  log_token(b, token_length(b, n));
+}
+
+// A child of the fork server has its own pending trace
+static void after_fork() {
+  pending.store(nullptr);
+  pending_name.clear();
+  pending_skips = 0;
+  seen_testcase_id = 0;
+  clear_seen();
+}
+
+__attribute__((constructor)) static void initialize() {
+  in_hook = true;
+#if !defined(__APPLE__)
+  real_strcmp = (strcmp_t)dlsym(RTLD_NEXT, "strcmp");
+  real_strncmp = (strncmp_t)dlsym(RTLD_NEXT, "strncmp");
+  real_memcmp = (memcmp_t)dlsym(RTLD_NEXT, "memcmp");
+  real_strstr = (strstr_t)dlsym(RTLD_NEXT, "strstr");
+#endif
+  if (const char *tc_id = std::getenv("COVERAGE_FUZZING_TESTCASE_ID"))
+    env_testcase_id = std::strtoul(tc_id, nullptr, 10);
+  pthread_atfork(nullptr, nullptr, after_fork);
+  in_hook = false;
+}
+}
+
+//
+// The hooks. The comparison is made first, only mismatching buffers are
+// logged: a matching one is already in the input.
+//
+extern "C" {
+
+__attribute__((visibility("default"))) int
+preload_strcmp(const char *s1, const char *s2) PRELOAD_SYMBOL(strcmp);
+__attribute__((visibility("default"))) int
+preload_strncmp(const char *s1, const char *s2, size_t n)
+    PRELOAD_SYMBOL(strncmp);
+__attribute__((visibility("default"))) int
+preload_memcmp(const void *s1, const void *s2, size_t n)
+    PRELOAD_SYMBOL(memcmp);
+__attribute__((visibility("default"))) char *
+preload_strstr(const char *haystack, const char *needle)
+    PRELOAD_SYMBOL(strstr);
+
+int preload_strcmp(const char *s1, const char *s2) {
+  const int result = PRELOAD_REAL(strcmp)(s1, s2);
+  if (result)
+    preload::log_strings(s1, s2, (size_t)-1);
+  return result;
+}
+
+int preload_strncmp(const char *s1, const char *s2, size_t n) {
+  const int result = PRELOAD_REAL(strncmp)(s1, s2, n);
+  if (result)
+    preload::log_strings(s1, s2, n);
+  return result;
+}
+
+int preload_memcmp(const void *s1, const void *s2, size_t n) {
+  const int result = PRELOAD_REAL(memcmp)(s1, s2, n);
+  if (result) {
+    preload::log_token(s1, n);
+    preload::log_token(s2, n);
+  }
+  return result;
+}
+
+char *preload_strstr(const char *haystack, const char *needle) {
+  char *result = PRELOAD_REAL(strstr)(haystack, needle);
+  if (!result)
+    preload::log_token(needle, preload::token_length(needle, (size_t)-1));
+  return result;
+}
+}
+
+PRELOAD_INTERPOSE(strcmp)
+PRELOAD_INTERPOSE(strncmp)
+PRELOAD_INTERPOSE(memcmp)
+PRELOAD_INTERPOSE(strstr)
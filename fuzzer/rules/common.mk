@@ -189,6 +189,11 @@ endif
 
 PIN_INTERCEPT_SPAWN:=$(PIN_INTERCEPT_SPAWN).$(DYNAMIC_LIB_EXT)
 
+#
+# Library preloaded in the SUT to intercept the libc comparisons (strcmp...)
+#
+LIB_PRELOAD=libinstr-preload.$(DYNAMIC_LIB_EXT)
+
 #
 # Some testing stuff...
 #
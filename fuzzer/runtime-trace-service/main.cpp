@@ -116,11 +116,13 @@ void get_trace_handler(const shared_ptr<Session> session) {
   } else {
     try {
       string json_str = to_json(*trace);
+      handler.container->release_trace(testcase_id);
       session->close(OK, json_str,
                      {{"Content-Length", std::to_string(json_str.length())},
                       {"Content-Type", "application/json"},
                       {"Connection", "close"}});
     } catch (exception &e) {
+      handler.container->release_trace(testcase_id);
       string error_message = custom_error_message(e.what());
       session->close(
           INTERNAL_SERVER_ERROR, error_message,
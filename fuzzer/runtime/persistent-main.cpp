@@ -0,0 +1,56 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "runtime.h"
+#include "shared-data/fork-server.h"
+
+#include <unistd.h>
+
+//
+// Entry point of the harnesses that only define a libFuzzer-style
+// `LLVMFuzzerTestOneInput`. This object is only pulled from the runtime archive
+// when the SUT doesn't have its own `main`.
+//
+// Launched by the fuzzer with --persistent, the harness runs the testcases
+// in-process until the fuzzer recycles it (see `runtime::run_persistent`).
+// Otherwise, each argument is read as a file and run once, which is how the
+// testcases are replayed.
+//
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+    __attribute__((weak));
+
+static int run_files(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::in | std::ios::binary);
+    if (!file) {
+      std::cerr << "Cannot read the input file: " << argv[i] << std::endl;
+      continue;
+    }
+    const std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)),
+                                     std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (LLVMFuzzerInitialize) {
+    LLVMFuzzerInitialize(&argc, &argv);
+  }
+
+  if (!std::getenv(ENV_PERSISTENT)) {
+    return run_files(argc, argv);
+  }
+
+  runtime::run_persistent(LLVMFuzzerTestOneInput);
+
+  // The trace of the last testcase is already flushed, don't let the atexit
+  // handler report an extra termination for it.
+  _exit(0);
+}
@@ -1,13 +1,15 @@
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <list>
 #include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
 
 #include "runtime.h"
+#include "shared-data/fork-server.h"
 using namespace shm;
 
 #include <boost/predef.h>
@@ -19,8 +21,10 @@ using namespace shm;
 #include <google_breakpad/processor/minidump_processor.h>
 
 #include <cerrno>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -30,6 +34,7 @@ using namespace shm;
 #include <google_breakpad/processor/minidump_processor.h>
 
 #include <cerrno>
+#include <pthread.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -37,32 +42,20 @@ using namespace shm;
 #include <unistd.h>
 #endif
 
-// XXX Need to actually do something cross-platform to get the current thread
-#ifdef CPP_11_SUPPORT
-#include <thread>
-size_t get_thread_id() {
-  return (size_t)std::hash<std::thread::id>()(std::this_thread::get_id());
-}
-#else
-#include <pthread.h>
-size_t get_thread_id() {
-  pthread_id_np_t tid = pthread_getthreadid_np();
-  return (size_t)tid;
-}
-#endif
-
-#define NASTY_DEBUG 1
+#define NASTY_DEBUG 0
 #define NO_BREAKPAD 0
 
 #define DEFAULT_TESTCASE_ID 0
-#define FLUSH_EVENT_RATE 100
 
 static std::atomic_bool sharedMemoryInitialized(false);
 static std::atomic_bool progTerminationHandlerInstalled(false);
 static std::atomic_bool testCaseIdFetched(false);
+static std::atomic_bool forkServerStarted(false);
 static std::atomic_ulong testCaseId(DEFAULT_TESTCASE_ID);
 
-static std::atomic_ulong eventsSinceLastFlush(0);
+// Until the runtime is initialized, by the first `__coverage_enter_func`
+static unsigned char initial_edge_map[EDGE_MAP_SIZE];
+unsigned char *__coverage_edge_map = initial_edge_map;
 
 //
 // Internal runtime stuff. Uses the shared memory to communicate.
@@ -77,12 +70,97 @@ static p_exception_handler_t bp_exceptionHandler = nullptr;
 std::atomic<SHMRuntimeWriterSingleton *> SHMRuntimeWriterSingleton::instance{
     nullptr};
 std::mutex SHMRuntimeWriterSingleton::mutex;
-std::mutex SHMRuntimeWriterSingleton::trace_mutex;
 shm::SHMRuntimeWriter *SHMRuntimeWriterSingleton::ptee = nullptr;
-std::list<TraceElement> SHMRuntimeWriterSingleton::trace;
+std::atomic<TraceRingBuffer *>
+    SHMRuntimeWriterSingleton::rings[RUNTIME_MAX_RINGS];
+std::atomic<size_t> SHMRuntimeWriterSingleton::num_rings{0};
+TraceRingBuffer *SHMRuntimeWriterSingleton::overflow_ring = nullptr;
+std::mutex SHMRuntimeWriterSingleton::overflow_mutex;
+uint32_t SHMRuntimeWriterSingleton::flush_interval_ms = 0;
+std::thread *SHMRuntimeWriterSingleton::flusher = nullptr;
+bool SHMRuntimeWriterSingleton::flusher_running = false;
+std::mutex SHMRuntimeWriterSingleton::flusher_mutex;
+std::condition_variable SHMRuntimeWriterSingleton::flusher_cv;
+shm::TraceMode SHMRuntimeWriterSingleton::trace_mode = E_TRACE_MODE_LIST;
+bool SHMRuntimeWriterSingleton::compress_traces = false;
+bool SHMRuntimeWriterSingleton::hit_buckets = false;
+uint32_t SHMRuntimeWriterSingleton::context_depth = 0;
+uint8_t *SHMRuntimeWriterSingleton::edge_hits = nullptr;
+std::atomic<int> SHMRuntimeWriterSingleton::edge_map_status{E_UNKNOWN};
+std::atomic<uint8_t>
+    SHMRuntimeWriterSingleton::skipped_branches[EDGE_MAP_SIZE / 8];
+bool SHMRuntimeWriterSingleton::cmp_log = false;
+shm::CmpOperands SHMRuntimeWriterSingleton::cmp_entries[CMP_LOG_SIZE];
+std::atomic<uint32_t> SHMRuntimeWriterSingleton::cmp_size{0};
+std::atomic<uint64_t>
+    SHMRuntimeWriterSingleton::cmp_seen[RUNTIME_CMP_SEEN_SIZE];
+uint8_t SHMRuntimeWriterSingleton::cmp_site_hits[RUNTIME_CMP_SITES];
+shm::PendingTrace *SHMRuntimeWriterSingleton::pending = nullptr;
 
 static SHMRuntimeWriterSingleton *writer = nullptr;
 
+// Owner of each thread index, by OS thread id (0 when the index is free). A
+// thread takes the lowest free index on its first event, and gives it back
+// when it terminates through the `thread_key` destructor (this doesn't
+// happen for the main thread).
+static std::atomic<uint64_t> thread_owners[RUNTIME_MAX_RINGS];
+static pthread_key_t thread_key;
+static std::once_flag thread_key_once;
+
+// Index + 1 of the current thread, 0 until it's assigned
+static thread_local uint32_t cached_thread_index = 0;
+
+// Functions called by the current thread (ENV_CONTEXT_DEPTH), and the hash of
+// the callers of the last one
+static thread_local uint32_t call_stack[RUNTIME_CALL_STACK_SIZE];
+static thread_local uint32_t call_depth = 0;
+static thread_local uint32_t call_context = 0;
+
+static uint64_t os_thread_id() {
+#if BOOST_OS_LINUX
+  return (uint64_t)syscall(SYS_gettid);
+#else
+  uint64_t tid = 0;
+  pthread_threadid_np(nullptr, &tid);
+  return tid;
+#endif
+}
+
+static void release_thread_index(void *value) {
+  const uint32_t index = (uint32_t)(uintptr_t)value - 1;
+  SHMRuntimeWriterSingleton::Instance()->thread_exited(index);
+  thread_owners[index].store(0, std::memory_order_release);
+}
+
+static uint32_t assign_thread_index() {
+  std::call_once(thread_key_once, []() {
+    pthread_key_create(&thread_key, release_thread_index);
+  });
+
+  const uint64_t tid = os_thread_id();
+  for (uint32_t index = 0; index < RUNTIME_MAX_RINGS; index++) {
+    uint64_t expected = 0;
+    if (thread_owners[index].load(std::memory_order_relaxed) == 0 &&
+        thread_owners[index].compare_exchange_strong(expected, tid)) {
+      pthread_setspecific(thread_key, (void *)(uintptr_t)(index + 1));
+      cached_thread_index = index + 1;
+      return index;
+    }
+  }
+
+#if (NASTY_DEBUG == 1)
+  std::cout << tid << " uses the overflow thread index" << std::endl;
+#endif
+  cached_thread_index = RUNTIME_OVERFLOW_THREAD + 1;
+  return RUNTIME_OVERFLOW_THREAD;
+}
+
+uint64_t thread_os_id(const uint32_t index) {
+  if (index >= RUNTIME_MAX_RINGS)
+    return 0;
+  return thread_owners[index].load(std::memory_order_acquire);
+}
+
 // instantiate the singleton
 SHMRuntimeWriterSingleton *SHMRuntimeWriterSingleton::Instance() {
   if (instance == nullptr) {
@@ -95,43 +173,473 @@ SHMRuntimeWriterSingleton *SHMRuntimeWriterSingleton::Instance() {
 }
 
 void handle_trace_element(const TraceElement &trace_element) {
-  runtime::writer->add(trace_element);
-
-  if (eventsSinceLastFlush >= FLUSH_EVENT_RATE) {
-    runtime::writer->flush();
-    eventsSinceLastFlush = 0;
+  if (runtime::writer->mode() == E_TRACE_MODE_EDGE_MAP) {
+    runtime::writer->add_edge(trace_element);
+  } else {
+    runtime::writer->add(trace_element);
   }
 }
 
 void SHMRuntimeWriterSingleton::initialize() {
+  // The fuzzer tells us how the trace should be shared
+  if (const char *mode = std::getenv("COVERAGE_FUZZING_TRACE_MODE")) {
+    trace_mode = shm::traceModeFromName(mode);
+  }
+  if (const char *compression = std::getenv(ENV_TRACE_COMPRESSION)) {
+    compress_traces = std::strcmp(compression, "1") == 0;
+  }
+  if (const char *buckets = std::getenv(ENV_HIT_BUCKETS)) {
+    hit_buckets = trace_mode == E_TRACE_MODE_LIST &&
+                  std::strcmp(buckets, "1") == 0;
+  }
+  if (const char *depth = std::getenv(ENV_CONTEXT_DEPTH)) {
+    context_depth = std::min<uint32_t>(
+        (uint32_t)std::strtoul(depth, nullptr, 10), CONTEXT_MAX_DEPTH);
+  }
+  if (const char *cmp = std::getenv(ENV_CMP_LOG)) {
+    cmp_log = std::strcmp(cmp, "1") == 0;
+  }
+  // The edge map is only published at the end
+  if (const char *interval = std::getenv(ENV_FLUSH_INTERVAL_MS)) {
+    if (trace_mode == E_TRACE_MODE_LIST)
+      flush_interval_ms = (uint32_t)std::strtoul(interval, nullptr, 10);
+  }
+
   // XXX create another mode where we dump it all in a normal file?
   ptee = new shm::SHMRuntimeWriter();
+  if (ptee->segment) {
+    pending =
+        ptee->pending->create_pending(getpid(), __coverage_get_testcase_id(),
+                                      ptee->container, ptee->edge_maps);
+  }
+  if (pending && trace_mode == E_TRACE_MODE_EDGE_MAP)
+    edge_hits = ptee->pending->create_edge_hits(pending);
+  if (!edge_hits)
+    edge_hits = new uint8_t[EDGE_MAP_SIZE]();
+  std::memcpy(edge_hits, initial_edge_map, EDGE_MAP_SIZE);
+  __coverage_edge_map = edge_hits;
+  overflow_ring =
+      new TraceRingBuffer(create_pending_ring(RUNTIME_OVERFLOW_THREAD));
   // Install the atexit & breakpad hooks when this singleton gets constructed.
   __coverage_install_atexit();
 }
 
-void SHMRuntimeWriterSingleton::flush() {
-  std::lock_guard<std::mutex> lock(trace_mutex);
-  if (trace.empty())
+// Rings are only created by the thread owning their index, and are reused by
+// the next owner of that index
+TraceRingBuffer *SHMRuntimeWriterSingleton::local_ring(const uint32_t index) {
+  if (index >= RUNTIME_MAX_RINGS)
+    return overflow_ring;
+  TraceRingBuffer *ring = rings[index].load(std::memory_order_acquire);
+  if (ring)
+    return ring;
+
+  ring = new TraceRingBuffer(create_pending_ring(index));
+  rings[index].store(ring, std::memory_order_release);
+  size_t count = num_rings.load();
+  while (count <= index && !num_rings.compare_exchange_weak(count, index + 1)) {
+  }
+  return ring;
+}
+
+shm::PendingRing *
+SHMRuntimeWriterSingleton::create_pending_ring(const uint32_t index) {
+  if (pending) {
+    if (shm::PendingRing *ring = ptee->pending->create_ring(pending, index))
+      return ring;
+  }
+#if (NASTY_DEBUG == 1)
+  std::cout << "no pending ring for thread index " << index << std::endl;
+#endif
+  return new shm::PendingRing();
+}
+
+void SHMRuntimeWriterSingleton::thread_exited(const uint32_t index) {
+  if (TraceRingBuffer *ring = rings[index].load(std::memory_order_acquire))
+    flush_ring(ring);
+}
+
+void SHMRuntimeWriterSingleton::flush_ring(TraceRingBuffer *ring) {
+  std::lock_guard<std::mutex> lock(ring->consumer_mutex);
+  shm::PendingRing *shared = ring->shared;
+  const size_t tail = shared->tail.load(std::memory_order_relaxed);
+  const size_t head = shared->head.load(std::memory_order_acquire);
+  if (head == tail)
+    return;
+
+  // Without the SHM, the records are dropped
+  if (!get()->segment) {
+    shared->tail.store(head, std::memory_order_release);
     return;
+  }
+
+  const unsigned long tc_id = __coverage_get_testcase_id();
 
+  if (compress_traces) {
+    flush_ring_compressed(ring, tc_id, tail, head);
+    shared->tail.store(head, std::memory_order_release);
+    return;
+  }
+
+  // The pending records are at most split in two contiguous chunks, which
+  // are appended at once so an extended element can't be split by another
+  // thread's flush
+  const size_t count = head - tail;
+  const size_t first = tail & TraceRingBuffer::mask;
+  const size_t first_count =
+      std::min(count, TraceRingBuffer::capacity - first);
+  const TraceSpan spans[2] = {
+      TraceSpan(shared->records + first, first_count),
+      TraceSpan(shared->records, count - first_count)};
+  get()->container->add(tc_id, spans, 2);
+
+  shared->tail.store(head, std::memory_order_release);
+}
+
+void SHMRuntimeWriterSingleton::flush_ring_compressed(TraceRingBuffer *ring,
+                                                      const unsigned long tc_id,
+                                                      const size_t tail,
+                                                      const size_t head) {
+  if (!ring->compressed)
+    ring->compressed = new uint8_t[RUNTIME_COMPRESSED_CHUNK_SIZE];
+  shm::TraceCompressor compressor(ring->compressed,
+                                  RUNTIME_COMPRESSED_CHUNK_SIZE);
+
+  TraceElement element;
+  size_t i = tail;
+  while (i < head) {
+    // An extended element can wrap around the end of the ring
+    const TraceRecord pair[2] = {
+        ring->shared->records[i & TraceRingBuffer::mask],
+        ring->shared->records[(i + 1) & TraceRingBuffer::mask]};
+    const size_t length = shm::decode_trace_record(pair, head - i, element);
+    if (!length)
+      break;
+    if (!compressor.add(element)) {
+      get()->container->add_compressed(tc_id, compressor.out, compressor.size,
+                                       compressor.num_elements);
+      compressor.reset();
+      continue;
+    }
+    i += length;
+  }
+  compressor.finish();
+  get()->container->add_compressed(tc_id, compressor.out, compressor.size,
+                                   compressor.num_elements);
+}
+
+void SHMRuntimeWriterSingleton::flush() {
 #if (NASTY_DEBUG == 1)
   std::cout << "Flushing current data" << std::endl;
 #endif
 
-  size_t num = 0;
-  const unsigned long tc_id = __coverage_get_testcase_id();
-  get()->container->add(tc_id, trace);
-  trace.clear();
+  if (!get()->segment) {
+    flush_rings();
+    return;
+  }
+
+  const uint32_t cmp_count =
+      std::min<uint32_t>(cmp_size.load(), CMP_LOG_SIZE);
+  if (cmp_count)
+    get()->cmp_logs->add(__coverage_get_testcase_id(), cmp_entries, cmp_count);
+
+  if (trace_mode == E_TRACE_MODE_EDGE_MAP) {
+    get()->edge_maps->add(__coverage_get_testcase_id(), edge_hits,
+                          (TraceKind)edge_map_status.load());
+    // Nothing left for the fuzzer to salvage (until the next `reset`)
+    if (pending)
+      pending->status.store(E_TERMINATED, std::memory_order_release);
+    return;
+  }
+
+  flush_rings();
 
 #if (NASTY_DEBUG == 1)
-  std::cout << "Dumped trace for tc_id=" << tc_id << std::endl;
+  std::cout << "Dumped trace for tc_id=" << __coverage_get_testcase_id()
+            << std::endl;
 #endif
 }
 
+void SHMRuntimeWriterSingleton::flush_rings() {
+  const size_t available =
+      std::min<size_t>(num_rings.load(std::memory_order_acquire),
+                       RUNTIME_MAX_RINGS);
+  for (size_t i = 0; i < available; i++) {
+    if (TraceRingBuffer *ring = rings[i].load(std::memory_order_acquire)) {
+      flush_ring(ring);
+    }
+  }
+  flush_ring(overflow_ring);
+}
+
+void SHMRuntimeWriterSingleton::start_flusher() {
+  std::lock_guard<std::mutex> lock(flusher_mutex);
+  if (!flush_interval_ms || flusher)
+    return;
+
+  // The signals (e.g. the timeout of the fuzzer) must be handled by the
+  // threads of the SUT, not while the flusher holds a ring
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  flusher_running = true;
+  flusher = new std::thread(flusher_loop);
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
+void SHMRuntimeWriterSingleton::stop_flusher() {
+  std::thread *thread = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(flusher_mutex);
+    flusher_running = false;
+    std::swap(thread, flusher);
+  }
+  if (!thread)
+    return;
+  flusher_cv.notify_all();
+  thread->join();
+  delete thread;
+}
+
+void SHMRuntimeWriterSingleton::flusher_loop() {
+  // Waits for the end of the initialization of the singleton
+  SHMRuntimeWriterSingleton *self = Instance();
+
+  std::unique_lock<std::mutex> lock(flusher_mutex);
+  while (flusher_running) {
+    flusher_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms));
+    if (!flusher_running)
+      break;
+    lock.unlock();
+    self->flush_rings();
+    lock.lock();
+  }
+}
+
 void SHMRuntimeWriterSingleton::add(const TraceElement &trace_element) {
-  std::lock_guard<std::mutex> lock(trace_mutex);
-  trace.push_back(trace_element);
+  // The full list has the function boundaries, the fuzzer finds the contexts
+  // by itself
+  if (hit_buckets) {
+    if (context_depth)
+      track_context(trace_element);
+    if (!enters_new_bucket(trace_element))
+      return;
+  }
+
+  const uint32_t index = (uint32_t)get_thread_id();
+  TraceRingBuffer *ring = local_ring(index);
+  if (ring == overflow_ring) {
+    std::lock_guard<std::mutex> lock(overflow_mutex);
+    if (ring->full())
+      flush_ring(ring);
+    ring->push(trace_element, index);
+    return;
+  }
+
+  const size_t pending = ring->pending();
+  if (pending > TraceRingBuffer::capacity - 2) {
+    flush_ring(ring);
+  } else if (flush_interval_ms && pending < TraceRingBuffer::capacity / 2 &&
+             pending + 2 >= TraceRingBuffer::capacity / 2) {
+    flusher_cv.notify_one();
+  }
+  ring->push(trace_element, index);
+}
+
+bool SHMRuntimeWriterSingleton::enters_new_bucket(
+    const TraceElement &trace_element) {
+  switch (trace_element.kind) {
+  case E_TRUE_BRANCH:
+  case E_FALSE_BRANCH:
+  case E_EXCEPTION_BRANCH:
+    break;
+  default:
+    return true;
+  }
+
+  const uint32_t index =
+      trace_element.kind == E_FALSE_BRANCH
+          ? shm::skip_edge_index(trace_element.func_id,
+                                 trace_element.pred_block_id,
+                                 trace_element.cur_block_id)
+          : shm::edge_index(trace_element.func_id, trace_element.pred_block_id,
+                            trace_element.cur_block_id);
+  uint8_t &hits = edge_hits[index ^ call_context];
+  if (hits == 0xff)
+    return false;
+  ++hits;
+  return shm::bucket_hits(hits) != shm::bucket_hits(hits - 1);
+}
+
+void SHMRuntimeWriterSingleton::track_context(
+    const TraceElement &trace_element) {
+  switch (trace_element.kind) {
+  case E_ENTER_FUNCTION:
+    if (call_depth < RUNTIME_CALL_STACK_SIZE)
+      call_stack[call_depth] = (uint32_t)trace_element.func_id;
+    call_depth++;
+    break;
+  case E_EXIT_FUNCTION:
+    if (!call_depth)
+      return;
+    call_depth--;
+    break;
+  default:
+    return;
+  }
+  call_context = shm::context_hash(
+      call_stack, std::min<uint32_t>(call_depth, RUNTIME_CALL_STACK_SIZE),
+      context_depth);
+}
+
+void SHMRuntimeWriterSingleton::add_edge(const TraceElement &trace_element) {
+  if (context_depth)
+    track_context(trace_element);
+
+  uint32_t index = 0;
+  switch (trace_element.kind) {
+  case E_TRUE_BRANCH:
+  case E_EXCEPTION_BRANCH:
+    index = shm::edge_index(trace_element.func_id, trace_element.pred_block_id,
+                            trace_element.cur_block_id);
+    break;
+  case E_FALSE_BRANCH:
+    index = shm::skip_edge_index(trace_element.func_id,
+                                 trace_element.pred_block_id,
+                                 trace_element.cur_block_id);
+    break;
+  case E_ENTER_FUNCTION:
+    index = shm::edge_index(trace_element.func_id, 0, 0);
+    break;
+  case E_TERMINATED:
+  case E_CRASHED:
+  case E_TIMEDOUT:
+    edge_map_status.store(trace_element.kind);
+    return;
+  default:
+    return;
+  }
+
+  uint8_t &hits = edge_hits[index ^ call_context];
+  if (hits != 0xff)
+    ++hits;
+}
+
+bool SHMRuntimeWriterSingleton::first_skip(const uint32_t func_id,
+                                           const uint32_t pred_block_id,
+                                           const uint32_t cur_block_id) {
+  const uint32_t index =
+      shm::skip_edge_index(func_id, pred_block_id, cur_block_id);
+  std::atomic<uint8_t> &bits = skipped_branches[index >> 3];
+  const uint8_t mask = (uint8_t)(1 << (index & 7));
+  if (bits.load(std::memory_order_relaxed) & mask)
+    return false;
+  return !(bits.fetch_or(mask, std::memory_order_relaxed) & mask);
+}
+
+void SHMRuntimeWriterSingleton::add_cmp(const shm::CmpOperands &operands) {
+  if (cmp_size.load(std::memory_order_relaxed) >= CMP_LOG_SIZE)
+    return;
+
+  uint64_t h = (operands.lhs * 0x9E3779B97F4A7C15ull) ^
+               (operands.rhs * 0xC2B2AE3D27D4EB4Full) ^
+               ((uint64_t)operands.func_id << 32 | operands.block_id) ^
+               operands.width;
+  h ^= h >> 29;
+  h |= 1; // 0 is a free entry
+  for (uint32_t probe = 0; probe < 8; probe++) {
+    std::atomic<uint64_t> &seen =
+        cmp_seen[(h + probe) & (RUNTIME_CMP_SEEN_SIZE - 1)];
+    uint64_t current = seen.load(std::memory_order_relaxed);
+    if (current == h)
+      return;
+    if (current == 0) {
+      if (!seen.compare_exchange_strong(current, h))
+        return; // Lost against another thread, likely the same comparison
+      uint8_t &site_hits =
+          cmp_site_hits[shm::edge_index(operands.func_id, operands.block_id,
+                                        0) &
+                        (RUNTIME_CMP_SITES - 1)];
+      if (site_hits >= CMP_LOG_MAX_PER_SITE)
+        return;
+      site_hits++;
+      const uint32_t index = cmp_size.fetch_add(1);
+      if (index < CMP_LOG_SIZE)
+        cmp_entries[index] = operands;
+      return;
+    }
+  }
+}
+
+void SHMRuntimeWriterSingleton::reset() {
+  std::memset(edge_hits, 0, EDGE_MAP_SIZE);
+  for (size_t i = 0; i < EDGE_MAP_SIZE / 8; i++)
+    skipped_branches[i].store(0, std::memory_order_relaxed);
+  if (cmp_log) {
+    cmp_size.store(0);
+    for (size_t i = 0; i < RUNTIME_CMP_SEEN_SIZE; i++)
+      cmp_seen[i].store(0, std::memory_order_relaxed);
+    std::memset(cmp_site_hits, 0, sizeof(cmp_site_hits));
+  }
+  edge_map_status.store(E_UNKNOWN);
+  // The previous testcase of the persistent loop may not have returned to
+  // the loop through the exits of its functions (exceptions, longjmp)
+  std::memset(call_stack, 0, sizeof(call_stack));
+  call_depth = 0;
+  call_context = 0;
+  if (pending) {
+    pending->testcase_id.store(__coverage_get_testcase_id());
+    pending->status.store(E_UNKNOWN, std::memory_order_release);
+  }
+}
+
+void SHMRuntimeWriterSingleton::terminated() {
+  if (pending)
+    pending->status.store(E_TERMINATED, std::memory_order_release);
+}
+
+void SHMRuntimeWriterSingleton::publish(const shm::TraceKind kind) {
+  edge_map_status.store(kind);
+  if (pending)
+    pending->status.store(kind, std::memory_order_release);
+}
+
+void SHMRuntimeWriterSingleton::after_fork() {
+  if (!ptee)
+    return;
+
+  // The rings and counters of the server are still shared with it
+  if (ptee->segment) {
+    pending =
+        ptee->pending->create_pending(getpid(), __coverage_get_testcase_id(),
+                                      ptee->container, ptee->edge_maps);
+  }
+  if (trace_mode == E_TRACE_MODE_EDGE_MAP) {
+    uint8_t *hits = pending ? ptee->pending->create_edge_hits(pending) : nullptr;
+    if (!hits)
+      hits = new uint8_t[EDGE_MAP_SIZE];
+    std::memcpy(hits, edge_hits, EDGE_MAP_SIZE);
+    edge_hits = hits;
+    __coverage_edge_map = edge_hits;
+  }
+
+  for (uint32_t index = 0; index <= RUNTIME_MAX_RINGS; index++) {
+    TraceRingBuffer *ring = index < RUNTIME_MAX_RINGS
+                                ? rings[index].load(std::memory_order_acquire)
+                                : overflow_ring;
+    if (!ring)
+      continue;
+    shm::PendingRing *copy = create_pending_ring(index);
+    copy->head.store(ring->shared->head.load());
+    copy->tail.store(ring->shared->tail.load());
+    std::memcpy(copy->records, ring->shared->records, sizeof(copy->records));
+    ring->shared = copy;
+  }
+}
+
+void SHMRuntimeWriterSingleton::remove_pending() {
+  if (ptee && pending)
+    ptee->pending->remove_pending(getpid());
+  pending = nullptr;
 }
 
 static bool breakpad_dump_callback(const char *dump_dir,
@@ -142,8 +650,9 @@ static bool breakpad_dump_callback(const char *dump_dir,
             << std::endl;
 #endif
 
-  runtime::handle_trace_element(TraceElement(E_CRASHED));
-  runtime::writer->flush();
+  // Anything else could deadlock or corrupt the SHM: the fuzzer salvages the
+  // pending trace once we're dead
+  SHMRuntimeWriterSingleton::publish(E_CRASHED);
 
 #if (NASTY_DEBUG == 1)
   std::cout << "breakpad_dump_callback for " << __coverage_get_testcase_id()
@@ -158,13 +667,8 @@ static void handle_custom_signal(int signum) {
   std::cout << "handle_custom_signal for " << __coverage_get_testcase_id()
             << std::endl;
 #endif
-  runtime::handle_trace_element(TraceElement(E_TIMEDOUT));
-  runtime::writer->flush();
-#if (NASTY_DEBUG == 1)
-  std::cout << "handle_custom_signal exits " << __coverage_get_testcase_id()
-            << std::endl;
-#endif
-  std::exit(0);
+  SHMRuntimeWriterSingleton::publish(E_TIMEDOUT);
+  _exit(0);
 #else
 #pragma error "This has never been tested in Windows platforms..."
 #endif
@@ -226,6 +730,126 @@ void install_breakpad() {
 #pragma error "Unsupported platform?!"
 #endif
 }
+
+// The fuzzer is gone, don't run any atexit handler
+static void exit_fork_server() {
+  SHMRuntimeWriterSingleton::remove_pending();
+  _exit(0);
+}
+
+// Only returns in the forked children, or right away when the SUT wasn't
+// launched by the fuzzer's fork server. See shared-data/fork-server.h.
+//
+// Note that only the current thread survives the fork, so threads started by
+// static constructors before the first instrumented function won't be there
+// in the children.
+void run_fork_server() {
+  if (forkServerStarted.exchange(true))
+    return;
+
+  SHMRuntimeWriterSingleton::stop_flusher();
+
+  const uint32_t hello = FORK_SERVER_HELLO;
+  if (!fork_server_write(FORK_SERVER_ST_FD, &hello, sizeof(hello)))
+    return;
+
+#if (NASTY_DEBUG == 1)
+  std::cout << "[[COVERAGE_INSTR_RUNTIME]] Fork server started" << std::endl;
+#endif
+
+  while (true) {
+    uint64_t tc_id = 0;
+    if (!fork_server_read(FORK_SERVER_CTL_FD, &tc_id, sizeof(tc_id)))
+      exit_fork_server();
+
+    std::cout.flush();
+    const pid_t pid = fork();
+    if (pid < 0) {
+      _exit(1);
+    }
+
+    if (pid == 0) {
+      close(FORK_SERVER_CTL_FD);
+      close(FORK_SERVER_ST_FD);
+      unsetenv(ENV_FORK_SERVER);
+
+      testCaseId.store(tc_id);
+      testCaseIdFetched = true;
+      SHMRuntimeWriterSingleton::after_fork();
+      SHMRuntimeWriterSingleton::start_flusher();
+      return;
+    }
+
+    const int32_t child_pid = pid;
+    if (!fork_server_write(FORK_SERVER_ST_FD, &child_pid, sizeof(child_pid)))
+      exit_fork_server();
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+      if (errno != EINTR)
+        break;
+    }
+
+    const int32_t child_status = status;
+    if (!fork_server_write(FORK_SERVER_ST_FD, &child_status,
+                           sizeof(child_status)))
+      exit_fork_server();
+  }
+}
+
+void run_persistent(persistent_callback_t callback) {
+  if (!sharedMemoryInitialized) {
+    runtime::writer = runtime::SHMRuntimeWriterSingleton::Instance();
+    sharedMemoryInitialized = true;
+  }
+
+  // Never fork from here
+  forkServerStarted = true;
+
+  const uint32_t hello = FORK_SERVER_HELLO;
+  if (!fork_server_write(FORK_SERVER_ST_FD, &hello, sizeof(hello)))
+    return;
+
+  const int32_t pid = getpid();
+  shm::PersistentInput *input = nullptr;
+
+  while (true) {
+    uint64_t tc_id = 0;
+    if (!fork_server_read(FORK_SERVER_CTL_FD, &tc_id, sizeof(tc_id)))
+      return;
+
+    // The fuzzer creates the buffer once it knows our pid
+    if (!input && writer->get()->inputs)
+      input = writer->get()->inputs->get_input(pid);
+
+    testCaseId.store(tc_id);
+    testCaseIdFetched = true;
+    writer->reset();
+
+    if (!fork_server_write(FORK_SERVER_ST_FD, &pid, sizeof(pid)))
+      return;
+
+    if (input) {
+      callback(input->data, input->size);
+    } else {
+      callback(nullptr, 0);
+    }
+
+    handle_trace_element(TraceElement(E_TERMINATED));
+    writer->flush();
+    writer->terminated();
+
+    const int32_t status = 0;
+    if (!fork_server_write(FORK_SERVER_ST_FD, &status, sizeof(status)))
+      return;
+  }
+}
+}
+
+size_t get_thread_id() {
+  if (runtime::cached_thread_index)
+    return runtime::cached_thread_index - 1;
+  return runtime::assign_thread_index();
 }
 
 //
@@ -247,6 +871,9 @@ void __coverage_reach_block(const unsigned long func_id,
 void __coverage_skip_block(const unsigned long func_id,
                       const unsigned int pred_block_id,
                       const unsigned int cur_block_id) {
+  if (!runtime::SHMRuntimeWriterSingleton::first_skip(
+          (uint32_t)func_id, pred_block_id, cur_block_id))
+    return;
 #if (NASTY_DEBUG == 1)
   std::cout << get_thread_id() << " false_branch(" << pred_block_id << "->"
             << cur_block_id << ")" << std::endl;
@@ -255,6 +882,29 @@ void __coverage_skip_block(const unsigned long func_id,
       E_FALSE_BRANCH, get_thread_id(), func_id, pred_block_id, cur_block_id));
 }
 
+void __coverage_cmp(const unsigned long func_id, const unsigned int block_id,
+                    const unsigned long long lhs, const unsigned long long rhs,
+                    const unsigned int width) {
+  if (!runtime::SHMRuntimeWriterSingleton::logs_cmp() || !runtime::writer)
+    return;
+  // Signed operands were sign-extended by the instrumentation
+  const unsigned long long mask =
+      width >= 8 ? ~0ull : (1ull << (width * 8)) - 1;
+  if ((lhs & mask) == (rhs & mask))
+    return;
+#if (NASTY_DEBUG == 1)
+  std::cout << get_thread_id() << " cmp(" << block_id << ", " << (lhs & mask)
+            << ", " << (rhs & mask) << ")" << std::endl;
+#endif
+  shm::CmpOperands operands;
+  operands.func_id = (uint32_t)func_id;
+  operands.block_id = block_id;
+  operands.lhs = lhs & mask;
+  operands.rhs = rhs & mask;
+  operands.width = width;
+  runtime::writer->add_cmp(operands);
+}
+
 void __coverage_enter_func(const unsigned long func_id) {
   if (!sharedMemoryInitialized) {
     runtime::writer = runtime::SHMRuntimeWriterSingleton::Instance();
@@ -291,8 +941,10 @@ void __coverage_terminated() {
 #if (NASTY_DEBUG == 1)
   std::cout << get_thread_id() << " exit_program()" << std::endl;
 #endif
+  runtime::SHMRuntimeWriterSingleton::stop_flusher();
   runtime::handle_trace_element(TraceElement(E_TERMINATED));
   runtime::writer->flush();
+  runtime::writer->terminated();
 }
 
 void __coverage_install_atexit() {
@@ -303,8 +955,8 @@ void __coverage_install_atexit() {
     progTerminationHandlerInstalled = true;
     std::atexit(__coverage_terminated);
 
-    // Install a signal handler to flush the trace when there is a
-    // timeout sent from the fuzzer
+    // Install a signal handler to publish E_TIMEDOUT when the fuzzer signals
+    // a timeout
     runtime::install_signal_handler();
 
     // We installed a normal termination handler with `atexit`, that's used to
@@ -314,6 +966,14 @@ void __coverage_install_atexit() {
     // the fuzzer can inspect to get deeper insight.
     runtime::install_breakpad();
 
+    // Everything above is done once, the fork server then only forks the
+    // testcases from this point (unless the SUT has its own snapshot point).
+    if (std::getenv(ENV_FORK_SERVER) &&
+        !std::getenv(ENV_FORK_SERVER_DEFERRED)) {
+      runtime::run_fork_server();
+    }
+    runtime::SHMRuntimeWriterSingleton::start_flusher();
+
     // After breakpad is installed, we can inject our fault
     if (const char *crash_test = std::getenv("COVERAGE_FUZZING_CRASH_ME")) {
       const unsigned int crash_test_num =
@@ -326,6 +986,20 @@ void __coverage_install_atexit() {
   }
 }
 
+void __coverage_fork_here() {
+  if (!std::getenv(ENV_FORK_SERVER) || !std::getenv(ENV_FORK_SERVER_DEFERRED))
+    return;
+
+  if (!sharedMemoryInitialized) {
+    runtime::writer = runtime::SHMRuntimeWriterSingleton::Instance();
+    sharedMemoryInitialized = true;
+  }
+#if (NASTY_DEBUG == 1)
+  std::cout << get_thread_id() << " fork_here()" << std::endl;
+#endif
+  runtime::run_fork_server();
+}
+
 unsigned long __coverage_get_testcase_id() {
   if (!testCaseIdFetched) {
     // The fuzzer needs to create a special env when it will set the testcase id
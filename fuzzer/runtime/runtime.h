@@ -5,16 +5,26 @@
 #define CPP_11_SUPPORT
 #endif
 
+// Small dense index of the calling thread, assigned on its first call. Only
+// the index is in the trace records: `runtime::thread_os_id` maps it back to
+// the thread within the target process, the fuzzer doesn't know the thread.
 size_t get_thread_id();
 
 // For function f. made the transition from BBL 1 to BBL 2
 void __coverage_reach_block(const unsigned long, const unsigned int,
                        const unsigned int);
 
-// For function f. did not make transition from BBL 1 to BBL 2
+// For function f. did not make transition from BBL 1 to BBL 2. Only the first
+// one of each testcase is recorded.
 void __coverage_skip_block(const unsigned long, const unsigned int,
                       const unsigned int);
 
+// For function f. compared two integers of the given width (in bytes) in a
+// branch condition of BBL 1
+void __coverage_cmp(const unsigned long, const unsigned int,
+                    const unsigned long long, const unsigned long long,
+                    const unsigned int);
+
 void __coverage_enter_func(const unsigned long);
 void __coverage_exit_func(const unsigned long);
 
@@ -24,16 +34,98 @@ void __coverage_terminated();
 
 void __coverage_install_atexit();
 
+// Snapshot point of a deferred fork server: when the fuzzer asks for it, the
+// children are forked from here instead of from the runtime initialization.
+// Must be placed before the SUT reads its input, and before it starts threads.
+// Does nothing otherwise.
+void __coverage_fork_here();
+
 unsigned long __coverage_get_testcase_id();
 
+// Hit counts of the edges, by `shm::edge_index`, incremented inline by the
+// code instrumented with `inline-counters`. Points to the edge map of the
+// current testcase once the runtime is initialized.
+extern unsigned char *__coverage_edge_map;
+
 #include "shared-data/shared-data.h"
 #include <atomic>
-#include <list>
+#include <condition_variable>
+#include <cstddef>
 #include <mutex>
+#include <thread>
 #include <vector>
 
+// Number of trace records each thread can buffer before it has to flush
+// them into the shared memory. Must be a power of 2.
+#define RUNTIME_RING_CAPACITY PENDING_RING_CAPACITY
+
+// Maximum number of threads alive at the same time with their own index and
+// thread buffer. The others share RUNTIME_OVERFLOW_THREAD, the last index the
+// trace records can hold (TRACE_RECORD_MAX_THREAD).
+#define RUNTIME_MAX_RINGS 1023
+#define RUNTIME_OVERFLOW_THREAD RUNTIME_MAX_RINGS
+
+// Size of the compressed chunks written when ENV_TRACE_COMPRESSION is set
+#define RUNTIME_COMPRESSED_CHUNK_SIZE 16384
+
+// Call stack depth tracked for ENV_CONTEXT_DEPTH, deeper frames only count
+#define RUNTIME_CALL_STACK_SIZE 1024
+
+// Fingerprints of the comparisons already logged with ENV_CMP_LOG, and
+// counters of their sites. Must be powers of 2.
+#define RUNTIME_CMP_SEEN_SIZE 4096
+#define RUNTIME_CMP_SITES 1024
+
 namespace runtime {
 
+// A single-producer ring of encoded trace records. Each thread index owns one
+// and its thread is the only one to push into it, so recording an event
+// doesn't take any lock or allocate. The consumer side (flushing into the shared
+// memory) can be the owner thread when the ring is full, or any thread at
+// exit; consumers are serialized with `consumer_mutex` which is never taken on
+// the hot path.
+//
+// The records themselves are in the pending trace of the process (see
+// `shm::PendingTrace`), so a crash or a timeout doesn't need to flush them.
+struct TraceRingBuffer {
+  static const size_t capacity = RUNTIME_RING_CAPACITY;
+  static const size_t mask = RUNTIME_RING_CAPACITY - 1;
+
+  // In the SHM, or on the heap if it was full
+  shm::PendingRing *shared;
+  std::mutex consumer_mutex;
+
+  // RUNTIME_COMPRESSED_CHUNK_SIZE bytes, allocated by the first compressed
+  // flush
+  uint8_t *compressed = nullptr;
+
+  TraceRingBuffer(shm::PendingRing *shared) : shared(shared) {}
+  TraceRingBuffer(const TraceRingBuffer &) = delete;
+  TraceRingBuffer &operator=(const TraceRingBuffer &) = delete;
+
+  // Number of records waiting to be flushed
+  inline size_t pending() const {
+    return shared->head.load(std::memory_order_relaxed) -
+           shared->tail.load(std::memory_order_acquire);
+  }
+
+  // An element takes up to 2 records
+  inline bool full() const { return pending() > capacity - 2; }
+
+  inline void push(const shm::TraceElement &trace_element,
+                   const uint32_t thread_index) {
+    shm::TraceRecord encoded[2];
+    const size_t count =
+        shm::encode_trace_record(trace_element, thread_index, encoded);
+    shm::PendingRing *ring = shared;
+    const size_t h = ring->head.load(std::memory_order_relaxed);
+    ring->records[h & mask] = encoded[0];
+    if (count > 1)
+      ring->records[(h + 1) & mask] = encoded[1];
+    ring->head.store(h + count, std::memory_order_release);
+  }
+};
+
 // A singleton guard that's thread safe (using double-lock mechanism). It's used
 // to capture the only reference
 class SHMRuntimeWriterSingleton {
@@ -48,26 +140,141 @@ public:
 
   inline shm::SHMRuntimeWriter *get() { return ptee; }
 
-  // We don't write in real-time inside the shared memory, we just flush once
-  // every N trace elements.
+  // We don't write in real-time inside the shared memory. Each thread fills
+  // its own ring, which gets flushed in bulk when it's full or when the
+  // program terminates. `flush` drains the rings of all threads.
   void flush();
 
   void add(const shm::TraceElement &trace_element);
 
+  // In E_TRACE_MODE_EDGE_MAP, the trace isn't kept. Only the hit counters
+  // of the edges are updated, and `flush` publishes them as an edge map.
+  void add_edge(const shm::TraceElement &trace_element);
+
+  inline shm::TraceMode mode() const { return trace_mode; }
+
+  // With ENV_CMP_LOG, remember the operands of a comparison for the fuzzer.
+  // Each distinct one is kept once, up to CMP_LOG_MAX_PER_SITE per site and
+  // CMP_LOG_SIZE in total, and `flush` publishes them.
+  static inline bool logs_cmp() { return cmp_log; }
+  void add_cmp(const shm::CmpOperands &operands);
+
+  // Whether a not-taken branch is seen for the first time in the testcase,
+  // the only time it's recorded. One bit per `shm::skip_edge_index`, so
+  // colliding branches are only recorded once.
+  static bool first_skip(const uint32_t func_id, const uint32_t pred_block_id,
+                         const uint32_t cur_block_id);
+
+  // Flush the ring of a terminating thread, before its index is reused
+  void thread_exited(const uint32_t index);
+
+  // With ENV_FLUSH_INTERVAL_MS, a background thread drains the rings
+  // periodically, and as soon as one of them is half full, while their
+  // threads keep filling them. It doesn't survive a fork: the fork server
+  // stops it before forking and each child starts its own.
+  static void start_flusher();
+  static void stop_flusher();
+
+  // Forget the state of the previous testcase, when the same process runs
+  // several of them (persistent mode). The trace must have been flushed.
+  void reset();
+
+  // The process terminates normally, everything is flushed
+  void terminated();
+
+  // Only publish the terminal kind of the testcase (E_CRASHED, E_TIMEDOUT):
+  // the fuzzer takes what wasn't flushed from the pending trace once the
+  // process is dead. Async-signal-safe.
+  static void publish(const shm::TraceKind kind);
+
+  // In a child of the fork server: give it its own pending trace, with a copy
+  // of the rings and edge counters of the server
+  static void after_fork();
+
+  // In the fork server, before it exits
+  static void remove_pending();
+
 private:
   SHMRuntimeWriterSingleton() { initialize(); }
 
   void initialize();
 
+  // Get (or lazily create) the ring of a thread index
+  TraceRingBuffer *local_ring(const uint32_t index);
+
+  // Allocate the storage of a ring, in the pending trace when possible
+  static shm::PendingRing *create_pending_ring(const uint32_t index);
+
+  void flush_ring(TraceRingBuffer *ring);
+
+  // Flush the rings of all threads
+  void flush_rings();
+
+  static void flusher_loop();
+
+  // With ENV_HIT_BUCKETS, count a branch and tell whether its edge entered a
+  // new bucket, i.e. it has to be recorded. Other elements always are.
+  bool enters_new_bucket(const shm::TraceElement &trace_element);
+
+  // With ENV_CONTEXT_DEPTH, follow the function boundaries of the current
+  // thread to update its calling context
+  static void track_context(const shm::TraceElement &trace_element);
+
+  // Flush the pending records as compressed chunks
+  void flush_ring_compressed(TraceRingBuffer *ring, const unsigned long tc_id,
+                             const size_t tail, const size_t head);
+
   static std::atomic<SHMRuntimeWriterSingleton *> instance;
   static std::mutex mutex;
   static shm::SHMRuntimeWriter *ptee;
-  static std::list<shm::TraceElement> trace;
-  static std::mutex trace_mutex;
+
+  // The ring of each thread index, up to `num_rings`. Rings of terminated
+  // threads are flushed and reused with their index, they are never freed.
+  static std::atomic<TraceRingBuffer *> rings[RUNTIME_MAX_RINGS];
+  static std::atomic<size_t> num_rings;
+
+  // Used by RUNTIME_OVERFLOW_THREAD
+  static TraceRingBuffer *overflow_ring;
+  static std::mutex overflow_mutex;
+
+  static uint32_t flush_interval_ms; // 0 without background flusher
+  static std::thread *flusher;
+  static bool flusher_running;
+  static std::mutex flusher_mutex;
+  static std::condition_variable flusher_cv;
+
+  // Process-wide edge counters, saturating at 255. Updates from different
+  // threads can race, which only loses hits (same trade-off as AFL).
+  static shm::TraceMode trace_mode;
+  static bool compress_traces;
+  static bool hit_buckets; // counted in `edge_hits`
+  static uint32_t context_depth; // 0 without calling contexts
+  static uint8_t *edge_hits; // EDGE_MAP_SIZE, in the pending trace if possible
+  static std::atomic<int> edge_map_status;
+  static std::atomic<uint8_t> skipped_branches[EDGE_MAP_SIZE / 8];
+
+  static bool cmp_log;
+  static shm::CmpOperands cmp_entries[CMP_LOG_SIZE];
+  static std::atomic<uint32_t> cmp_size;
+  static std::atomic<uint64_t> cmp_seen[RUNTIME_CMP_SEEN_SIZE];
+  static uint8_t cmp_site_hits[RUNTIME_CMP_SITES];
+
+  // Of this process, nullptr if the SHM was full
+  static shm::PendingTrace *pending;
 };
 
+typedef int (*persistent_callback_t)(const uint8_t *data, size_t size);
+
 void install_breakpad();
 void install_signal_handler();
+void run_fork_server();
+
+// Serve the testcases of the fuzzer in-process, each one by a call to
+// `callback`. Returns when the fuzzer recycles the process.
+void run_persistent(persistent_callback_t callback);
+
+// OS thread id of the thread currently holding a thread index, 0 if it's free
+uint64_t thread_os_id(const uint32_t index);
 }
 
 #endif
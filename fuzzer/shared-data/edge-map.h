@@ -0,0 +1,40 @@
+#ifndef EDGE_MAP_H
+#define EDGE_MAP_H
+
+#include <cstdint>
+
+// Layout of the edge maps, shared by the runtime, the fuzzer and the
+// instrumenter (which inlines `edge_index` in the inline counters mode). Kept
+// free of any dependency for the latter.
+
+// Number of entries in an edge map. Must be a power of 2.
+#define EDGE_MAP_SIZE_POW2 16
+#define EDGE_MAP_SIZE (1 << EDGE_MAP_SIZE_POW2)
+
+#define EDGE_HASH_FUNC 0x9E3779B1u
+#define EDGE_HASH_PRED 0x85EBCA77u
+#define EDGE_HASH_CUR 0xC2B2AE3Du
+
+namespace shm {
+
+// The index of an edge in the edge map. Function boundaries are recorded as
+// the (func_id, 0, 0) edge. This is shared by the runtime and the fuzzer
+// so they agree on the layout of the map.
+inline uint32_t edge_index(const uint32_t func_id, const uint32_t pred_block_id,
+                           const uint32_t cur_block_id) {
+  const uint32_t h = (func_id * EDGE_HASH_FUNC) ^
+                     (pred_block_id * EDGE_HASH_PRED) ^
+                     (cur_block_id * EDGE_HASH_CUR);
+  return (h ^ (h >> EDGE_MAP_SIZE_POW2)) & (EDGE_MAP_SIZE - 1);
+}
+
+// The index of a branch into `cur_block_id` that was not taken
+// (E_FALSE_BRANCH), apart from the edge itself
+inline uint32_t skip_edge_index(const uint32_t func_id,
+                                const uint32_t pred_block_id,
+                                const uint32_t cur_block_id) {
+  return edge_index(func_id, pred_block_id, ~cur_block_id);
+}
+}
+
+#endif
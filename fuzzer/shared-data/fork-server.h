@@ -0,0 +1,78 @@
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+
+// Protocol between the fuzzer (`Commander`) and the fork server embedded in
+// the instrumented runtime.
+//
+// The fuzzer launches the SUT once, with COVERAGE_FUZZING_FORK_SERVER set, the
+// control pipe on FORK_SERVER_CTL_FD and the status pipe on FORK_SERVER_ST_FD.
+// When the runtime is initialized (first instrumented function), it stops
+// there and serves the fuzzer:
+//
+//   runtime -> fuzzer: uint32_t FORK_SERVER_HELLO, once the server is ready
+//   fuzzer -> runtime: uint64_t testcase_id, to run a new testcase
+//   runtime -> fuzzer: int32_t pid, of the forked child
+//   runtime -> fuzzer: int32_t status, of the child as returned by waitpid
+//
+// The child carries on with the execution of the program, using the testcase
+// id it was forked for. The runtime initialization, breakpad, the dynamic
+// loading and the static constructors are only paid once.
+//
+// With COVERAGE_FUZZING_FORK_SERVER_DEFERRED also set, the runtime doesn't
+// start the server at its initialization but when the SUT calls
+// `__coverage_fork_here()`, so its own expensive initialization is only done
+// once too.
+//
+// With COVERAGE_FUZZING_PERSISTENT instead, the SUT is a harness linked
+// without `main` (see runtime/persistent-main.cpp). It speaks the same
+// protocol but doesn't fork: every testcase runs in the server process itself,
+// which always reports its own pid. Its input is read from the shared memory.
+namespace shm {
+
+#define ENV_FORK_SERVER "COVERAGE_FUZZING_FORK_SERVER"
+#define ENV_FORK_SERVER_DEFERRED "COVERAGE_FUZZING_FORK_SERVER_DEFERRED"
+#define ENV_PERSISTENT "COVERAGE_FUZZING_PERSISTENT"
+
+#define FORK_SERVER_CTL_FD 198
+#define FORK_SERVER_ST_FD 199
+
+#define FORK_SERVER_HELLO 0x4b524f46
+
+// Read or write exactly `size` bytes on a pipe. Returns false when the other
+// end is closed.
+inline bool fork_server_read(const int fd, void *buffer, const size_t size) {
+  uint8_t *ptr = reinterpret_cast<uint8_t *>(buffer);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t ret = read(fd, ptr + done, size - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+
+inline bool fork_server_write(const int fd, const void *buffer,
+                              const size_t size) {
+  const uint8_t *ptr = reinterpret_cast<const uint8_t *>(buffer);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t ret = write(fd, ptr + done, size - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+}
+
+#endif
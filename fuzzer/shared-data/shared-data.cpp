@@ -1,12 +1,20 @@
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <new>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "shared-data.h"
 #include <boost/lexical_cast.hpp>
@@ -17,12 +25,32 @@ namespace shm {
 
 #define NASTY_DEBUG 0
 
-static const std::string SHARED_MEMORY_NAME =
+static const char LEGACY_SHARED_MEMORY_NAME[] =
     "5bac7840-9158-43c7-98d1-889369e4f0f0";
 
-static const char SHARED_TRACES_MUTEX_NAME[] = "__CTM_889369e4f0f0";
+// Not used anymore, but a crashed process of a previous version could have
+// left it locked
+static const char LEGACY_SHARED_TRACES_MUTEX_NAME[] = "__CTM_889369e4f0f0";
+
+static const std::size_t MAX_CAMPAIGN_ID_LENGTH = 64;
+
+static const char TRACE_SLOTS_NAME[] = "__trace_slots";
+static const char EDGE_MAP_SLOTS_NAME[] = "__edge_map_slots";
+static const char CMP_LOG_SLOTS_NAME[] = "__cmp_log_slots";
+static const char TOKEN_LOG_SLOTS_NAME[] = "__token_log_slots";
 
-static const std::size_t SHARED_MEMORY_SIZE = 5 * 104857600; // 500MB
+// How long the runtime waits for the fuzzer to create the SHM before it
+// creates it itself, the maximum delay between two attempts, and when it gives
+// up (the runtime then records nothing)
+static const unsigned int SHM_ATTACH_TIMEOUT_MS = 1000;
+static const unsigned int SHM_ATTACH_MAX_BACKOFF_MS = 64;
+static const unsigned int SHM_ATTACH_GIVE_UP_MS = 2000;
+
+// How long a writer waits for the slot of another testcase to be given back,
+// and how many times it only yields before it starts sleeping
+static const unsigned int SLOT_WAIT_TIMEOUT_US = 1000000;
+static const unsigned int SLOT_SPIN_YIELDS = 64;
+static const unsigned int SLOT_SLEEP_US = 100;
 
 const char *traceKindName(const TraceKind kind) {
   switch (kind) {
@@ -49,6 +77,23 @@ const char *traceKindName(const TraceKind kind) {
   }
 }
 
+const char *traceModeName(const TraceMode mode) {
+  switch (mode) {
+  case E_TRACE_MODE_LIST:
+    return "list";
+  case E_TRACE_MODE_EDGE_MAP:
+    return "edges";
+  default:
+    return "list";
+  }
+}
+
+TraceMode traceModeFromName(const std::string &name) {
+  if (name == "edges")
+    return E_TRACE_MODE_EDGE_MAP;
+  return E_TRACE_MODE_LIST;
+}
+
 std::string TraceElement::toString() const {
   ostringstream oss;
   oss << "<TraceElement kind=" << traceKindName(kind)
@@ -66,15 +111,360 @@ bool operator==(const TraceElement &a, const TraceElement &b) {
          a.cur_block_id == b.cur_block_id;
 }
 
+//
+// Trace compression
+//
+
+static inline uint64_t zigzag(const int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(const uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint8_t compressed_kind(const TraceKind kind) {
+  return kind < TRACE_RECORD_EXT_TAIL ? (uint8_t)kind : TRACE_RECORD_UNKNOWN;
+}
+
+uint32_t TraceCompressor::hash_element(const TraceElement &e) {
+  const uint32_t h = (e.func_id * 0x9E3779B1u) ^ (e.cur_block_id * 0x85EBCA77u) ^
+                     (e.pred_block_id * 0xC2B2AE3Du) ^ (uint32_t)e.kind ^
+                     (uint32_t)e.thread_id;
+  return (h >> 24) & (TRACE_COMPRESSION_HASH_SIZE - 1);
+}
+
+void TraceCompressor::write_varint(uint64_t value) {
+  while (value >= 0x80) {
+    out[size++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (uint8_t)value;
+}
+
+void TraceCompressor::write_element(const TraceElement &e,
+                                    const TraceElement &previous) {
+  uint8_t tag = compressed_kind(e.kind);
+  const bool no_block = !e.pred_block_id && !e.cur_block_id;
+  if (e.thread_id != previous.thread_id)
+    tag |= 0x10;
+  if (e.func_id != previous.func_id)
+    tag |= 0x20;
+  if (no_block)
+    tag |= 0x40;
+  else if (e.pred_block_id != previous.cur_block_id)
+    tag |= 0x80;
+
+  out[size++] = tag;
+  if (tag & 0x10)
+    write_varint(e.thread_id);
+  if (tag & 0x20)
+    write_varint(zigzag((int64_t)e.func_id - previous.func_id));
+  if (no_block)
+    return;
+  if (tag & 0x80)
+    write_varint(zigzag((int64_t)e.pred_block_id - previous.cur_block_id));
+  write_varint(zigzag((int64_t)e.cur_block_id - e.pred_block_id));
+}
+
+bool TraceCompressor::add(const TraceElement &e) {
+  // Enough for the literals of an aborted run and `e`
+  if (capacity - size <
+      (TRACE_COMPRESSION_MIN_RUN + 1) * TRACE_COMPRESSION_MAX_ELEMENT_BYTES) {
+    finish();
+    return false;
+  }
+
+  if (run_period) {
+    if (e == history_at(position - run_period)) {
+      last_seen[hash_element(e)] = position + 1;
+      history[position++ & (TRACE_COMPRESSION_WINDOW - 1)] = e;
+      run_length++;
+      num_elements++;
+      return true;
+    }
+    finish();
+  }
+
+  // Start a run on the last identical element, if it's in the window
+  uint64_t &last = last_seen[hash_element(e)];
+  const uint64_t seen = last;
+  last = position + 1;
+  if (seen && position + 1 - seen <= TRACE_COMPRESSION_WINDOW &&
+      e == history_at(seen - 1)) {
+    run_period = (uint32_t)(position + 1 - seen);
+    run_length = 1;
+  }
+  if (!run_period)
+    write_element(e, position ? history_at(position - 1) : TraceElement());
+  history[position++ & (TRACE_COMPRESSION_WINDOW - 1)] = e;
+  num_elements++;
+  return true;
+}
+
+void TraceCompressor::finish() {
+  if (!run_period)
+    return;
+  if (run_length >= TRACE_COMPRESSION_MIN_RUN) {
+    out[size++] = TRACE_COMPRESSION_REPEAT;
+    write_varint(run_period);
+    write_varint(run_length);
+  } else {
+    // Every element of a run has a predecessor in the window
+    for (uint64_t i = position - run_length; i < position; i++)
+      write_element(history_at(i), history_at(i - 1));
+  }
+  run_period = 0;
+  run_length = 0;
+}
+
+void TraceCompressor::reset() {
+  std::memset(last_seen, 0, sizeof(last_seen));
+  size = 0;
+  num_elements = 0;
+  position = 0;
+  run_period = 0;
+  run_length = 0;
+}
+
+bool CompressedTraceReader::read_varint(uint64_t &value) {
+  value = 0;
+  for (unsigned shift = 0; offset < size && shift < 64; shift += 7) {
+    const uint8_t byte = data[offset++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool CompressedTraceReader::next(TraceElement &e) {
+  while (!run_left) {
+    if (offset >= size)
+      return false;
+    const uint8_t tag = data[offset++];
+    if ((tag & 0xf) != TRACE_COMPRESSION_REPEAT) {
+      const TraceElement previous =
+          position ? history_at(position - 1) : TraceElement();
+      const uint32_t kind = tag & 0xf;
+      uint64_t value = 0;
+      e.kind = kind == TRACE_RECORD_UNKNOWN ? E_UNKNOWN : (TraceKind)kind;
+      e.thread_id = previous.thread_id;
+      e.func_id = previous.func_id;
+      e.pred_block_id = 0;
+      e.cur_block_id = 0;
+      if ((tag & 0x10) && !read_varint(e.thread_id))
+        break;
+      if (tag & 0x20) {
+        if (!read_varint(value))
+          break;
+        e.func_id = (uint32_t)(previous.func_id + unzigzag(value));
+      }
+      if (!(tag & 0x40)) {
+        e.pred_block_id = previous.cur_block_id;
+        if (tag & 0x80) {
+          if (!read_varint(value))
+            break;
+          e.pred_block_id = (uint32_t)(previous.cur_block_id + unzigzag(value));
+        }
+        if (!read_varint(value))
+          break;
+        e.cur_block_id = (uint32_t)(e.pred_block_id + unzigzag(value));
+      }
+      history[position++ & (TRACE_COMPRESSION_WINDOW - 1)] = e;
+      return true;
+    }
+
+    uint64_t period = 0, length = 0;
+    if (!read_varint(period) || !read_varint(length) || !period ||
+        period > TRACE_COMPRESSION_WINDOW || period > position)
+      break;
+    run_period = (uint32_t)period;
+    run_left = length;
+  }
+
+  if (run_left) {
+    e = history_at(position - run_period);
+    history[position++ & (TRACE_COMPRESSION_WINDOW - 1)] = e;
+    run_left--;
+    return true;
+  }
+
+  // Corrupted chunk
+  offset = size;
+  return false;
+}
+
+//
+// SHMConfig
+//
+
+SHMConfig::SHMConfig(const std::string &id, const std::size_t segment_size_mb)
+    : segment_size(segment_size_mb * 1024 * 1024) {
+  for (const char c : id.substr(0, MAX_CAMPAIGN_ID_LENGTH)) {
+    campaign_id += (std::isalnum((unsigned char)c) || c == '_' || c == '-')
+                       ? c
+                       : '_';
+  }
+  if (campaign_id.empty()) {
+    segment_name = LEGACY_SHARED_MEMORY_NAME;
+    mutex_name = LEGACY_SHARED_TRACES_MUTEX_NAME;
+  } else {
+    segment_name = "coverage-fuzzing-" + campaign_id;
+    mutex_name = "__CTM_" + campaign_id;
+  }
+}
+
+const SHMConfig &SHMConfig::current() {
+  static const SHMConfig config = []() {
+    const char *id = std::getenv(ENV_CAMPAIGN_ID);
+    const char *size_mb = std::getenv(ENV_SHM_SIZE_MB);
+    std::size_t segment_size_mb = DEFAULT_SHM_SIZE_MB;
+    if (size_mb && std::strtoul(size_mb, nullptr, 10) > 0)
+      segment_size_mb = std::strtoul(size_mb, nullptr, 10);
+    return SHMConfig(id ? id : "", segment_size_mb);
+  }();
+  return config;
+}
+
+//
+// TestcaseSlots related methods
+//
+
+static inline uint64_t slot_word(const uint32_t state, const int32_t pid) {
+  return ((uint64_t)(uint32_t)pid << 32) | state;
+}
+
+static inline uint32_t slot_state(const uint64_t word) {
+  return (uint32_t)word;
+}
+
+static inline int32_t slot_owner(const uint64_t word) {
+  return (int32_t)(word >> 32);
+}
+
+static bool is_dead(const int32_t pid) {
+  return pid > 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+TestcaseSlots::TestcaseSlots(managed_shared_memory *shm, const char *name) {
+  slots = shm->find_or_construct<TestcaseSlot>(name)[TESTCASE_SLOTS]();
+}
+
+TestcaseSlot *TestcaseSlots::acquire_write(const key_type testcase_id,
+                                           void **evicted) {
+  TestcaseSlot &s = slot(testcase_id);
+  const uint64_t mine = slot_word(E_SLOT_WRITING, getpid());
+  *evicted = nullptr;
+
+  unsigned int waited_us = 0;
+  for (unsigned int attempt = 0;; attempt++) {
+    uint64_t word = s.state.load(std::memory_order_acquire);
+    const uint32_t state = slot_state(word);
+    const bool claimable = state == E_SLOT_FREE || state == E_SLOT_READY;
+    // Held by a process that died: its data can be half-written, so it's
+    // leaked rather than evicted
+    const bool abandoned = !claimable && attempt >= SLOT_SPIN_YIELDS &&
+                           is_dead(slot_owner(word));
+
+    if (claimable || abandoned) {
+      if (!s.state.compare_exchange_weak(word, mine,
+                                         std::memory_order_acq_rel))
+        continue;
+      if (abandoned || state == E_SLOT_FREE ||
+          s.testcase_id.load(std::memory_order_relaxed) != testcase_id) {
+        if (state == E_SLOT_READY)
+          *evicted = s.data.get();
+        s.data = nullptr;
+        s.testcase_id.store(testcase_id, std::memory_order_release);
+      }
+      return &s;
+    }
+
+    // Keep waiting if it's another thread of ours flushing the same testcase
+    if (waited_us >= SLOT_WAIT_TIMEOUT_US &&
+        s.testcase_id.load(std::memory_order_acquire) != testcase_id) {
+#if (NASTY_DEBUG == 1)
+      std::cerr << "TestcaseSlots- slot of " << testcase_id << " busy"
+                << std::endl;
+#endif
+      return nullptr;
+    }
+
+    if (attempt < SLOT_SPIN_YIELDS) {
+      sched_yield();
+    } else {
+      usleep(SLOT_SLEEP_US);
+      waited_us += SLOT_SLEEP_US;
+    }
+  }
+}
+
+void TestcaseSlots::publish(TestcaseSlot *slot) {
+  slot->state.store(slot_word(E_SLOT_READY, 0), std::memory_order_release);
+}
+
+TestcaseSlot *TestcaseSlots::acquire_read(const key_type testcase_id) {
+  TestcaseSlot &s = slot(testcase_id);
+  if (s.testcase_id.load(std::memory_order_acquire) != testcase_id)
+    return nullptr;
+
+  uint64_t word = s.state.load(std::memory_order_acquire);
+  const uint32_t state = slot_state(word);
+  if (state != E_SLOT_READY &&
+      !(state == E_SLOT_READING && is_dead(slot_owner(word))))
+    return nullptr;
+  if (!s.state.compare_exchange_strong(word,
+                                       slot_word(E_SLOT_READING, getpid()),
+                                       std::memory_order_acq_rel))
+    return nullptr;
+
+  // It could have been evicted between the check and the CAS
+  if (s.testcase_id.load(std::memory_order_acquire) != testcase_id) {
+    release(&s);
+    return nullptr;
+  }
+  return &s;
+}
+
+TestcaseSlot *TestcaseSlots::held(const key_type testcase_id) {
+  TestcaseSlot &s = slot(testcase_id);
+  if (s.state.load(std::memory_order_acquire) !=
+          slot_word(E_SLOT_READING, getpid()) ||
+      s.testcase_id.load(std::memory_order_acquire) != testcase_id)
+    return nullptr;
+  return &s;
+}
+
+void TestcaseSlots::release(TestcaseSlot *slot) {
+  slot->state.store(slot_word(E_SLOT_READY, 0), std::memory_order_release);
+}
+
+void TestcaseSlots::remove(TestcaseSlot *slot) {
+  slot->data = nullptr;
+  slot->testcase_id.store(0, std::memory_order_release);
+  slot->state.store(slot_word(E_SLOT_FREE, 0), std::memory_order_release);
+}
+
+std::string TestcaseSlots::toString() {
+  size_t count[4] = {0, 0, 0, 0};
+  for (size_t i = 0; i < TESTCASE_SLOTS; i++) {
+    count[slot_state(slots[i].state.load(std::memory_order_relaxed)) & 3]++;
+  }
+  ostringstream oss;
+  oss << "<TestcaseSlots free=" << count[E_SLOT_FREE]
+      << " writing=" << count[E_SLOT_WRITING]
+      << " ready=" << count[E_SLOT_READY]
+      << " reading=" << count[E_SLOT_READING] << ">";
+  return oss.str();
+}
+
 //
 // Container related methods
 //
 
 Container::Container(managed_shared_memory *shm, segment_manager_t *seg_mgr)
-    : shm(shm), inner_trace_alloc(seg_mgr) {
-  traces_mutex = std::unique_ptr<shared_data_mutex_t>(
-      new shared_data_mutex_t(open_or_create, SHARED_TRACES_MUTEX_NAME));
-}
+    : shm(shm), slots(shm, TRACE_SLOTS_NAME) {}
 
 Container::~Container() {
   //
@@ -82,89 +472,594 @@ Container::~Container() {
 
 void Container::add(const key_type testcase_id,
                     const element_value_type trace_element) {
-  boost::interprocess::scoped_lock<shared_data_mutex_t> lock(
-      *traces_mutex.get());
-  trace_t *trace = get_create_list(testcase_id);
-  trace->push_back(trace_element);
+  add(testcase_id, &trace_element, 1);
 }
 
 void Container::add(const key_type testcase_id,
                     const std::list<element_value_type> &received_trace) {
-  boost::interprocess::scoped_lock<shared_data_mutex_t> lock(
-      *traces_mutex.get());
-  trace_t *trace = get_create_list(testcase_id);
-  for (auto &i : received_trace) {
-    trace->push_back(i);
+  const std::vector<element_value_type> elements(received_trace.begin(),
+                                                 received_trace.end());
+  add(testcase_id, elements.data(), elements.size());
+}
+
+void Container::add(const key_type testcase_id,
+                    const element_value_type *elements, const size_t count) {
+  if (count < 1)
+    return;
+  std::vector<TraceRecord> records(count * 2);
+  size_t num_records = 0;
+  for (size_t i = 0; i < count; i++) {
+    num_records += encode_trace_record(elements[i], elements[i].thread_id,
+                                       records.data() + num_records);
+  }
+  const TraceSpan span(records.data(), num_records);
+  add(testcase_id, &span, 1);
+}
+
+void Container::add(const key_type testcase_id, const TraceSpan *spans,
+                    const size_t num_spans) {
+  size_t count = 0;
+  for (size_t i = 0; i < num_spans; i++)
+    count += spans[i].size;
+  if (count < 1)
+    return;
+  TestcaseSlot *slot = acquire_trace(testcase_id);
+  if (!slot)
+    return;
+  trace_t *trace = static_cast<trace_t *>(slot->data.get());
+  for (size_t i = 0; i < num_spans; i++)
+    append(trace, spans[i].data, spans[i].size);
+  slots.publish(slot);
+}
+
+void Container::add_compressed(const key_type testcase_id, const uint8_t *data,
+                               const size_t size,
+                               const uint32_t num_elements) {
+  if (size < 1)
+    return;
+  TestcaseSlot *slot = acquire_trace(testcase_id);
+  if (!slot)
+    return;
+  trace_t *trace = static_cast<trace_t *>(slot->data.get());
+  void *raw = shm->allocate(sizeof(TraceChunk) + size, std::nothrow);
+  if (raw) {
+    TraceChunk *chunk =
+        new (raw) TraceChunk((uint32_t)size, E_TRACE_ENCODING_COMPRESSED);
+    std::memcpy(chunk->bytes(), data, size);
+    chunk->size = (uint32_t)size;
+    chunk->num_elements = num_elements;
+    if (trace->last)
+      trace->last->next = chunk;
+    else
+      trace->first = chunk;
+    trace->last = chunk;
+    trace->num_compressed_elements += num_elements;
+    trace->num_compressed_bytes += size;
   }
+#if (NASTY_DEBUG == 1)
+  else {
+    std::cerr << "Container- SHM full, dropping " << num_elements
+              << " compressed elements" << std::endl;
+  }
+#endif
+  slots.publish(slot);
 }
 
-std::string Container::get_trace_name(const key_type testcase_id) {
-  return std::to_string(testcase_id);
+void Container::append(trace_t *trace, const TraceRecord *records,
+                       size_t count) {
+  while (count > 0) {
+    TraceChunk *chunk = trace->last.get();
+    if (!chunk || chunk->compressed() || chunk->size == chunk->capacity) {
+      size_t capacity =
+          (chunk && !chunk->compressed()) ? (size_t)chunk->capacity * 2 : count;
+      capacity = std::max(capacity, (size_t)TRACE_CHUNK_MIN_CAPACITY);
+      capacity = std::min(capacity, (size_t)TRACE_CHUNK_MAX_CAPACITY);
+
+      void *raw = shm->allocate(
+          sizeof(TraceChunk) + capacity * sizeof(TraceRecord), std::nothrow);
+      if (!raw) {
+#if (NASTY_DEBUG == 1)
+        std::cerr << "Container- SHM full, dropping " << count << " records"
+                  << std::endl;
+#endif
+        return;
+      }
+      TraceChunk *new_chunk = new (raw) TraceChunk((uint32_t)capacity);
+      if (chunk)
+        chunk->next = new_chunk;
+      else
+        trace->first = new_chunk;
+      trace->last = new_chunk;
+      chunk = new_chunk;
+    }
+
+    size_t n = std::min(count, (size_t)(chunk->capacity - chunk->size));
+    // Keep the two records of an extended element in the same chunk
+    if (n == (size_t)(chunk->capacity - chunk->size) &&
+        is_trace_record_head(records[n - 1])) {
+      if (--n == 0) {
+        chunk->capacity = chunk->size;
+        continue;
+      }
+    }
+    std::memcpy(chunk->records() + chunk->size, records,
+                n * sizeof(TraceRecord));
+    chunk->size += n;
+    trace->num_records += n;
+    records += n;
+    count -= n;
+  }
+}
+
+void Container::destroy_trace(trace_t *trace) {
+  TraceChunk *chunk = trace->first.get();
+  while (chunk) {
+    TraceChunk *next = chunk->next.get();
+    shm->deallocate(chunk);
+    chunk = next;
+  }
+  shm->destroy_ptr(trace);
 }
 
 Container::trace_t *Container::get_trace(const key_type testcase_id) {
-  boost::interprocess::scoped_lock<shared_data_mutex_t> lock(
-      *traces_mutex.get());
-  const std::string name = get_trace_name(testcase_id);
-  return shm->find<trace_t>(name.c_str()).first;
+  TestcaseSlot *slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return nullptr;
+  if (!slot->data) {
+    slots.release(slot);
+    return nullptr;
+  }
+  return static_cast<trace_t *>(slot->data.get());
+}
+
+void Container::release_trace(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (slot)
+    slots.release(slot);
 }
 
 void Container::remove_trace(const key_type testcase_id) {
-  boost::interprocess::scoped_lock<shared_data_mutex_t> lock(
-      *traces_mutex.get());
-  const std::string name = get_trace_name(testcase_id);
-  const bool success = shm->destroy<trace_t>(name.c_str());
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (!slot)
+    slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return;
+  if (slot->data)
+    destroy_trace(static_cast<trace_t *>(slot->data.get()));
+  slots.remove(slot);
 #if (NASTY_DEBUG == 1)
-  std::cout << "remove trace: " << testcase_id << " success=" << success
-            << std::endl;
+  std::cout << "remove trace: " << testcase_id << std::endl;
 #endif
 }
 
-Container::trace_t *Container::get_create_list(const key_type testcase_id) {
-  const std::string name = get_trace_name(testcase_id);
-  return shm->find_or_construct<trace_t>(name.c_str())(inner_trace_alloc);
+TestcaseSlot *Container::acquire_trace(const key_type testcase_id) {
+  void *evicted = nullptr;
+  TestcaseSlot *slot = slots.acquire_write(testcase_id, &evicted);
+  if (evicted)
+    destroy_trace(static_cast<trace_t *>(evicted));
+  if (slot && !slot->data) {
+    slot->data = shm->construct<trace_t>(anonymous_instance, std::nothrow)();
+    if (!slot->data) {
+      slots.publish(slot);
+      return nullptr;
+    }
+  }
+  return slot;
 }
 
 std::string Container::toString() {
   using namespace std;
-  return "<Container>";
+  return "<Container " + slots.toString() + ">";
+}
+
+//
+// EdgeMapContainer related methods
+//
+
+EdgeMapContainer::EdgeMapContainer(managed_shared_memory *shm)
+    : shm(shm), slots(shm, EDGE_MAP_SLOTS_NAME) {}
+
+void EdgeMapContainer::add(const key_type testcase_id, const uint8_t *raw_hits,
+                           const TraceKind status) {
+  void *evicted = nullptr;
+  TestcaseSlot *slot = slots.acquire_write(testcase_id, &evicted);
+  if (evicted)
+    shm->destroy_ptr(static_cast<edge_map_t *>(evicted));
+  if (!slot)
+    return;
+  if (!slot->data)
+    slot->data = shm->construct<edge_map_t>(anonymous_instance, std::nothrow)();
+  if (!slot->data) {
+    slots.remove(slot);
+    return;
+  }
+
+  edge_map_t *edge_map = static_cast<edge_map_t *>(slot->data.get());
+  for (size_t i = 0; i < EDGE_MAP_SIZE; i++) {
+    edge_map->hits[i] = bucket_hits(raw_hits[i]);
+  }
+  if (status != E_UNKNOWN) {
+    edge_map->status = status;
+  }
+  slots.publish(slot);
+}
+
+EdgeMapContainer::edge_map_t *
+EdgeMapContainer::get_map(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return nullptr;
+  if (!slot->data) {
+    slots.release(slot);
+    return nullptr;
+  }
+  return static_cast<edge_map_t *>(slot->data.get());
+}
+
+void EdgeMapContainer::release_map(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (slot)
+    slots.release(slot);
+}
+
+void EdgeMapContainer::remove_map(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (!slot)
+    slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return;
+  if (slot->data)
+    shm->destroy_ptr(static_cast<edge_map_t *>(slot->data.get()));
+  slots.remove(slot);
+}
+
+//
+// CmpLogContainer related methods
+//
+
+CmpLogContainer::CmpLogContainer(managed_shared_memory *shm)
+    : shm(shm), slots(shm, CMP_LOG_SLOTS_NAME) {}
+
+void CmpLogContainer::add(const key_type testcase_id,
+                          const CmpOperands *entries, const uint32_t size) {
+  void *evicted = nullptr;
+  TestcaseSlot *slot = slots.acquire_write(testcase_id, &evicted);
+  if (evicted)
+    shm->destroy_ptr(static_cast<cmp_log_t *>(evicted));
+  if (!slot)
+    return;
+  if (!slot->data)
+    slot->data = shm->construct<cmp_log_t>(anonymous_instance, std::nothrow)();
+  if (!slot->data) {
+    slots.remove(slot);
+    return;
+  }
+
+  cmp_log_t *cmp_log = static_cast<cmp_log_t *>(slot->data.get());
+  cmp_log->size = std::min(size, (uint32_t)CMP_LOG_SIZE);
+  std::memcpy(cmp_log->entries, entries,
+              cmp_log->size * sizeof(CmpOperands));
+  slots.publish(slot);
+}
+
+CmpLogContainer::cmp_log_t *
+CmpLogContainer::get_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return nullptr;
+  if (!slot->data) {
+    slots.release(slot);
+    return nullptr;
+  }
+  return static_cast<cmp_log_t *>(slot->data.get());
+}
+
+void CmpLogContainer::release_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (slot)
+    slots.release(slot);
+}
+
+void CmpLogContainer::remove_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (!slot)
+    slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return;
+  if (slot->data)
+    shm->destroy_ptr(static_cast<cmp_log_t *>(slot->data.get()));
+  slots.remove(slot);
+}
+
+//
+// TokenLogContainer related methods
+//
+
+TokenLogContainer::TokenLogContainer(managed_shared_memory *shm)
+    : shm(shm), slots(shm, TOKEN_LOG_SLOTS_NAME) {}
+
+bool TokenLogContainer::add(const key_type testcase_id, const uint8_t *data,
+                            const uint32_t size) {
+  void *evicted = nullptr;
+  TestcaseSlot *slot = slots.acquire_write(testcase_id, &evicted);
+  if (evicted)
+    shm->destroy_ptr(static_cast<token_log_t *>(evicted));
+  if (!slot)
+    return false;
+  if (!slot->data)
+    slot->data =
+        shm->construct<token_log_t>(anonymous_instance, std::nothrow)();
+  if (!slot->data) {
+    slots.remove(slot);
+    return false;
+  }
+
+  token_log_t *token_log = static_cast<token_log_t *>(slot->data.get());
+  const bool added = token_log->size < TOKEN_LOG_SIZE;
+  if (added) {
+    Token &token = token_log->entries[token_log->size++];
+    token.size = std::min(size, (uint32_t)TOKEN_MAX_SIZE);
+    std::memcpy(token.data, data, token.size);
+  }
+  slots.publish(slot);
+  return added;
+}
+
+TokenLogContainer::token_log_t *
+TokenLogContainer::get_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return nullptr;
+  if (!slot->data) {
+    slots.release(slot);
+    return nullptr;
+  }
+  return static_cast<token_log_t *>(slot->data.get());
+}
+
+void TokenLogContainer::release_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (slot)
+    slots.release(slot);
+}
+
+void TokenLogContainer::remove_log(const key_type testcase_id) {
+  TestcaseSlot *slot = slots.held(testcase_id);
+  if (!slot)
+    slot = slots.acquire_read(testcase_id);
+  if (!slot)
+    return;
+  if (slot->data)
+    shm->destroy_ptr(static_cast<token_log_t *>(slot->data.get()));
+  slots.remove(slot);
+}
+
+//
+// PersistentInputContainer
+//
+std::string PersistentInputContainer::get_input_name(const key_type pid) {
+  return "input_" + std::to_string(pid);
+}
+
+PersistentInputContainer::input_t *
+PersistentInputContainer::get_create_input(const key_type pid) {
+  const std::string name = get_input_name(pid);
+  return shm->find_or_construct<input_t>(name.c_str())();
+}
+
+PersistentInputContainer::input_t *
+PersistentInputContainer::get_input(const key_type pid) {
+  const std::string name = get_input_name(pid);
+  return shm->find<input_t>(name.c_str()).first;
+}
+
+void PersistentInputContainer::remove_input(const key_type pid) {
+  const std::string name = get_input_name(pid);
+  shm->destroy<input_t>(name.c_str());
+}
+
+//
+// PendingTraceContainer related methods
+//
+
+std::string PendingTraceContainer::get_pending_name(const key_type pid) {
+  return "pending_" + std::to_string(pid);
+}
+
+PendingTraceContainer::pending_t *
+PendingTraceContainer::create_pending(const key_type pid,
+                                      const uint64_t testcase_id,
+                                      Container *container,
+                                      EdgeMapContainer *edge_maps) {
+  const std::string name = get_pending_name(pid);
+  if (pending_t *leftover = shm->find<pending_t>(name.c_str()).first) {
+    // Its process is dead since we have its pid. The fuzzer won't salvage it
+    // anymore: it now finds our testcase_id in the pending trace.
+    if (container)
+      move_records(leftover, container, edge_maps);
+    remove_pending(pid);
+  }
+  return shm->construct<pending_t>(name.c_str(), std::nothrow)(testcase_id);
+}
+
+PendingRing *PendingTraceContainer::create_ring(pending_t *pending,
+                                                const uint32_t index) {
+  if (index >= PENDING_MAX_RINGS)
+    return nullptr;
+  PendingRing *ring =
+      shm->construct<PendingRing>(anonymous_instance, std::nothrow)();
+  if (ring)
+    pending->rings[index] = ring;
+  return ring;
+}
+
+uint8_t *PendingTraceContainer::create_edge_hits(pending_t *pending) {
+  void *raw = shm->allocate(EDGE_MAP_SIZE, std::nothrow);
+  if (!raw)
+    return nullptr;
+  std::memset(raw, 0, EDGE_MAP_SIZE);
+  pending->edge_hits = static_cast<uint8_t *>(raw);
+  return pending->edge_hits.get();
+}
+
+bool PendingTraceContainer::salvage(const key_type pid,
+                                    const uint64_t testcase_id,
+                                    Container *container,
+                                    EdgeMapContainer *edge_maps) {
+  const std::string name = get_pending_name(pid);
+  pending_t *pending = shm->find<pending_t>(name.c_str()).first;
+  // Moved by a new process with the same pid, or a persistent target that
+  // went on with the next testcase
+  if (!pending || pending->testcase_id.load() != testcase_id)
+    return true;
+
+  const bool dead = is_dead(pid);
+  if (!dead && pending->status.load() != E_TERMINATED)
+    return false;
+  if (dead) {
+    if (container)
+      move_records(pending, container, edge_maps);
+    remove_pending(pid);
+  }
+  return true;
+}
+
+void PendingTraceContainer::move_records(pending_t *pending,
+                                         Container *container,
+                                         EdgeMapContainer *edge_maps) {
+  const TraceKind status = (TraceKind)pending->status.load();
+  const uint64_t testcase_id = pending->testcase_id.load();
+  if (status == E_TERMINATED)
+    return;
+
+  bool has_rings = false;
+  for (size_t i = 0; i < PENDING_MAX_RINGS; i++) {
+    PendingRing *ring = pending->rings[i].get();
+    if (!ring)
+      continue;
+    has_rings = true;
+    const uint64_t head = ring->head.load();
+    const uint64_t tail =
+        std::max(ring->tail.load(),
+                 head - std::min<uint64_t>(head, PENDING_RING_CAPACITY));
+    const size_t count = head - tail;
+    if (!count)
+      continue;
+    const size_t first = tail & (PENDING_RING_CAPACITY - 1);
+    const size_t first_count =
+        std::min(count, (size_t)PENDING_RING_CAPACITY - first);
+    const TraceSpan spans[2] = {
+        TraceSpan(ring->records + first, first_count),
+        TraceSpan(ring->records, count - first_count)};
+    container->add(testcase_id, spans, 2);
+  }
+  if (has_rings && (status == E_CRASHED || status == E_TIMEDOUT))
+    container->add(testcase_id, TraceElement(status));
+  if (pending->edge_hits)
+    edge_maps->add(testcase_id, pending->edge_hits.get(), status);
+#if (NASTY_DEBUG == 1)
+  std::cout << "salvaged the pending trace of testcase " << testcase_id
+            << ": " << traceKindName(status) << std::endl;
+#endif
+}
+
+void PendingTraceContainer::remove_pending(const key_type pid) {
+  const std::string name = get_pending_name(pid);
+  pending_t *pending = shm->find<pending_t>(name.c_str()).first;
+  if (!pending)
+    return;
+  for (size_t i = 0; i < PENDING_MAX_RINGS; i++) {
+    if (pending->rings[i])
+      shm->destroy_ptr(pending->rings[i].get());
+  }
+  if (pending->edge_hits)
+    shm->deallocate(pending->edge_hits.get());
+  shm->destroy_ptr(pending);
 }
 
 //
 // Runtime client and Fuzzer client to the shared memory
 //
+// The fuzzer creates the SHM before launching the SUT, so attaching to it
+// normally succeeds on the first attempt. Otherwise, back off (1ms, 2ms, ...)
+// and after SHM_ATTACH_TIMEOUT_MS, create it. Note that `open_only` already
+// waits for the creator to be done with the initialization of the segment.
+// After SHM_ATTACH_GIVE_UP_MS, or if the containers can't be built, `segment`
+// and the containers stay null rather than hang the SUT.
 void SHMRuntimeWriter::create_shm() {
-  bool not_exists = true;
-  // This is a pretty ghetto way to know the shared memory has been prepared.
-  // Shouldn't be necessary now that the client can also create the shared
-  // memory, still here for now.
-  bool open_only_flag = true;
-  unsigned int iterations = 0;
-  while (not_exists) {
-    sleep(1);
-    ++iterations;
-    try_create_shm();
-    not_exists = !segment;
+  unsigned int backoff_ms = 1;
+  unsigned int waited_ms = 0;
+  while (!try_open_shm()) {
+    if (waited_ms >= SHM_ATTACH_GIVE_UP_MS) {
+#if (NASTY_DEBUG == 1)
+      std::cerr << "SHMRuntimeWriter- no SHM after " << waited_ms
+                << "ms, nothing will be recorded" << std::endl;
+#endif
+      return;
+    }
+    if (waited_ms >= SHM_ATTACH_TIMEOUT_MS) {
+      try_create_shm();
+      if (segment)
+        break;
+    }
+    usleep(backoff_ms * 1000);
+    waited_ms += backoff_ms;
+    backoff_ms = std::min(backoff_ms * 2, SHM_ATTACH_MAX_BACKOFF_MS);
   }
 
   try {
     if (segment) {
       container = new Container(segment, segment->get_segment_manager());
+      edge_maps = new EdgeMapContainer(segment);
+      cmp_logs = new CmpLogContainer(segment);
+      token_logs = new TokenLogContainer(segment);
+      inputs = new PersistentInputContainer(segment);
+      pending = new PendingTraceContainer(segment);
     }
   } catch (const std::exception &ex) {
 #if (NASTY_DEBUG == 1)
     std::cerr << "Exception- " << ex.what() << std::endl;
 #endif
-    if (segment)
-      delete segment;
     if (container)
       delete container;
+    if (edge_maps)
+      delete edge_maps;
+    if (cmp_logs)
+      delete cmp_logs;
+    if (token_logs)
+      delete token_logs;
+    if (inputs)
+      delete inputs;
+    if (pending)
+      delete pending;
+    if (segment)
+      delete segment;
     segment = nullptr;
     container = nullptr;
-    create_shm();
+    edge_maps = nullptr;
+    cmp_logs = nullptr;
+    token_logs = nullptr;
+    inputs = nullptr;
+    pending = nullptr;
   }
 }
 
+bool SHMRuntimeWriter::try_open_shm() {
+  if (segment)
+    return true;
+
+  try {
+    segment = new managed_shared_memory(
+        open_only, SHMConfig::current().segment_name.c_str());
+  } catch (const std::exception &ex) {
+#if (NASTY_DEBUG == 1)
+    std::cerr << "Exception- " << ex.what() << std::endl;
+#endif
+    segment = nullptr;
+  }
+  return segment != nullptr;
+}
+
 void SHMRuntimeWriter::try_create_shm() {
   if (segment)
     return;
@@ -173,9 +1068,30 @@ void SHMRuntimeWriter::try_create_shm() {
     delete container;
     container = nullptr;
   }
+  if (edge_maps) {
+    delete edge_maps;
+    edge_maps = nullptr;
+  }
+  if (cmp_logs) {
+    delete cmp_logs;
+    cmp_logs = nullptr;
+  }
+  if (token_logs) {
+    delete token_logs;
+    token_logs = nullptr;
+  }
+  if (inputs) {
+    delete inputs;
+    inputs = nullptr;
+  }
+  if (pending) {
+    delete pending;
+    pending = nullptr;
+  }
+  const SHMConfig &config = SHMConfig::current();
   try {
     segment = new managed_shared_memory(
-        open_or_create, SHARED_MEMORY_NAME.c_str(), SHARED_MEMORY_SIZE);
+        open_or_create, config.segment_name.c_str(), config.segment_size);
   } catch (std::exception &ex) {
 #if (NASTY_DEBUG == 1)
     std::cerr << "Exception- " << ex.what() << std::endl;
@@ -188,7 +1104,8 @@ void SHMRuntimeWriter::try_create_shm() {
 bool SHMRuntimeWriter::exists(bool open_only_flag) {
   managed_shared_memory *s = nullptr;
   try {
-    s = new managed_shared_memory(open_only, SHARED_MEMORY_NAME.c_str());
+    s = new managed_shared_memory(open_only,
+                                  SHMConfig::current().segment_name.c_str());
     bool value = s->check_sanity();
     if (s)
       delete s;
@@ -206,18 +1123,19 @@ bool SHMRuntimeWriter::exists(bool open_only_flag) {
 
 SHMFuzzerHandler::SHMFuzzerHandler(bool cleanup, bool remove_mutexes)
     : cleanup(cleanup) {
+  const SHMConfig &config = SHMConfig::current();
   if (remove_mutexes) {
-    named_mutex::remove(SHARED_TRACES_MUTEX_NAME);
+    named_mutex::remove(config.mutex_name.c_str());
   }
 
   if (cleanup) {
 #if (NASTY_DEBUG == 1)
     std::cout << "SHMFuzzerHandler- cleaning existing SHM data" << std::endl;
 #endif
-    shared_memory_object::remove(SHARED_MEMORY_NAME.c_str());
+    shared_memory_object::remove(config.segment_name.c_str());
   }
   segment = new managed_shared_memory(
-      open_or_create, SHARED_MEMORY_NAME.c_str(), SHARED_MEMORY_SIZE);
+      open_or_create, config.segment_name.c_str(), config.segment_size);
   bool value = segment->check_sanity();
   if (!value) {
 #if (NASTY_DEBUG == 1)
@@ -225,44 +1143,49 @@ SHMFuzzerHandler::SHMFuzzerHandler(bool cleanup, bool remove_mutexes)
 #endif
   }
   container = new Container(segment, segment->get_segment_manager());
+  edge_maps = new EdgeMapContainer(segment);
+  cmp_logs = new CmpLogContainer(segment);
+  token_logs = new TokenLogContainer(segment);
+  inputs = new PersistentInputContainer(segment);
+  pending = new PendingTraceContainer(segment);
 }
 
-size_t SHMFuzzerHandler::red_free_size() {
-  const size_t current_size = segment->get_size();
-  const size_t free_size = segment->get_free_memory();
-  return free_size < (current_size >> 2);
+bool SHMFuzzerHandler::red_free_size() {
+  return segment->get_free_memory() < (segment->get_size() >> 2);
 }
 
 void SHMFuzzerHandler::force_remove_mutexes() {
-  named_mutex::remove(SHARED_TRACES_MUTEX_NAME);
-}
-
-// Less than 25% free, we grow
-void SHMFuzzerHandler::update_size() {
-#if (NASTY_DEBUG == 1)
-  std::cout << "grow size of segment, current size=" << current_size
-            << std::endl;
-#endif
-  delete segment;
-  delete container;
-  named_mutex::remove(SHARED_TRACES_MUTEX_NAME);
-  managed_shared_memory::grow(SHARED_MEMORY_NAME.c_str(), SHARED_MEMORY_SIZE);
-
-  segment = new managed_shared_memory(open_only, SHARED_MEMORY_NAME.c_str());
-  container = new Container(segment, segment->get_segment_manager());
+  named_mutex::remove(SHMConfig::current().mutex_name.c_str());
 }
 
 bool SHMFuzzerHandler::is_sane() { return segment && segment->check_sanity(); }
 
 size_t SHMFuzzerHandler::free_size() { return segment->get_free_memory(); }
 
+size_t SHMFuzzerHandler::size() { return segment->get_size(); }
+
 SHMFuzzerHandler::~SHMFuzzerHandler() {
   if (cleanup) {
-    shared_memory_object::remove(SHARED_MEMORY_NAME.c_str());
+    shared_memory_object::remove(SHMConfig::current().segment_name.c_str());
   }
   if (container) {
     delete container;
   }
+  if (edge_maps) {
+    delete edge_maps;
+  }
+  if (cmp_logs) {
+    delete cmp_logs;
+  }
+  if (token_logs) {
+    delete token_logs;
+  }
+  if (inputs) {
+    delete inputs;
+  }
+  if (pending) {
+    delete pending;
+  }
   if (segment) {
     delete segment;
   }
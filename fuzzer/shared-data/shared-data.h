@@ -1,13 +1,18 @@
 #ifndef SHARED_DATA_H
 #define SHARED_DATA_H
 
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <iterator>
 #include <list>
 #include <map>
 #include <memory>
 #include <string>
 
+#include "shared-data/edge-map.h"
+
 // Comment out to use the direct object shared memory
 //#define USE_FILE_BACKED_MEMORY
 //
@@ -22,6 +27,7 @@
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/containers/list.hpp>
 #include <boost/interprocess/containers/map.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
 
 #include <boost/interprocess/sync/interprocess_mutex.hpp>
 #include <boost/interprocess/sync/interprocess_upgradable_mutex.hpp>
@@ -49,6 +55,70 @@ enum TraceKind {
 
 const char *traceKindName(const TraceKind kind);
 
+// How the runtime shares the trace of a testcase with the fuzzer:
+//  - E_TRACE_MODE_LIST: the full ordered list of `TraceElement`
+//  - E_TRACE_MODE_EDGE_MAP: a fixed-size map of edge index -> bucketed hit
+//                           count (AFL-style), whatever the trace length
+enum TraceMode { E_TRACE_MODE_LIST = 0, E_TRACE_MODE_EDGE_MAP = 1 };
+
+const char *traceModeName(const TraceMode mode);
+TraceMode traceModeFromName(const std::string &name);
+
+// When set to a number of milliseconds, the runtime streams the trace to the
+// SHM from a background thread with this period, instead of only when a
+// thread buffer is full and at exit
+#define ENV_FLUSH_INTERVAL_MS "COVERAGE_FUZZING_FLUSH_INTERVAL_MS"
+
+// Classify a raw hit count in buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127,
+// 128+), each bucket being a single bit so novelty is a simple mask.
+inline uint8_t bucket_hits(const uint8_t hits) {
+  if (hits == 0)
+    return 0;
+  if (hits < 4)
+    return (uint8_t)(1 << (hits - 1)); // 1, 2, 4
+  if (hits < 8)
+    return 8;
+  if (hits < 16)
+    return 16;
+  if (hits < 32)
+    return 32;
+  if (hits < 128)
+    return 64;
+  return 128;
+}
+
+// When set to 1 in E_TRACE_MODE_LIST, the runtime counts the hits of each
+// branch edge (by `edge_index`) and only records a traversal when it makes
+// the edge enter a new bucket, so a loop costs at most 8 elements per edge.
+// Edges colliding in the map share their counter, as in the edge maps.
+#define ENV_HIT_BUCKETS "COVERAGE_FUZZING_HIT_BUCKETS"
+
+// The bucket of an edge recorded `step` times (>= 1) in a trace with
+// ENV_HIT_BUCKETS
+inline uint8_t bucket_of_step(const uint32_t step) {
+  return step >= 8 ? 128 : (uint8_t)(1 << (step - 1));
+}
+
+// When set to n > 0, edges are also told apart by their calling context:
+// the hash of the n innermost callers of their function, XORed into their
+// edge index. The runtime tracks it from the function boundaries of each
+// thread for the edge maps and ENV_HIT_BUCKETS, and the fuzzer from the same
+// boundaries in the list traces.
+#define ENV_CONTEXT_DEPTH "COVERAGE_FUZZING_CONTEXT_DEPTH"
+#define CONTEXT_MAX_DEPTH 16
+
+// Calling context of the current function of a call stack (its last entry),
+// up to `depth` callers
+inline uint32_t context_hash(const uint32_t *stack, const size_t size,
+                             const uint32_t depth) {
+  uint32_t h = 0;
+  for (size_t j = 1; j <= depth && j < size; j++) {
+    const uint32_t f = (stack[size - 1 - j] + (uint32_t)j) * 0x85EBCA77u;
+    h ^= f ^ (f >> 15);
+  }
+  return h & (EDGE_MAP_SIZE - 1);
+}
+
 // This is the object that captures the runtime information that's
 // coming from the SUT into the shared memory. This represents a simple
 // program point, so it is unique. That allows us to limit the
@@ -87,41 +157,512 @@ struct TraceElement {
 
 bool operator==(const TraceElement &a, const TraceElement &b);
 
+// The packed form of a `TraceElement`, as stored in the SHM: 8 bytes instead
+// of 32. The thread id is replaced by a small thread index. The block ids are
+// the internal ids of the CFG of their function, small enough to be kept as
+// they are:
+//
+//   bits  0-3   kind (TRACE_RECORD_UNKNOWN for E_UNKNOWN)
+//   bits  4-13  thread index
+//   bits 14-39  func_id
+//   bits 40-51  pred_block_id
+//   bits 52-63  cur_block_id
+//
+// An element that doesn't fit takes two records: a TRACE_RECORD_EXT_HEAD with
+// the kind, thread index and the full func_id, followed by a
+// TRACE_RECORD_EXT_TAIL with the block ids on 30 bits each.
+typedef uint64_t TraceRecord;
+
+#define TRACE_RECORD_EXT_TAIL 0xD
+#define TRACE_RECORD_UNKNOWN 0xE
+#define TRACE_RECORD_EXT_HEAD 0xF
+
+#define TRACE_RECORD_THREAD_BITS 10
+#define TRACE_RECORD_FUNC_BITS 26
+#define TRACE_RECORD_BLOCK_BITS 12
+#define TRACE_RECORD_EXT_BLOCK_BITS 30
+
+#define TRACE_RECORD_MAX_THREAD ((1u << TRACE_RECORD_THREAD_BITS) - 1)
+
+inline bool is_trace_record_head(const TraceRecord record) {
+  return (record & 0xf) == TRACE_RECORD_EXT_HEAD;
+}
+
+// Encode `e`, with `thread_index` (saturated at TRACE_RECORD_MAX_THREAD) in
+// place of its thread id. Returns the number of records written in `out`.
+inline size_t encode_trace_record(const TraceElement &e,
+                                  const uint32_t thread_index,
+                                  TraceRecord out[2]) {
+  const uint64_t kind =
+      (e.kind < TRACE_RECORD_EXT_TAIL) ? e.kind : TRACE_RECORD_UNKNOWN;
+  const uint64_t thread = thread_index < TRACE_RECORD_MAX_THREAD
+                              ? thread_index
+                              : TRACE_RECORD_MAX_THREAD;
+  const bool fits = e.func_id < (1u << TRACE_RECORD_FUNC_BITS) &&
+                    e.pred_block_id < (1u << TRACE_RECORD_BLOCK_BITS) &&
+                    e.cur_block_id < (1u << TRACE_RECORD_BLOCK_BITS);
+
+  if (fits) {
+    out[0] = kind | (thread << 4) | ((uint64_t)e.func_id << 14) |
+             ((uint64_t)e.pred_block_id << 40) |
+             ((uint64_t)e.cur_block_id << 52);
+    return 1;
+  }
+
+  const uint64_t block_mask = (1u << TRACE_RECORD_EXT_BLOCK_BITS) - 1;
+  out[0] = TRACE_RECORD_EXT_HEAD | (kind << 4) | (thread << 8) |
+           ((uint64_t)e.func_id << 32);
+  out[1] = TRACE_RECORD_EXT_TAIL | ((e.pred_block_id & block_mask) << 4) |
+           ((e.cur_block_id & block_mask) << 34);
+  return 2;
+}
+
+// Decode the element starting at `records[0]`, out of `available` records.
+// Returns the number of records consumed, 0 if the element is truncated.
+inline size_t decode_trace_record(const TraceRecord *records,
+                                  const size_t available, TraceElement &e) {
+  if (available < 1)
+    return 0;
+  const TraceRecord r = records[0];
+  const uint32_t thread_mask = TRACE_RECORD_MAX_THREAD;
+
+  if (is_trace_record_head(r)) {
+    if (available < 2)
+      return 0;
+    const TraceRecord tail = records[1];
+    const uint64_t block_mask = (1u << TRACE_RECORD_EXT_BLOCK_BITS) - 1;
+    const uint32_t kind = (r >> 4) & 0xf;
+    e.kind = kind == TRACE_RECORD_UNKNOWN ? E_UNKNOWN : (TraceKind)kind;
+    e.thread_id = (r >> 8) & thread_mask;
+    e.func_id = (uint32_t)(r >> 32);
+    e.pred_block_id = (uint32_t)((tail >> 4) & block_mask);
+    e.cur_block_id = (uint32_t)((tail >> 34) & block_mask);
+    return 2;
+  }
+
+  const uint32_t kind = r & 0xf;
+  const uint32_t block_mask = (1u << TRACE_RECORD_BLOCK_BITS) - 1;
+  e.kind = kind == TRACE_RECORD_UNKNOWN ? E_UNKNOWN : (TraceKind)kind;
+  e.thread_id = (r >> 4) & thread_mask;
+  e.func_id = (uint32_t)((r >> 14) & ((1u << TRACE_RECORD_FUNC_BITS) - 1));
+  e.pred_block_id = (r >> 40) & block_mask;
+  e.cur_block_id = (r >> 52) & block_mask;
+  return 1;
+}
+
+// Optional compressed form of the trace (ENV_TRACE_COMPRESSION), written by
+// the runtime when it flushes and decoded by the fuzzer while it reads the
+// trace. Each element is a tag byte, followed by the LEB128 varints of what
+// can't be deduced from the previous element:
+//
+//   tag bits 0-3  kind (as in `TraceRecord`), or TRACE_COMPRESSION_REPEAT
+//   tag bit  4    the thread index follows, else it's the previous one
+//   tag bit  5    the zigzag delta to the previous func_id follows, else it's
+//                 the previous func_id
+//   tag bit  6    the element has no block (pred and cur block ids are 0)
+//   tag bit  7    the zigzag delta of pred_block_id to the previous
+//                 cur_block_id follows, else it's the previous cur_block_id
+//
+// and then, for an element with blocks, the zigzag delta of cur_block_id to
+// pred_block_id. Loops are run-length coded: TRACE_COMPRESSION_REPEAT is
+// followed by a period p and a length n, and stands for the next n elements
+// being a copy of the elements p positions before them. A compressed chunk
+// is self-contained: its first element is relative to a zeroed element.
+#define ENV_TRACE_COMPRESSION "COVERAGE_FUZZING_TRACE_COMPRESSION"
+
+#define TRACE_COMPRESSION_REPEAT 0xF
+
+// Longest loop body detected, must be a power of 2
+#define TRACE_COMPRESSION_WINDOW 16
+
+// Shortest run coded as a repeat, shorter ones are written element by element
+#define TRACE_COMPRESSION_MIN_RUN 4
+
+// Worst case size of one element
+#define TRACE_COMPRESSION_MAX_ELEMENT_BYTES 32
+
+// Entries of the table used to find the last occurrence of an element, must be
+// a power of 2
+#define TRACE_COMPRESSION_HASH_SIZE 256
+
+// Streaming encoder writing into a fixed buffer. The caller moves the
+// compressed bytes away when `add` refuses an element, and starts again with
+// `reset`.
+struct TraceCompressor {
+  uint8_t *out = nullptr;
+  size_t capacity = 0;
+  size_t size = 0;
+  uint32_t num_elements = 0;
+
+  TraceCompressor(uint8_t *out, const size_t capacity)
+      : out(out), capacity(capacity) {
+    reset();
+  }
+
+  // Returns false when the buffer is full: `e` isn't added, the pending run is
+  // written and the buffer must be emptied.
+  bool add(const TraceElement &e);
+
+  // Write the pending run, if any
+  void finish();
+
+  void reset();
+
+private:
+  inline const TraceElement &history_at(const uint64_t position) const {
+    return history[position & (TRACE_COMPRESSION_WINDOW - 1)];
+  }
+
+  static uint32_t hash_element(const TraceElement &e);
+  void write_element(const TraceElement &e, const TraceElement &previous);
+  void write_varint(uint64_t value);
+
+  TraceElement history[TRACE_COMPRESSION_WINDOW];
+  uint64_t position = 0; // number of elements seen since `reset`
+  // Position + 1 of the last element with a given hash
+  uint64_t last_seen[TRACE_COMPRESSION_HASH_SIZE];
+  uint32_t run_period = 0;
+  uint32_t run_length = 0;
+};
+
+// Streaming decoder of a compressed chunk. Corrupted data ends the chunk.
+struct CompressedTraceReader {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  size_t offset = 0;
+
+  CompressedTraceReader() = default;
+  CompressedTraceReader(const uint8_t *data, const size_t size)
+      : data(data), size(size) {}
+
+  // Returns false at the end of the chunk
+  bool next(TraceElement &e);
+
+private:
+  inline const TraceElement &history_at(const uint64_t position) const {
+    return history[position & (TRACE_COMPRESSION_WINDOW - 1)];
+  }
+
+  bool read_varint(uint64_t &value);
+
+  TraceElement history[TRACE_COMPRESSION_WINDOW];
+  uint64_t position = 0;
+  uint32_t run_period = 0;
+  uint64_t run_left = 0;
+};
+
 //
 // Interprocess code
 //
 
 typedef ipc::managed_shared_memory::segment_manager segment_manager_t;
 
+#define ENV_CAMPAIGN_ID "COVERAGE_FUZZING_CAMPAIGN_ID"
+#define ENV_SHM_SIZE_MB "COVERAGE_FUZZING_SHM_SIZE_MB"
+
+#define DEFAULT_SHM_SIZE_MB 500
+
+// Names and size of the SHM of a fuzzing campaign. Campaigns with different
+// ids use different segments, so several fuzzers can share a host. The
+// fuzzer passes its campaign to the SUT with ENV_CAMPAIGN_ID and
+// ENV_SHM_SIZE_MB. Without campaign id, the historical names are used.
+struct SHMConfig {
+  std::string campaign_id;
+  std::string segment_name;
+  std::string mutex_name;
+  std::size_t segment_size = 0;
+
+  // Characters of `campaign_id` other than [A-Za-z0-9_-] are replaced
+  SHMConfig(const std::string &campaign_id = "",
+            const std::size_t segment_size_mb = DEFAULT_SHM_SIZE_MB);
+
+  // The configuration of the current process, read from the environment the
+  // first time it's needed
+  static const SHMConfig &current();
+};
+
+// Number of testcase slots preallocated in the SHM. A testcase always uses the
+// slot `testcase_id % TESTCASE_SLOTS`, so this bounds the number of testcases
+// whose data can wait for the fuzzer at the same time.
+#define TESTCASE_SLOTS 16384
+
+enum SlotState {
+  E_SLOT_FREE = 0,
+  E_SLOT_WRITING = 1,
+  E_SLOT_READY = 2,
+  E_SLOT_READING = 3
+};
+
+// An entry of the slot table. `state` holds the `SlotState` in its low 32 bits
+// and the pid of the process holding the slot in its high 32 bits, so both
+// are claimed with a single CAS. The process that moved it to E_SLOT_WRITING
+// or E_SLOT_READING has exclusive access to `testcase_id` and `data` until it
+// gives it back.
+struct TestcaseSlot {
+  std::atomic<uint64_t> state;
+  std::atomic<uint64_t> testcase_id;
+  ipc::offset_ptr<void> data;
+
+  TestcaseSlot() : state(E_SLOT_FREE), testcase_id(0), data(nullptr) {}
+  TestcaseSlot(const TestcaseSlot &) = delete;
+  TestcaseSlot &operator=(const TestcaseSlot &) = delete;
+};
+
+// A table of `TESTCASE_SLOTS` slots living in the SHM, shared by all the
+// processes without any interprocess lock:
+//  - a writer (the runtime) moves the slot of its testcase from FREE or READY
+//    to WRITING, appends its data and publishes it back as READY. The READY
+//    data of another testcase is evicted.
+//  - a reader (the fuzzer) moves it from READY to READING while it processes
+//    the data, then back to READY (`release`) or to FREE (`remove`).
+// When the slot is held by another process, a writer waits a bit and gives up.
+// A slot held by a process that died (e.g. a SUT that crashed in the middle of
+// a flush) is taken over, so it can't block the campaign.
+struct TestcaseSlots {
+  typedef unsigned long key_type; // testcase id
+
+  TestcaseSlot *slots = nullptr;
+
+  TestcaseSlots() = delete;
+  TestcaseSlots(const TestcaseSlots &) = delete;
+  TestcaseSlots &operator=(const TestcaseSlots &) = delete;
+
+  // The table is constructed once by the first process that asks for it
+  TestcaseSlots(ipc::managed_shared_memory *shm, const char *name);
+
+  inline TestcaseSlot &slot(const key_type testcase_id) {
+    return slots[testcase_id % TESTCASE_SLOTS];
+  }
+
+  // Claim the slot for writing. Returns nullptr if it's busy with another
+  // testcase. If the data of another testcase had to be evicted, it's
+  // detached from the slot and returned in `evicted` for the caller to
+  // destroy.
+  TestcaseSlot *acquire_write(const key_type testcase_id, void **evicted);
+
+  void publish(TestcaseSlot *slot);
+
+  // Claim the slot for reading. Returns nullptr if there's no published data
+  // for this testcase.
+  TestcaseSlot *acquire_read(const key_type testcase_id);
+
+  // The slot of the testcase if it's held for reading by this process
+  TestcaseSlot *held(const key_type testcase_id);
+
+  void release(TestcaseSlot *slot);
+
+  // The data must have been destroyed by the caller
+  void remove(TestcaseSlot *slot);
+
+  std::string toString();
+};
+
+// Chunks of records of a trace double in size, from the first flush of the
+// runtime up to TRACE_CHUNK_MAX_CAPACITY records
+#define TRACE_CHUNK_MIN_CAPACITY 256
+#define TRACE_CHUNK_MAX_CAPACITY 65536
+
+enum TraceEncoding {
+  E_TRACE_ENCODING_RECORDS = 0,
+  E_TRACE_ENCODING_COMPRESSED = 1
+};
+
+// A contiguous, read-only run of trace records
+struct TraceSpan {
+  const TraceRecord *data = nullptr;
+  size_t size = 0;
+
+  TraceSpan() = default;
+  TraceSpan(const TraceRecord *data, const size_t size)
+      : data(data), size(size) {}
+
+  inline const TraceRecord *begin() const { return data; }
+  inline const TraceRecord *end() const { return data + size; }
+  inline const TraceRecord &operator[](const size_t i) const {
+    return data[i];
+  }
+};
+
+// A chunk of a trace: its header is directly followed by `capacity` records,
+// of which the first `size` are set. The two records of an extended element
+// are always in the same chunk. A compressed chunk holds `size` bytes of
+// compressed elements instead, see `TraceCompressor`.
+struct TraceChunk {
+  ipc::offset_ptr<TraceChunk> next;
+  uint32_t size = 0;
+  uint32_t capacity = 0;
+  uint32_t encoding = E_TRACE_ENCODING_RECORDS;
+  uint32_t num_elements = 0; // only kept for compressed chunks
+
+  TraceChunk(const uint32_t capacity,
+             const TraceEncoding encoding = E_TRACE_ENCODING_RECORDS)
+      : next(nullptr), capacity(capacity), encoding(encoding) {}
+  TraceChunk(const TraceChunk &) = delete;
+  TraceChunk &operator=(const TraceChunk &) = delete;
+
+  inline bool compressed() const {
+    return encoding == E_TRACE_ENCODING_COMPRESSED;
+  }
+
+  inline TraceRecord *records() {
+    return reinterpret_cast<TraceRecord *>(this + 1);
+  }
+  inline const TraceRecord *records() const {
+    return reinterpret_cast<const TraceRecord *>(this + 1);
+  }
+  inline uint8_t *bytes() { return reinterpret_cast<uint8_t *>(this + 1); }
+  inline const uint8_t *bytes() const {
+    return reinterpret_cast<const uint8_t *>(this + 1);
+  }
+  inline TraceSpan span() const { return TraceSpan(records(), size); }
+};
+
+// The trace of a testcase in the SHM: a list of chunks of contiguous
+// records, so the fuzzer scans it span by span instead of chasing a pointer
+// per element. Chunks are only appended by the writer holding the slot of the
+// testcase, and are never empty.
+struct ChunkedTrace {
+  ipc::offset_ptr<TraceChunk> first;
+  ipc::offset_ptr<TraceChunk> last;
+  uint64_t num_records = 0;
+  uint64_t num_compressed_elements = 0;
+  uint64_t num_compressed_bytes = 0;
+
+  ChunkedTrace() : first(nullptr), last(nullptr) {}
+  ChunkedTrace(const ChunkedTrace &) = delete;
+  ChunkedTrace &operator=(const ChunkedTrace &) = delete;
+
+  // In records plus compressed elements, which is a bit more than the number
+  // of elements
+  inline size_t size() const {
+    return num_records + num_compressed_elements;
+  }
+  inline bool empty() const { return size() == 0; }
+
+  // Size of the trace in the SHM, chunk headers excluded
+  inline size_t num_bytes() const {
+    return num_records * sizeof(TraceRecord) + num_compressed_bytes;
+  }
+
+  // Call `f(const TraceSpan &)` for each chunk of records, in order. The
+  // compressed chunks are skipped.
+  template <typename F> void for_each_span(F f) const {
+    for (const TraceChunk *chunk = first.get(); chunk;
+         chunk = chunk->next.get()) {
+      if (!chunk->compressed())
+        f(chunk->span());
+    }
+  }
+
+  // Call `f(const TraceElement &)` for each decoded element, in order
+  template <typename F> void for_each_element(F f) const {
+    TraceElement element;
+    for (const TraceChunk *chunk = first.get(); chunk;
+         chunk = chunk->next.get()) {
+      if (chunk->compressed()) {
+        CompressedTraceReader reader(chunk->bytes(), chunk->size);
+        while (reader.next(element))
+          f(element);
+        continue;
+      }
+      const TraceRecord *records = chunk->records();
+      size_t i = 0;
+      while (size_t length =
+                 decode_trace_record(records + i, chunk->size - i, element)) {
+        f(element);
+        i += length;
+      }
+    }
+  }
+
+  // Element by element iteration, for the code that doesn't care
+  struct const_iterator {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef TraceElement value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const TraceElement *pointer;
+    typedef const TraceElement &reference;
+
+    const TraceChunk *chunk = nullptr;
+    uint32_t index = 0; // record, or element of a compressed chunk
+    uint32_t length = 0;
+    TraceElement element;
+    CompressedTraceReader reader;
+
+    const_iterator() = default;
+    const_iterator(const TraceChunk *chunk) { enter(chunk); }
+
+    inline reference operator*() const { return element; }
+    inline pointer operator->() const { return &element; }
+
+    inline const_iterator &operator++() {
+      index += length;
+      load();
+      return *this;
+    }
+    inline const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    inline bool operator==(const const_iterator &o) const {
+      return chunk == o.chunk && index == o.index;
+    }
+    inline bool operator!=(const const_iterator &o) const {
+      return !(*this == o);
+    }
+
+  private:
+    inline void enter(const TraceChunk *next_chunk) {
+      chunk = next_chunk;
+      index = 0;
+      if (!chunk)
+        return;
+      if (chunk->compressed())
+        reader = CompressedTraceReader(chunk->bytes(), chunk->size);
+      load();
+    }
+
+    // Decode the element at `index`, or move to the next chunk. A truncated
+    // element can only be the last one of its chunk.
+    inline void load() {
+      if (chunk->compressed()) {
+        length = reader.next(element) ? 1 : 0;
+      } else {
+        length = (uint32_t)decode_trace_record(chunk->records() + index,
+                                               chunk->size - index, element);
+      }
+      if (!length)
+        enter(chunk->next.get());
+    }
+  };
+
+  inline const_iterator begin() const { return const_iterator(first.get()); }
+  inline const_iterator end() const { return const_iterator(); }
+};
+
 // The container represents the structure in shared memory. The runtime writes
 // to it and the fuzzer reads from it (for now). The data that's captured is
 // the following:
-//  - `statuses`: the association of a testcase id and an `ExecutionStatus`
-//  - `trace_\d+`: an std::list of `TraceElement` used as a stack.
-//                 This is essentially the raw data from the runtime.
+//  - `slots`: the slot of each testcase, see `TestcaseSlots`
+//  - the trace of each testcase: a `ChunkedTrace` of `TraceElement`,
+//    referenced by its slot. This is essentially the raw data from the
+//    runtime.
 struct Container {
-  typedef ipc::interprocess_upgradable_mutex upgradable_mutex_type;
-  typedef ipc::named_mutex named_mutex;
-  typedef named_mutex shared_data_mutex_t;
-
   typedef unsigned long key_type; // testcase id
 
   typedef TraceElement element_value_type;
 
-  // Definition of a list of `element_value_type` living in the SHM
-  typedef ipc::allocator<element_value_type, segment_manager_t>
-      shm_trace_alloc_t;
-  typedef ipc::list<element_value_type, shm_trace_alloc_t> trace_t;
+  typedef ChunkedTrace trace_t;
   typedef std::list<element_value_type> mocked_trace_t;
   typedef mocked_trace_t heap_trace_t;
 
-  // The allocators are managed by the container itself, but the shared
+  // The chunks are allocated by the container itself, but the shared
   // memory pointer is provided by a `Writer` or `Reader`
   ipc::managed_shared_memory *shm = nullptr;
 
-  std::unique_ptr<shared_data_mutex_t> traces_mutex;
-
-  shm_trace_alloc_t inner_trace_alloc;
+  TestcaseSlots slots;
 
   Container() = delete;
   Container(const Container &) = delete;
@@ -130,39 +671,341 @@ struct Container {
 
   Container(ipc::managed_shared_memory *shm, segment_manager_t *seg_mgr);
 
-  // Add an element in its trace. If the trace doesn't exist, it gets created
-  // and its status is set to E_ACTIVE
+  // Add an element in its trace. If the trace doesn't exist, it gets created.
+  // The elements are dropped if the slot of the testcase stays busy.
   void add(const key_type testcase_id, const element_value_type trace_element);
 
   void add(const key_type testcase_id,
            const std::list<element_value_type> &trace);
 
-  std::string get_trace_name(const key_type testcase_id);
+  // The thread id of the elements is used as their thread index
+  void add(const key_type testcase_id, const element_value_type *elements,
+           const size_t count);
+
+  // Bulk insertion of already encoded records, used by the runtime when it
+  // flushes its per-thread buffers. The spans are appended in order, with a
+  // single claim of the slot.
+  void add(const key_type testcase_id, const TraceSpan *spans,
+           const size_t num_spans);
+
+  // Append one compressed chunk of `num_elements` elements, produced by a
+  // `TraceCompressor`
+  void add_compressed(const key_type testcase_id, const uint8_t *data,
+                      const size_t size, const uint32_t num_elements);
 
   std::string toString();
 
+  // The trace is held for reading until it's given back with `release_trace`
+  // or `remove_trace`. Returns nullptr if it's not (yet) available.
   trace_t *get_trace(const key_type testcase_id);
 
+  void release_trace(const key_type testcase_id);
+
   void remove_trace(const key_type testcase_id);
 
 private:
-  // Get or create the list associated to the testcase_id. This API cannot be
-  // called
-  // directly as it's not protected by a lock.
-  trace_t *get_create_list(const key_type testcase_id);
+  // Claim the slot of the testcase for writing, with its trace created.
+  // Returns nullptr if the slot is busy.
+  TestcaseSlot *acquire_trace(const key_type testcase_id);
+
+  // Copy the records at the end of the trace, allocating chunks as needed.
+  // Records that don't fit in the SHM anymore are dropped.
+  void append(trace_t *trace, const TraceRecord *records, size_t count);
+
+  void destroy_trace(trace_t *trace);
+};
+
+// The edge map of one testcase, as stored in the SHM. `hits` contains
+// bucketed counters (see `bucket_hits`), and `status` the last terminal kind
+// reported by the runtime (E_TERMINATED, E_CRASHED, E_TIMEDOUT).
+struct EdgeMap {
+  TraceKind status = E_UNKNOWN;
+  uint8_t hits[EDGE_MAP_SIZE];
+
+  EdgeMap() { std::memset(hits, 0, sizeof(hits)); }
+  EdgeMap(const EdgeMap &) = delete;
+  EdgeMap &operator=(const EdgeMap &) = delete;
+};
+
+// Counterpart of `Container` for the E_TRACE_MODE_EDGE_MAP mode. Each
+// testcase gets a fixed-size map instead of a list, so the fuzzer can score
+// it in constant time. The maps have their own slot table.
+struct EdgeMapContainer {
+  typedef unsigned long key_type; // testcase id
+  typedef EdgeMap edge_map_t;
+
+  ipc::managed_shared_memory *shm = nullptr;
+
+  TestcaseSlots slots;
+
+  EdgeMapContainer() = delete;
+  EdgeMapContainer(const EdgeMapContainer &) = delete;
+  EdgeMapContainer &operator=(const EdgeMapContainer &) = delete;
+  ~EdgeMapContainer() = default;
+
+  EdgeMapContainer(ipc::managed_shared_memory *shm);
+
+  // Store the raw (non-bucketed) hit counters of a testcase. The counters
+  // are cumulative in the runtime, so this overwrites the previous map.
+  // Nothing is stored if the SHM is full.
+  void add(const key_type testcase_id, const uint8_t *raw_hits,
+           const TraceKind status = E_UNKNOWN);
+
+  // Same protocol as `Container::get_trace`
+  edge_map_t *get_map(const key_type testcase_id);
+
+  void release_map(const key_type testcase_id);
+
+  void remove_map(const key_type testcase_id);
+};
+
+// When set to 1, the runtime logs the operands of the integer comparisons of
+// the SUT (`__coverage_cmp`), published with the trace of each testcase
+#define ENV_CMP_LOG "COVERAGE_FUZZING_CMP_LOG"
+
+// Distinct comparisons kept per testcase, and per comparison site
+#define CMP_LOG_SIZE 256
+#define CMP_LOG_MAX_PER_SITE 8
+
+// The operands of an integer comparison, zero-extended. `width` is the size
+// of the compared type in bytes (1, 2, 4 or 8).
+struct CmpOperands {
+  uint32_t func_id;
+  uint32_t block_id;
+  uint64_t lhs;
+  uint64_t rhs;
+  uint32_t width;
+};
+
+// The distinct comparisons of one testcase whose operands differed, in
+// order of first appearance
+struct CmpLog {
+  uint32_t size = 0;
+  CmpOperands entries[CMP_LOG_SIZE];
+
+  CmpLog() = default;
+  CmpLog(const CmpLog &) = delete;
+  CmpLog &operator=(const CmpLog &) = delete;
+};
+
+// The comparison logs of the testcases, with their own slot table. Same
+// protocol as `EdgeMapContainer`.
+struct CmpLogContainer {
+  typedef unsigned long key_type; // testcase id
+  typedef CmpLog cmp_log_t;
+
+  ipc::managed_shared_memory *shm = nullptr;
+
+  TestcaseSlots slots;
+
+  CmpLogContainer() = delete;
+  CmpLogContainer(const CmpLogContainer &) = delete;
+  CmpLogContainer &operator=(const CmpLogContainer &) = delete;
+  ~CmpLogContainer() = default;
+
+  CmpLogContainer(ipc::managed_shared_memory *shm);
+
+  // Overwrite the log of a testcase with `size` (<= CMP_LOG_SIZE) entries
+  void add(const key_type testcase_id, const CmpOperands *entries,
+           const uint32_t size);
+
+  cmp_log_t *get_log(const key_type testcase_id);
+
+  void release_log(const key_type testcase_id);
+
+  void remove_log(const key_type testcase_id);
+};
+
+// Tokens compared by the libc functions intercepted by the preload library
+// (strcmp, strncmp, memcmp and strstr, see preload/), per testcase. Longer
+// buffers are unlikely to be tokens, and are skipped.
+#define TOKEN_MAX_SIZE 32
+#define TOKEN_LOG_SIZE 128
 
-  // A handler that check the current size of the SHM and grows it if we're
-  // approaching full size
-  void update_size();
+struct Token {
+  uint32_t size;
+  uint8_t data[TOKEN_MAX_SIZE];
+};
+
+// The distinct tokens of one testcase, in order of first appearance
+struct TokenLog {
+  uint32_t size = 0;
+  Token entries[TOKEN_LOG_SIZE];
+
+  TokenLog() = default;
+  TokenLog(const TokenLog &) = delete;
+  TokenLog &operator=(const TokenLog &) = delete;
+};
+
+// The token logs of the testcases, with their own slot table. Same protocol
+// as `EdgeMapContainer`, except that the tokens are appended one by one.
+struct TokenLogContainer {
+  typedef unsigned long key_type; // testcase id
+  typedef TokenLog token_log_t;
+
+  ipc::managed_shared_memory *shm = nullptr;
+
+  TestcaseSlots slots;
+
+  TokenLogContainer() = delete;
+  TokenLogContainer(const TokenLogContainer &) = delete;
+  TokenLogContainer &operator=(const TokenLogContainer &) = delete;
+  ~TokenLogContainer() = default;
+
+  TokenLogContainer(ipc::managed_shared_memory *shm);
+
+  // Append a token (truncated to TOKEN_MAX_SIZE) to the log of a testcase.
+  // Returns false when the log is full or busy.
+  bool add(const key_type testcase_id, const uint8_t *data,
+           const uint32_t size);
+
+  token_log_t *get_log(const key_type testcase_id);
+
+  void release_log(const key_type testcase_id);
+
+  void remove_log(const key_type testcase_id);
+};
+
+// Maximum size of an input given to a process running in persistent mode
+#define PERSISTENT_INPUT_MAX_SIZE (1 << 20)
+
+// The input of the current testcase of a persistent process, written by the
+// fuzzer before each request (see runtime/persistent-main.cpp).
+struct PersistentInput {
+  uint32_t size = 0;
+  uint8_t data[PERSISTENT_INPUT_MAX_SIZE];
+
+  PersistentInput() = default;
+  PersistentInput(const PersistentInput &) = delete;
+  PersistentInput &operator=(const PersistentInput &) = delete;
+};
+
+// Each persistent process gets an `input_\d+` buffer, named by its pid. There
+// is a single writer (the fuzzer) and a single reader (the process), and they
+// take turns through the fork server pipes, so there's no locking.
+struct PersistentInputContainer {
+  typedef uint32_t key_type; // pid of the persistent process
+  typedef PersistentInput input_t;
+
+  ipc::managed_shared_memory *shm = nullptr;
+
+  PersistentInputContainer() = delete;
+  PersistentInputContainer(const PersistentInputContainer &) = delete;
+  PersistentInputContainer &operator=(const PersistentInputContainer &) =
+      delete;
+  ~PersistentInputContainer() = default;
+
+  PersistentInputContainer(ipc::managed_shared_memory *shm) : shm(shm) {}
+
+  std::string get_input_name(const key_type pid);
+
+  // Get or create the buffer of the process
+  input_t *get_create_input(const key_type pid);
+
+  input_t *get_input(const key_type pid);
+
+  void remove_input(const key_type pid);
+};
+
+// Capacity of the thread rings of the runtime, in records. Must be a power of
+// 2.
+#define PENDING_RING_CAPACITY 4096
+
+// A process has one ring per thread index, plus the overflow one
+#define PENDING_MAX_RINGS (TRACE_RECORD_MAX_THREAD + 1)
+
+// A thread ring of the runtime, in the SHM so the records that are not
+// flushed yet survive the process. `head` is only written by the thread that
+// owns the ring, and `tail` by the flushes.
+struct PendingRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  TraceRecord records[PENDING_RING_CAPACITY];
+
+  PendingRing() : head(0), tail(0) {}
+  PendingRing(const PendingRing &) = delete;
+  PendingRing &operator=(const PendingRing &) = delete;
+};
+
+// What a runtime process hasn't flushed yet: its rings, and its edge counters
+// in E_TRACE_MODE_EDGE_MAP. The crash and timeout handlers of the runtime only
+// publish `status` (E_CRASHED or E_TIMEDOUT), which is async-signal-safe, and
+// die. Once the process is dead, the fuzzer salvages the records into the
+// trace of `testcase_id` (or the edge map), followed by `status`. A process
+// that terminates normally flushes everything and sets E_TERMINATED.
+struct PendingTrace {
+  std::atomic<uint32_t> status;
+  std::atomic<uint64_t> testcase_id;
+  ipc::offset_ptr<uint8_t> edge_hits; // EDGE_MAP_SIZE raw counters
+  ipc::offset_ptr<PendingRing> rings[PENDING_MAX_RINGS];
+
+  PendingTrace(const uint64_t testcase_id)
+      : status(E_UNKNOWN), testcase_id(testcase_id), edge_hits(nullptr) {
+    for (size_t i = 0; i < PENDING_MAX_RINGS; i++)
+      rings[i] = nullptr;
+  }
+  PendingTrace(const PendingTrace &) = delete;
+  PendingTrace &operator=(const PendingTrace &) = delete;
+};
+
+// The `pending_\d+` trace of each runtime process, named by its pid. The
+// process creates it when it starts (and the children of the fork server
+// create their own), the fuzzer destroys it once the process is dead.
+struct PendingTraceContainer {
+  typedef int32_t key_type; // pid of the runtime process
+  typedef PendingTrace pending_t;
+
+  ipc::managed_shared_memory *shm = nullptr;
+
+  PendingTraceContainer() = delete;
+  PendingTraceContainer(const PendingTraceContainer &) = delete;
+  PendingTraceContainer &operator=(const PendingTraceContainer &) = delete;
+  ~PendingTraceContainer() = default;
+
+  PendingTraceContainer(ipc::managed_shared_memory *shm) : shm(shm) {}
+
+  std::string get_pending_name(const key_type pid);
+
+  // Runtime side. A leftover of a dead process with the same pid is replaced,
+  // after moving what the fuzzer didn't salvage yet into `container` and
+  // `edge_maps`. Returns nullptr if the SHM is full.
+  pending_t *create_pending(const key_type pid, const uint64_t testcase_id,
+                            Container *container, EdgeMapContainer *edge_maps);
+
+  // Allocate the ring `index` of a pending trace. Returns nullptr if the SHM
+  // is full.
+  PendingRing *create_ring(pending_t *pending, const uint32_t index);
+
+  // Allocate the edge counters of a pending trace
+  uint8_t *create_edge_hits(pending_t *pending);
+
+  // Fuzzer side. If the process is dead, move what it didn't flush for
+  // `testcase_id` in its trace or edge map and destroy its pending trace.
+  // With null containers, the pending trace is only destroyed. Returns false
+  // if the process is still running with something to salvage.
+  bool salvage(const key_type pid, const uint64_t testcase_id,
+               Container *container, EdgeMapContainer *edge_maps);
+
+  void remove_pending(const key_type pid);
+
+private:
+  void move_records(pending_t *pending, Container *container,
+                    EdgeMapContainer *edge_maps);
 };
 
 // The writer is embedded in the runtime, so it can only create the SHM or
 // write
 // to it, it doesn't remove it when the program terminates (since it's still
-// used by the fuzzer).
+// used by the fuzzer). If it can't attach, `segment` and the containers are
+// null.
 struct SHMRuntimeWriter {
   ipc::managed_shared_memory *segment = nullptr;
   Container *container = nullptr;
+  EdgeMapContainer *edge_maps = nullptr;
+  CmpLogContainer *cmp_logs = nullptr;
+  TokenLogContainer *token_logs = nullptr;
+  PersistentInputContainer *inputs = nullptr;
+  PendingTraceContainer *pending = nullptr;
 
   SHMRuntimeWriter() { create_shm(); }
 
@@ -173,6 +1016,21 @@ struct SHMRuntimeWriter {
     if (container) {
       delete container;
     }
+    if (edge_maps) {
+      delete edge_maps;
+    }
+    if (cmp_logs) {
+      delete cmp_logs;
+    }
+    if (token_logs) {
+      delete token_logs;
+    }
+    if (inputs) {
+      delete inputs;
+    }
+    if (pending) {
+      delete pending;
+    }
     if (segment) {
       delete segment;
     }
@@ -181,6 +1039,8 @@ struct SHMRuntimeWriter {
 private:
   void create_shm();
 
+  bool try_open_shm();
+
   void try_create_shm();
 
   bool exists(bool open_only_flag = true);
@@ -193,17 +1053,25 @@ struct SHMFuzzerHandler {
   bool cleanup = true;
   ipc::managed_shared_memory *segment = nullptr;
   Container *container = nullptr;
+  EdgeMapContainer *edge_maps = nullptr;
+  CmpLogContainer *cmp_logs = nullptr;
+  TokenLogContainer *token_logs = nullptr;
+  PersistentInputContainer *inputs = nullptr;
+  PendingTraceContainer *pending = nullptr;
 
   SHMFuzzerHandler(const SHMFuzzerHandler &) = delete;
 
   SHMFuzzerHandler(bool cleanup = false, bool remove_mutexes = true);
 
-  void update_size();
   void force_remove_mutexes();
 
-  size_t red_free_size();
+  // Less than 25% of the segment is free. The traces are freed as soon as
+  // the fuzzer ingests them, so the fuzzer should wait for the pending ones
+  // before spawning more processes.
+  bool red_free_size();
   bool is_sane();
   size_t free_size();
+  size_t size();
 
   ~SHMFuzzerHandler();
 };
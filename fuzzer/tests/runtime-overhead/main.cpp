@@ -0,0 +1,97 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "runtime/runtime.h"
+
+// Measures the cost of one edge event in the instrumentation runtime, that is
+// the cost of what the instrumented code pays on every `__coverage_reach_block`.
+// Run it against two revisions of `libinstr-runtime.a` to compare them, with
+// `inline` to measure the inline counters of the instrumentation instead, or
+// with `function` and `block` for the calls of the other levels:
+//   smoke-runtime-overhead <num_threads> <num_edges_per_thread>
+//                          [edge|block|function|inline]
+// The edges are made by calls to a function of BENCH_FUNC_BLOCKS blocks.
+
+#define DEFAULT_NUM_THREADS 4
+#define DEFAULT_NUM_EDGES 2000000
+
+static const unsigned long BENCH_FUNC_ID = 42;
+static const unsigned int BENCH_FUNC_BLOCKS = 16;
+
+enum BenchMode { M_EDGE, M_BLOCK, M_FUNCTION, M_INLINE };
+
+static const char *mode_names[] = {"edge", "block", "function", "inline"};
+
+// What the instrumentation inserts in each block at each level
+void emit_edges(const uint64_t num_edges, const BenchMode mode) {
+  unsigned int pred_block = 0;
+  for (uint64_t i = 0; i < num_edges; i++) {
+    const unsigned int cur_block = (unsigned int)(i % BENCH_FUNC_BLOCKS) + 1;
+    if (cur_block == 1) {
+      __coverage_enter_func(BENCH_FUNC_ID);
+      pred_block = 0;
+    }
+    if (mode == M_INLINE) {
+      // What `__coverage_count_edge` does in the instrumented code
+      unsigned char *hits =
+          __coverage_edge_map +
+          shm::edge_index(BENCH_FUNC_ID, pred_block, cur_block);
+      *hits += *hits != 0xff;
+    } else if (mode == M_BLOCK) {
+      __coverage_reach_block(BENCH_FUNC_ID, 0, cur_block);
+    } else if (mode == M_EDGE) {
+      __coverage_reach_block(BENCH_FUNC_ID, pred_block, cur_block);
+    }
+    pred_block = cur_block;
+    if (cur_block == BENCH_FUNC_BLOCKS)
+      __coverage_exit_func(BENCH_FUNC_ID);
+  }
+  if (num_edges % BENCH_FUNC_BLOCKS)
+    __coverage_exit_func(BENCH_FUNC_ID);
+}
+
+int main(int argc, char *argv[]) {
+  const uint32_t num_threads =
+      argc > 1 ? std::strtoul(argv[1], nullptr, 10) : DEFAULT_NUM_THREADS;
+  const uint64_t num_edges =
+      argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_NUM_EDGES;
+  BenchMode mode = M_EDGE;
+  for (int m = M_EDGE; argc > 3 && m <= M_INLINE; m++) {
+    if (std::string(argv[3]) == mode_names[m])
+      mode = (BenchMode)m;
+  }
+
+  // Make sure the runtime is attached to the shared memory before measuring
+  __coverage_enter_func(BENCH_FUNC_ID);
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < num_threads; t++) {
+    threads.push_back(std::thread(emit_edges, num_edges, mode));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+  const double elapsed_ns =
+      std::chrono::duration<double, std::nano>(end - start).count();
+  const double total_edges = (double)num_threads * (double)num_edges;
+
+  cout << mode_names[mode] << " threads=" << num_threads
+       << " edges/thread=" << num_edges
+       << " ns/edge=" << (elapsed_ns / total_edges)
+       << " ns/edge/thread=" << (elapsed_ns * num_threads / total_edges)
+       << endl;
+
+  __coverage_exit_func(BENCH_FUNC_ID);
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+// Compares the SHM footprint and the throughput of a trace written as records
+// and as compressed chunks (ENV_TRACE_COMPRESSION). The trace is shaped like a
+// deep loop: a loop body of a few branches that calls a function now and
+// then. Every compressed trace is checked against the original.
+//   smoke-trace-compression <num_elements> <loop_body_size>
+
+#define DEFAULT_NUM_ELEMENTS 10000000
+#define DEFAULT_LOOP_BODY_SIZE 6
+#define FLUSH_SIZE 4096
+#define COMPRESSED_CHUNK_SIZE 16384
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static double seconds_since(const bench_clock_t::time_point &start) {
+  return std::chrono::duration<double>(bench_clock_t::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t num_elements =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_NUM_ELEMENTS;
+  const uint32_t body_size =
+      argc > 2 ? (uint32_t)std::strtoul(argv[2], nullptr, 10)
+               : DEFAULT_LOOP_BODY_SIZE;
+
+  std::vector<TraceElement> elements;
+  elements.reserve(num_elements);
+  const uint32_t loop_func = 5000, callee_func = 9000;
+  uint64_t iteration = 0;
+  while (elements.size() < num_elements) {
+    for (uint32_t b = 0; b < body_size; b++) {
+      elements.push_back(TraceElement(b % 3 ? E_TRUE_BRANCH : E_FALSE_BRANCH,
+                                      0, loop_func, loop_func + 1 + b,
+                                      loop_func + 2 + b));
+    }
+    if (++iteration % 100 == 0) {
+      elements.push_back(TraceElement(E_ENTER_FUNCTION, 0, callee_func));
+      elements.push_back(TraceElement(E_TRUE_BRANCH, 0, callee_func,
+                                      callee_func + 1,
+                                      callee_func + 2 + iteration % 7));
+      elements.push_back(TraceElement(E_EXIT_FUNCTION, 0, callee_func));
+    }
+  }
+  elements.resize(num_elements);
+
+  SHMFuzzerHandler reader(/*cleanup*/ true);
+  SHMRuntimeWriter writer;
+  std::vector<uint8_t> buffer(COMPRESSED_CHUNK_SIZE);
+  TraceCompressor compressor(buffer.data(), buffer.size());
+
+  // Records, as written by the runtime
+  auto start = bench_clock_t::now();
+  for (uint64_t done = 0; done < num_elements; done += FLUSH_SIZE) {
+    writer.container->add(1, elements.data() + done,
+                          std::min<uint64_t>(FLUSH_SIZE, num_elements - done));
+  }
+  const double records_seconds = seconds_since(start);
+
+  // Compressed, one flush at a time
+  start = bench_clock_t::now();
+  for (uint64_t done = 0; done < num_elements; done += FLUSH_SIZE) {
+    const uint64_t end = std::min<uint64_t>(done + FLUSH_SIZE, num_elements);
+    for (uint64_t i = done; i < end;) {
+      if (compressor.add(elements[i])) {
+        i++;
+        continue;
+      }
+      writer.container->add_compressed(2, compressor.out, compressor.size,
+                                       compressor.num_elements);
+      compressor.reset();
+    }
+    compressor.finish();
+    writer.container->add_compressed(2, compressor.out, compressor.size,
+                                     compressor.num_elements);
+    compressor.reset();
+  }
+  const double compress_seconds = seconds_since(start);
+
+  Container::trace_t *records = reader.container->get_trace(1);
+  Container::trace_t *compressed = reader.container->get_trace(2);
+  if (!records || !compressed) {
+    cerr << "Cannot retrieve the traces" << endl;
+    return 1;
+  }
+
+  start = bench_clock_t::now();
+  uint64_t checksum = 0;
+  records->for_each_element([&](const TraceElement &element) {
+    checksum += element.func_id + element.cur_block_id;
+  });
+  const double records_scan_seconds = seconds_since(start);
+
+  start = bench_clock_t::now();
+  uint64_t decoded = 0, mismatches = 0;
+  compressed->for_each_element([&](const TraceElement &element) {
+    if (decoded >= num_elements || !(element == elements[decoded]))
+      mismatches++;
+    decoded++;
+  });
+  const double compressed_scan_seconds = seconds_since(start);
+
+  uint64_t iterated = 0;
+  for (const TraceElement &element : *compressed) {
+    if (iterated >= num_elements || !(element == elements[iterated]))
+      mismatches++;
+    iterated++;
+  }
+
+  const double total = (double)num_elements;
+  cout << "elements=" << num_elements << " loop_body=" << body_size
+       << " records: bytes/element="
+       << (double)records->num_bytes() / total
+       << " write=" << (uint64_t)(total / records_seconds) << " elements/s"
+       << " scan=" << (uint64_t)(total / records_scan_seconds) << " elements/s"
+       << " | compressed: bytes/element="
+       << (double)compressed->num_bytes() / total
+       << " write=" << (uint64_t)(total / compress_seconds) << " elements/s"
+       << " scan=" << (uint64_t)(total / compressed_scan_seconds)
+       << " elements/s (checksum=" << checksum << ")" << endl;
+
+  reader.container->remove_trace(1);
+  reader.container->remove_trace(2);
+
+  if (decoded != num_elements || iterated != num_elements || mismatches) {
+    cerr << "Compressed trace differs: decoded=" << decoded
+         << " iterated=" << iterated << " mismatches=" << mismatches << endl;
+    return 1;
+  }
+  return 0;
+}
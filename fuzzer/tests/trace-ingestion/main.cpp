@@ -0,0 +1,73 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+// Measures how fast the fuzzer can ingest a trace from the shared memory: the
+// runtime flushes `num_elements` elements in bulk (as its rings do), then the
+// fuzzer scans the whole trace. Run it against two revisions of
+// `libshared-data` to compare them:
+//   smoke-trace-ingestion <num_testcases> <num_elements_per_testcase>
+
+#define DEFAULT_NUM_TESTCASES 20
+#define DEFAULT_NUM_ELEMENTS 1000000
+#define FLUSH_SIZE 4096
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static double seconds_since(const bench_clock_t::time_point &start) {
+  return std::chrono::duration<double>(bench_clock_t::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t num_testcases =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_NUM_TESTCASES;
+  const uint64_t num_elements =
+      argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_NUM_ELEMENTS;
+
+  SHMFuzzerHandler reader(/*cleanup*/ true);
+  SHMRuntimeWriter writer;
+
+  std::vector<TraceElement> buffer(FLUSH_SIZE);
+  for (size_t i = 0; i < FLUSH_SIZE; i++) {
+    buffer[i] = TraceElement(E_TRUE_BRANCH, 1, 42, i & 0xff, (i + 1) & 0xff);
+  }
+
+  double write_seconds = 0, scan_seconds = 0;
+  uint64_t checksum = 0, scanned = 0;
+
+  for (uint64_t testcase_id = 1; testcase_id <= num_testcases; testcase_id++) {
+    auto start = bench_clock_t::now();
+    for (uint64_t done = 0; done < num_elements; done += FLUSH_SIZE) {
+      const size_t count = std::min<uint64_t>(FLUSH_SIZE, num_elements - done);
+      writer.container->add(testcase_id, buffer.data(), count);
+    }
+    write_seconds += seconds_since(start);
+
+    start = bench_clock_t::now();
+    Container::trace_t *trace = reader.container->get_trace(testcase_id);
+    if (!trace) {
+      cerr << "Cannot retrieve trace " << testcase_id << endl;
+      return 1;
+    }
+    for (const TraceElement &element : *trace) {
+      checksum += element.func_id + element.pred_block_id + element.cur_block_id;
+      scanned++;
+    }
+    scan_seconds += seconds_since(start);
+    reader.container->remove_trace(testcase_id);
+  }
+
+  const double total = (double)num_testcases * (double)num_elements;
+  cout << "testcases=" << num_testcases << " elements/testcase=" << num_elements
+       << " write=" << (uint64_t)(total / write_seconds) << " elements/s"
+       << " ingest=" << (uint64_t)(scanned / scan_seconds) << " elements/s"
+       << " (checksum=" << checksum << ")" << endl;
+  return 0;
+}
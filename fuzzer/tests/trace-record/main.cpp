@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+#include "shared-data/shared-data.h"
+using namespace shm;
+
+// Throughput of the packed trace record codec: encodes a synthetic trace
+// shaped like what the runtime records (function boundaries and branches
+// between the internal CFG block ids of the functions, with a few extended
+// elements from a huge function), then decodes it.
+//   smoke-trace-record <num_elements> <num_rounds>
+
+#define DEFAULT_NUM_ELEMENTS 1000000
+#define DEFAULT_NUM_ROUNDS 20
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static double seconds_since(const bench_clock_t::time_point &start) {
+  return std::chrono::duration<double>(bench_clock_t::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t num_elements =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_NUM_ELEMENTS;
+  const uint64_t num_rounds =
+      argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_NUM_ROUNDS;
+
+  std::vector<TraceElement> elements;
+  elements.reserve(num_elements);
+  for (uint64_t i = 0; i < num_elements; i++) {
+    const uint32_t func_id = 42 + (uint32_t)(i / 64) % 500 * 100;
+    // The CFG numbers the blocks backward from the entry
+    const uint32_t block = 64 - (uint32_t)(i % 64);
+    if (block == 64) {
+      elements.push_back(TraceElement(E_ENTER_FUNCTION, 0, func_id));
+    } else if (i % 1000 == 1) {
+      // a block id too large for a compact record: extended element
+      elements.push_back(
+          TraceElement(E_FALSE_BRANCH, 0, func_id, 5002, 5000));
+    } else {
+      elements.push_back(
+          TraceElement(E_TRUE_BRANCH, 0, func_id, block + 2, block));
+    }
+  }
+
+  std::vector<TraceRecord> records(2 * num_elements);
+  size_t num_records = 0;
+  double encode_seconds = 0, decode_seconds = 0;
+  uint64_t checksum = 0;
+
+  for (uint64_t round = 0; round < num_rounds; round++) {
+    auto start = bench_clock_t::now();
+    num_records = 0;
+    for (const TraceElement &element : elements) {
+      num_records += encode_trace_record(element, (uint32_t)round & 0xf,
+                                         records.data() + num_records);
+    }
+    encode_seconds += seconds_since(start);
+
+    start = bench_clock_t::now();
+    TraceElement decoded;
+    size_t offset = 0;
+    while (size_t length = decode_trace_record(
+               records.data() + offset, num_records - offset, decoded)) {
+      checksum += decoded.func_id + decoded.cur_block_id + decoded.thread_id;
+      offset += length;
+    }
+    decode_seconds += seconds_since(start);
+  }
+
+  const double total = (double)num_elements * (double)num_rounds;
+  cout << "elements=" << num_elements << " rounds=" << num_rounds
+       << " bytes/element=" << (double)(num_records * sizeof(TraceRecord)) /
+                                   (double)num_elements
+       << " (vs " << sizeof(TraceElement) << ")"
+       << " encode=" << (uint64_t)(total / encode_seconds) << " elements/s"
+       << " decode=" << (uint64_t)(total / decode_seconds) << " elements/s"
+       << " (checksum=" << checksum << ")" << endl;
+  return 0;
+}